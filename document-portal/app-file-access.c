@@ -0,0 +1,576 @@
+/*
+ * Copyright © 2026 The xdg-desktop-portal authors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Evaluates the filesystem access of a flatpak app from its metadata
+ * and overrides, the way "flatpak info --file-access" does, without
+ * having to spawn flatpak for every file. */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "app-file-access.h"
+#include "src/xdp-utils.h"
+
+#define MAX_CACHED_RESULTS 1024
+
+/* Files that make up the context of an app, in the order they are
+ * merged: the app metadata, then the system and the user overrides.
+ * Like flatpak run, we prefer the user installation of the app. */
+enum {
+  APP_FILE_USER_METADATA,
+  APP_FILE_SYSTEM_METADATA,
+  APP_FILE_SYSTEM_GLOBAL_OVERRIDE,
+  APP_FILE_SYSTEM_OVERRIDE,
+  APP_FILE_USER_GLOBAL_OVERRIDE,
+  APP_FILE_USER_OVERRIDE,
+  N_APP_FILES
+};
+
+typedef struct {
+  gboolean exists;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+} FileStamp;
+
+typedef struct {
+  char *path;
+  AppFileAccess access;
+  gboolean is_host; /* Doesn't apply to the reserved directories */
+} AccessRule;
+
+typedef struct {
+  char *files[N_APP_FILES];
+  FileStamp stamps[N_APP_FILES];
+  gboolean has_metadata;
+  GPtrArray *rules;
+  GHashTable *rule_paths;
+  GHashTable *results; /* directory -> AppFileAccess */
+} AppEntry;
+
+G_LOCK_DEFINE_STATIC (app_file_access);
+static GHashTable *apps = NULL; /* app id -> AppEntry */
+
+/* Not exported by filesystem=host */
+static const char *host_reserved_dirs[] = {
+  "/app", "/bin", "/boot", "/dev", "/etc", "/lib", "/lib32", "/lib64",
+  "/proc", "/root", "/run", "/sbin", "/sys", "/tmp", "/usr", "/var",
+  NULL
+};
+
+/* Never exported, even if asked for explicitly */
+static const char *forbidden_dirs[] = {
+  "/app", "/bin", "/dev", "/etc", "/lib", "/lib32", "/lib64", "/proc",
+  "/root", "/run/flatpak", "/run/host", "/sbin", "/sys", "/usr",
+  NULL
+};
+
+static const struct {
+  const char *name;
+  GUserDirectory dir;
+} xdg_user_dirs[] = {
+  { "xdg-desktop", G_USER_DIRECTORY_DESKTOP },
+  { "xdg-documents", G_USER_DIRECTORY_DOCUMENTS },
+  { "xdg-download", G_USER_DIRECTORY_DOWNLOAD },
+  { "xdg-music", G_USER_DIRECTORY_MUSIC },
+  { "xdg-pictures", G_USER_DIRECTORY_PICTURES },
+  { "xdg-public-share", G_USER_DIRECTORY_PUBLIC_SHARE },
+  { "xdg-templates", G_USER_DIRECTORY_TEMPLATES },
+  { "xdg-videos", G_USER_DIRECTORY_VIDEOS },
+};
+
+static void
+access_rule_free (AccessRule *rule)
+{
+  g_free (rule->path);
+  g_free (rule);
+}
+
+static void
+app_entry_free (AppEntry *entry)
+{
+  int i;
+
+  for (i = 0; i < N_APP_FILES; i++)
+    g_free (entry->files[i]);
+  g_clear_pointer (&entry->rules, g_ptr_array_unref);
+  g_clear_pointer (&entry->rule_paths, g_hash_table_unref);
+  g_clear_pointer (&entry->results, g_hash_table_unref);
+  g_free (entry);
+}
+
+static void
+file_stamp_init (FileStamp  *stamp,
+                 const char *path)
+{
+  struct stat st_buf;
+
+  memset (stamp, 0, sizeof (FileStamp));
+
+  if (stat (path, &st_buf) != 0)
+    return;
+
+  stamp->exists = TRUE;
+  stamp->dev = st_buf.st_dev;
+  stamp->ino = st_buf.st_ino;
+  stamp->size = st_buf.st_size;
+  stamp->mtime = st_buf.st_mtim;
+}
+
+static gboolean
+file_stamp_equal (const FileStamp *a,
+                  const FileStamp *b)
+{
+  if (a->exists != b->exists)
+    return FALSE;
+
+  if (!a->exists)
+    return TRUE;
+
+  return a->dev == b->dev &&
+         a->ino == b->ino &&
+         a->size == b->size &&
+         a->mtime.tv_sec == b->mtime.tv_sec &&
+         a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static gboolean
+path_in_dirs (const char  *path,
+              const char **dirs)
+{
+  int i;
+
+  for (i = 0; dirs[i] != NULL; i++)
+    {
+      if (xdp_has_path_prefix (path, dirs[i]))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Parses a filesystems entry like "!xdg-download/foo:ro" */
+static char *
+parse_filesystem (const char     *fs,
+                  gboolean       *negated,
+                  gboolean       *reset,
+                  AppFileAccess  *access)
+{
+  g_autofree char *name = NULL;
+  char *suffix;
+  gsize len;
+
+  *negated = fs[0] == '!';
+  if (*negated)
+    fs++;
+
+  *reset = FALSE;
+  *access = APP_FILE_ACCESS_READ_WRITE;
+
+  name = g_strdup (fs);
+
+  suffix = strrchr (name, ':');
+  if (suffix != NULL)
+    {
+      if (strcmp (suffix, ":ro") == 0)
+        *access = APP_FILE_ACCESS_READ_ONLY;
+      else if (strcmp (suffix, ":reset") == 0)
+        {
+          /* Like flatpak, only accept this as "!host:reset" */
+          if (!*negated)
+            return NULL;
+          *reset = TRUE;
+        }
+      else if (strcmp (suffix, ":rw") != 0 && strcmp (suffix, ":create") != 0)
+        return NULL;
+
+      *suffix = 0;
+    }
+
+  len = strlen (name);
+  while (len > 1 && name[len - 1] == '/')
+    name[--len] = 0;
+
+  if (len == 0)
+    return NULL;
+
+  return g_steal_pointer (&name);
+}
+
+static void
+merge_keyfile (GHashTable *filesystems,
+               const char *path)
+{
+  g_autoptr(GKeyFile) keyfile = NULL;
+  g_auto(GStrv) fss = NULL;
+  int i;
+
+  keyfile = g_key_file_new ();
+  if (!g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, NULL))
+    return;
+
+  fss = g_key_file_get_string_list (keyfile, "Context", "filesystems", NULL, NULL);
+  if (fss == NULL)
+    return;
+
+  for (i = 0; fss[i] != NULL; i++)
+    {
+      g_autofree char *name = NULL;
+      gboolean negated, reset;
+      AppFileAccess access;
+
+      name = parse_filesystem (fss[i], &negated, &reset, &access);
+      if (name == NULL)
+        continue;
+
+      if (reset)
+        g_hash_table_remove_all (filesystems);
+      else if (negated)
+        g_hash_table_remove (filesystems, name);
+      else
+        g_hash_table_insert (filesystems, g_steal_pointer (&name), GINT_TO_POINTER (access));
+    }
+}
+
+/* Returns the host directory a filesystems entry refers to, or NULL if
+ * it doesn't refer to one that is exported at the same path. */
+static char *
+resolve_filesystem (const char *name)
+{
+  g_autofree char *base = NULL;
+  const char *rest = NULL;
+  char *resolved;
+  const char *home = g_get_home_dir ();
+  int i;
+
+  if (strcmp (name, "home") == 0 || strcmp (name, "~") == 0)
+    base = g_strdup (home);
+  else if (g_str_has_prefix (name, "~/"))
+    {
+      base = g_strdup (home);
+      rest = name + 2;
+    }
+  else if (name[0] == '/')
+    base = g_strdup (name);
+  else
+    {
+      g_autofree char *prefix = NULL;
+      const char *slash = strchr (name, '/');
+
+      prefix = g_strndup (name, slash ? slash - name : strlen (name));
+      if (slash)
+        rest = slash + 1;
+
+      if (strcmp (prefix, "xdg-config") == 0)
+        base = g_strdup (g_get_user_config_dir ());
+      else if (strcmp (prefix, "xdg-cache") == 0)
+        base = g_strdup (g_get_user_cache_dir ());
+      else if (strcmp (prefix, "xdg-data") == 0)
+        base = g_strdup (g_get_user_data_dir ());
+      else if (strcmp (prefix, "xdg-run") == 0)
+        {
+          /* Only subdirectories of the runtime dir are exported */
+          if (rest == NULL)
+            return NULL;
+          base = g_strdup (g_get_user_runtime_dir ());
+        }
+      else
+        {
+          for (i = 0; i < G_N_ELEMENTS (xdg_user_dirs); i++)
+            {
+              const char *dir;
+
+              if (strcmp (prefix, xdg_user_dirs[i].name) != 0)
+                continue;
+
+              /* flatpak ignores unset user dirs, which point to $HOME */
+              dir = g_get_user_special_dir (xdg_user_dirs[i].dir);
+              if (dir != NULL && strcmp (dir, home) != 0)
+                base = g_strdup (dir);
+              break;
+            }
+        }
+    }
+
+  if (base == NULL)
+    return NULL;
+
+  if (rest != NULL && *rest != 0)
+    {
+      g_autofree char *joined = g_build_filename (base, rest, NULL);
+      g_free (base);
+      base = g_steal_pointer (&joined);
+    }
+
+  /* Matched against the real paths of the fds we're given */
+  resolved = realpath (base, NULL);
+  if (resolved == NULL)
+    return NULL;
+
+  if (name[0] == '/' &&
+      (strcmp (resolved, "/") == 0 || path_in_dirs (resolved, forbidden_dirs)))
+    {
+      free (resolved);
+      return NULL;
+    }
+
+  return resolved;
+}
+
+static void
+add_rule (AppEntry      *entry,
+          char          *path,
+          AppFileAccess  access,
+          gboolean       is_host)
+{
+  AccessRule *rule = g_new0 (AccessRule, 1);
+
+  rule->path = path;
+  rule->access = access;
+  rule->is_host = is_host;
+
+  g_ptr_array_add (entry->rules, rule);
+  g_hash_table_add (entry->rule_paths, rule->path);
+}
+
+static void
+app_entry_load (AppEntry   *entry,
+                const char *app_id)
+{
+  g_autoptr(GHashTable) filesystems = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+  int i;
+
+  g_clear_pointer (&entry->rules, g_ptr_array_unref);
+  g_clear_pointer (&entry->rule_paths, g_hash_table_unref);
+  g_clear_pointer (&entry->results, g_hash_table_unref);
+
+  entry->rules = g_ptr_array_new_with_free_func ((GDestroyNotify) access_rule_free);
+  entry->rule_paths = g_hash_table_new (g_str_hash, g_str_equal);
+  entry->results = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  for (i = 0; i < N_APP_FILES; i++)
+    file_stamp_init (&entry->stamps[i], entry->files[i]);
+
+  entry->has_metadata = entry->stamps[APP_FILE_USER_METADATA].exists ||
+                        entry->stamps[APP_FILE_SYSTEM_METADATA].exists;
+  if (!entry->has_metadata)
+    return;
+
+  filesystems = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (i = 0; i < N_APP_FILES; i++)
+    {
+      if (i == APP_FILE_SYSTEM_METADATA && entry->stamps[APP_FILE_USER_METADATA].exists)
+        continue;
+      merge_keyfile (filesystems, entry->files[i]);
+    }
+
+  /* Other apps' data is hidden, even with home access */
+  {
+    g_autofree char *var_app = g_build_filename (g_get_home_dir (), ".var/app", NULL);
+    g_autofree char *own_data = g_build_filename (var_app, app_id, NULL);
+    char *path;
+
+    path = realpath (var_app, NULL);
+    if (path != NULL)
+      add_rule (entry, path, APP_FILE_ACCESS_NONE, FALSE);
+
+    path = realpath (own_data, NULL);
+    if (path != NULL)
+      add_rule (entry, path, APP_FILE_ACCESS_READ_WRITE, FALSE);
+  }
+
+  g_hash_table_iter_init (&iter, filesystems);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *name = key;
+      AppFileAccess access = GPOINTER_TO_INT (value);
+      char *path;
+
+      if (strcmp (name, "host") == 0)
+        {
+          /* host implies home, which may be in one of the reserved dirs */
+          add_rule (entry, g_strdup ("/"), access, TRUE);
+          name = "home";
+        }
+
+      path = resolve_filesystem (name);
+      if (path == NULL)
+        continue;
+
+      /* Only keep the most permissive of two entries for the same path */
+      if (g_hash_table_contains (entry->rule_paths, path))
+        {
+          int j;
+
+          for (j = 0; j < entry->rules->len; j++)
+            {
+              AccessRule *rule = g_ptr_array_index (entry->rules, j);
+
+              if (!rule->is_host && strcmp (rule->path, path) == 0)
+                {
+                  rule->access = MAX (rule->access, access);
+                  break;
+                }
+            }
+          free (path);
+          continue;
+        }
+
+      add_rule (entry, g_strdup (path), access, FALSE);
+      free (path);
+    }
+}
+
+static AppFileAccess
+app_entry_evaluate (AppEntry   *entry,
+                    const char *path)
+{
+  AccessRule *best = NULL;
+  gsize best_len = 0;
+  gboolean reserved;
+  int i;
+
+  reserved = path_in_dirs (path, host_reserved_dirs);
+
+  /* The most specific mount wins */
+  for (i = 0; i < entry->rules->len; i++)
+    {
+      AccessRule *rule = g_ptr_array_index (entry->rules, i);
+      gsize len = strlen (rule->path);
+
+      if (rule->is_host && reserved)
+        continue;
+
+      if ((best == NULL || len > best_len) && xdp_has_path_prefix (path, rule->path))
+        {
+          best = rule;
+          best_len = len;
+        }
+    }
+
+  if (best == NULL)
+    return APP_FILE_ACCESS_NONE;
+
+  return best->access;
+}
+
+static AppEntry *
+app_entry_new (const char *app_id)
+{
+  AppEntry *entry = g_new0 (AppEntry, 1);
+  g_autofree char *user_installation = g_build_filename (g_get_user_data_dir (), "flatpak", NULL);
+  const char *system_installation = "/var/lib/flatpak";
+
+  entry->files[APP_FILE_USER_METADATA] = g_build_filename (user_installation, "app", app_id, "current/active/metadata", NULL);
+  entry->files[APP_FILE_SYSTEM_METADATA] = g_build_filename (system_installation, "app", app_id, "current/active/metadata", NULL);
+  entry->files[APP_FILE_SYSTEM_GLOBAL_OVERRIDE] = g_build_filename (system_installation, "overrides", "global", NULL);
+  entry->files[APP_FILE_SYSTEM_OVERRIDE] = g_build_filename (system_installation, "overrides", app_id, NULL);
+  entry->files[APP_FILE_USER_GLOBAL_OVERRIDE] = g_build_filename (user_installation, "overrides", "global", NULL);
+  entry->files[APP_FILE_USER_OVERRIDE] = g_build_filename (user_installation, "overrides", app_id, NULL);
+
+  app_entry_load (entry, app_id);
+
+  return entry;
+}
+
+static gboolean
+app_entry_is_current (AppEntry *entry)
+{
+  int i;
+
+  for (i = 0; i < N_APP_FILES; i++)
+    {
+      FileStamp stamp;
+
+      file_stamp_init (&stamp, entry->files[i]);
+      if (!file_stamp_equal (&stamp, &entry->stamps[i]))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Returns what access the app has to the (canonical) path outside of the
+ * document portal, or APP_FILE_ACCESS_UNKNOWN if the app isn't installed
+ * in one of the default installations. Results are cached per app and
+ * directory, until the metadata or overrides of the app change. */
+AppFileAccess
+app_file_access_lookup (const char *app_id,
+                        const char *path)
+{
+  AppEntry *entry;
+  g_autofree char *dir = NULL;
+  gpointer cached;
+  AppFileAccess access;
+
+  G_LOCK (app_file_access);
+
+  if (apps == NULL)
+    apps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) app_entry_free);
+
+  entry = g_hash_table_lookup (apps, app_id);
+  if (entry == NULL)
+    {
+      entry = app_entry_new (app_id);
+      g_hash_table_insert (apps, g_strdup (app_id), entry);
+    }
+  else if (!app_entry_is_current (entry))
+    {
+      /* The app was installed, updated or its overrides changed */
+      g_hash_table_remove (apps, app_id);
+      entry = app_entry_new (app_id);
+      g_hash_table_insert (apps, g_strdup (app_id), entry);
+    }
+
+  if (!entry->has_metadata)
+    {
+      G_UNLOCK (app_file_access);
+      return APP_FILE_ACCESS_UNKNOWN;
+    }
+
+  /* All entries in a directory have the same access, unless a rule
+   * names one of them, or they are in one of the reserved dirs */
+  dir = g_path_get_dirname (path);
+  if (strcmp (dir, "/") == 0 || g_hash_table_contains (entry->rule_paths, path))
+    {
+      access = app_entry_evaluate (entry, path);
+      G_UNLOCK (app_file_access);
+      return access;
+    }
+
+  if (g_hash_table_lookup_extended (entry->results, dir, NULL, &cached))
+    {
+      G_UNLOCK (app_file_access);
+      return GPOINTER_TO_INT (cached);
+    }
+
+  access = app_entry_evaluate (entry, path);
+
+  if (g_hash_table_size (entry->results) >= MAX_CACHED_RESULTS)
+    g_hash_table_remove_all (entry->results);
+  g_hash_table_insert (entry->results, g_steal_pointer (&dir), GINT_TO_POINTER (access));
+
+  G_UNLOCK (app_file_access);
+
+  return access;
+}
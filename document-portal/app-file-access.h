@@ -0,0 +1,30 @@
+/*
+ * Copyright © 2026 The xdg-desktop-portal authors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+typedef enum {
+  APP_FILE_ACCESS_UNKNOWN,    /* No metadata found for the app */
+  APP_FILE_ACCESS_NONE,
+  APP_FILE_ACCESS_READ_ONLY,
+  APP_FILE_ACCESS_READ_WRITE,
+} AppFileAccess;
+
+AppFileAccess app_file_access_lookup (const char *app_id,
+                                      const char *path);
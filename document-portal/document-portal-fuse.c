@@ -79,6 +79,17 @@
  * To work around this we regularly emit entry invalidation calls
  * to the kernel, which will make it forget the inodes that are
  * only pinned by the dcache.
+ *
+ * Caching can optionally be enabled with xdp_fuse_set_cache_timeout().
+ * In that mode document entries and attributes are handed to the
+ * kernel with a non-zero lifetime and we rely on explicit invalidation
+ * to stay correct: permission changes invalidate every inode of the
+ * affected document domains, and operations that change the tree
+ * through one view of a document (i.e. root/$DOC or
+ * by-app/$APP/$DOC) invalidate the same entries and inodes in all the
+ * other views. Changes done to the backing files outside the fuse
+ * filesystem are only seen once the timeout expires, which is why
+ * this is not the default.
  */
 
 
@@ -94,6 +105,137 @@ static pthread_t fuse_pthread = 0;
 static uid_t my_uid;
 static gid_t my_gid;
 
+/* Kernel cache lifetime (in seconds) of document entries and attributes,
+ * 0 means no caching. */
+static double document_cache_timeout = 0.0;
+
+/* Passthrough needs libfuse 3.16, and a 6.9 kernel at runtime */
+#ifdef FUSE_CAP_PASSTHROUGH
+#define HAVE_FUSE_PASSTHROUGH 1
+#endif
+
+/* 1 if the kernel agreed to passthrough and registering backing
+ * files has not failed with EPERM yet. Access atomically. */
+static int use_passthrough = 0;
+
+/* Number of live objects, for xdp_fuse_get_object_stats(). Access atomically. */
+static gint n_live_inodes;
+static gint n_live_domains;
+static gint n_live_physical_inodes;
+static gint n_live_tempfiles;
+
+/* Per-operation call counts and latencies, only collected if enabled
+ * with xdp_fuse_set_stats_enabled(). Latency bucket i counts calls
+ * that took less than 2^i µs (and at least 2^(i-1) µs), the last
+ * bucket counts everything slower. */
+typedef enum {
+  XDP_FUSE_OP_LOOKUP,
+  XDP_FUSE_OP_GETATTR,
+  XDP_FUSE_OP_SETATTR,
+  XDP_FUSE_OP_OPEN,
+  XDP_FUSE_OP_CREATE,
+  XDP_FUSE_OP_READ,
+  XDP_FUSE_OP_WRITE,
+  XDP_FUSE_OP_FSYNC,
+  XDP_FUSE_OP_FALLOCATE,
+  XDP_FUSE_OP_COPY_FILE_RANGE,
+  XDP_FUSE_OP_LSEEK,
+  XDP_FUSE_OP_FLUSH,
+  XDP_FUSE_OP_RELEASE,
+  XDP_FUSE_OP_FORGET,
+  XDP_FUSE_OP_OPENDIR,
+  XDP_FUSE_OP_READDIR,
+  XDP_FUSE_OP_RELEASEDIR,
+  XDP_FUSE_OP_FSYNCDIR,
+  XDP_FUSE_OP_MKDIR,
+  XDP_FUSE_OP_UNLINK,
+  XDP_FUSE_OP_RENAME,
+  XDP_FUSE_OP_ACCESS,
+  XDP_FUSE_OP_RMDIR,
+  XDP_FUSE_OP_READLINK,
+  XDP_FUSE_OP_SYMLINK,
+  XDP_FUSE_OP_LINK,
+  XDP_FUSE_OP_STATFS,
+  XDP_FUSE_OP_XATTR,
+  XDP_FUSE_OP_LOCK,
+  N_XDP_FUSE_OPS
+} XdpFuseOp;
+
+static const char *xdp_fuse_op_names[N_XDP_FUSE_OPS] = {
+  "lookup",
+  "getattr",
+  "setattr",
+  "open",
+  "create",
+  "read",
+  "write",
+  "fsync",
+  "fallocate",
+  "copy_file_range",
+  "lseek",
+  "flush",
+  "release",
+  "forget",
+  "opendir",
+  "readdir",
+  "releasedir",
+  "fsyncdir",
+  "mkdir",
+  "unlink",
+  "rename",
+  "access",
+  "rmdir",
+  "readlink",
+  "symlink",
+  "link",
+  "statfs",
+  "xattr",
+  "lock",
+};
+
+#define N_LATENCY_BUCKETS 20
+
+typedef struct {
+  guint64 calls;
+  guint64 total_usec;
+  guint64 latency[N_LATENCY_BUCKETS];
+} XdpFuseOpStats;
+
+/* Updated with relaxed 64-bit atomics rather than under a lock, so that
+ * collecting stats doesn't serialize the fuse threads */
+static gboolean op_stats_enabled = FALSE;
+static XdpFuseOpStats op_stats[N_XDP_FUSE_OPS];
+
+typedef struct {
+  XdpFuseOp op;
+  gint64 start;
+} XdpFuseOpTimer;
+
+static void
+xdp_fuse_op_timer_done (XdpFuseOpTimer *timer)
+{
+  XdpFuseOpStats *stats;
+  gint64 elapsed;
+  guint bucket;
+
+  if (timer->start == 0)
+    return;
+
+  elapsed = MAX (g_get_monotonic_time () - timer->start, 0);
+  bucket = elapsed == 0 ? 0 : g_bit_storage (elapsed);
+
+  stats = &op_stats[timer->op];
+  __atomic_fetch_add (&stats->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&stats->total_usec, elapsed, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&stats->latency[MIN (bucket, N_LATENCY_BUCKETS - 1)], 1, __ATOMIC_RELAXED);
+}
+
+/* Times the rest of the enclosing fuse operation */
+#define XDP_FUSE_OP_STATS(op) \
+  G_GNUC_UNUSED __attribute__((cleanup (xdp_fuse_op_timer_done))) \
+  XdpFuseOpTimer G_PASTE (op_timer, __LINE__) = \
+    { op, op_stats_enabled ? g_get_monotonic_time () : 0 }
+
 /* from libfuse */
 #define FUSE_UNKNOWN_INO 0xffffffff
 
@@ -129,7 +271,8 @@ struct _XdpDomain {
    * by_app: by app
    * document: by physical
    */
-  GHashTable *inodes; /* Protected by domain_inodes */
+  GHashTable *inodes; /* Protected by inodes_mutex */
+  GMutex inodes_mutex; /* When nesting, take parent domains first */
 
   /* Below only used for XDP_DOMAIN_DOCUMENT */
 
@@ -140,6 +283,7 @@ struct _XdpDomain {
   guint32 doc_flags;
 
   int doc_queued_invalidate; /* Access atomically, 1 if queued invalidate */
+  gpointer cached_perms; /* Access atomically, see xdp_document_domain_get_permissions() */
 
   /* Below is mutable, protected by mutex */
   GMutex  tempfile_mutex;
@@ -149,13 +293,23 @@ struct _XdpDomain {
 static void xdp_domain_unref (XdpDomain *domain);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (XdpDomain, xdp_domain_unref)
 
-G_LOCK_DEFINE (domain_inodes);
+typedef struct _XdpPhysicalInode XdpPhysicalInode;
 
-typedef struct {
+struct _XdpPhysicalInode {
   gint ref_count; /* atomic */
   DevIno backing_devino;
-  int fd; /* O_PATH fd */
-} XdpPhysicalInode;
+
+  /* Below protected by mutex */
+  GMutex mutex;
+  int fd; /* O_PATH fd, -1 if evicted, use xdp_physical_inode_dup_fd() */
+  gint64 last_used; /* monotonic time of last fd use */
+  /* Where to reopen the fd from after eviction, either name in the
+   * parent directory, or an absolute path. If neither is set the fd
+   * is never evicted. */
+  XdpPhysicalInode *parent;
+  char *name;
+  char *path;
+};
 
 static XdpPhysicalInode *xdp_physical_inode_ref   (XdpPhysicalInode *inode);
 static void              xdp_physical_inode_unref (XdpPhysicalInode *inode);
@@ -194,47 +348,62 @@ struct _XdpInode {
 
 typedef struct {
   int fd;
+  int backing_id; /* > 0 if registered for passthrough */
 } XdpFile;
 
 
+typedef struct {
+  char *name;
+  mode_t mode;
+} XdpDirEntry;
+
 typedef struct {
   DIR *dir;
   struct dirent *entry;
   off_t offset;
 
-  char *dirbuf;
-  gsize dirbuf_size;
+  GArray *entries; /* XdpDirEntry, for buffered (non-physical) dirs */
 } XdpDir;
 
+typedef struct {
+  fuse_ino_t ino;
+  char *filename; /* NULL for inode invalidation */
+} Invalidate;
+
 XdpInode *root_inode;
 XdpInode *by_app_inode;
 
 static XdpInode *xdp_inode_ref (XdpInode *inode);
 static void xdp_inode_unref (XdpInode *inode);
 
+/* The global inode tables are used on every request, so to avoid
+ * serializing all the fuse worker threads on a single lock they are
+ * split into shards, each with its own lock. */
+#define N_INODE_SHARDS 32
+
+typedef struct {
+  GRWLock lock;
+  GHashTable *inodes; /* guint64 -> XdpInode */
+} XdpInodeShard;
+
 /* Lookup by inode for verification */
-static GHashTable *all_inodes; /* guint64 -> XdpInode */
-static guint64 next_virtual_inode = FUSE_ROOT_ID; /* root is the first inode created, so it gets this */
-G_LOCK_DEFINE (all_inodes);
+static XdpInodeShard all_inodes[N_INODE_SHARDS];
+
+static XdpInodeShard *
+all_inodes_shard (guint64 ino)
+{
+  return &all_inodes[(ino ^ (ino >> 32)) % N_INODE_SHARDS];
+}
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (XdpInode, xdp_inode_unref)
 
 static int ensure_docdir_inode (XdpInode *parent,
                                 int o_path_fd_in, /* Takes ownership */
+                                const char *disk_name,
                                 struct fuse_entry_param *e,
                                 XdpInode **inode_out);
-
-static gboolean
-app_can_write_doc (PermissionDbEntry *entry, const char *app_id)
-{
-  if (app_id == NULL)
-    return TRUE;
-
-  if (document_entry_has_permissions_by_app_id (entry, app_id, DOCUMENT_PERMISSION_FLAGS_WRITE))
-    return TRUE;
-
-  return FALSE;
-}
+static void queue_invalidate_other_views (XdpInode   *inode,
+                                          const char *name);
 
 static gboolean
 app_can_see_doc (PermissionDbEntry *entry, const char *app_id)
@@ -391,37 +560,85 @@ devino_equal (gconstpointer  _a,
   return a->ino == b->ino && a->dev == b->dev;
 }
 
+typedef struct {
+  GMutex lock;
+  GHashTable *inodes; /* DevIno -> XdpPhysicalInode */
+} XdpPhysicalInodeShard;
+
 /* Lookup by physical backing devino */
-static GHashTable *physical_inodes;
-G_LOCK_DEFINE (physical_inodes);
+static XdpPhysicalInodeShard physical_inodes[N_INODE_SHARDS];
 
+static XdpPhysicalInodeShard *
+physical_inodes_shard (DevIno *devino)
+{
+  return &physical_inodes[devino_hash (devino) % N_INODE_SHARDS];
+}
+
+
+/* We keep an O_PATH fd open for each physical inode, which for a large
+ * directory document can be a lot of fds. To bound this, once more than
+ * fd_budget are open we close the fds of the least recently used
+ * physical inodes, and reopen them from their last known location when
+ * they are used again.
+ */
+#define DEFAULT_FD_BUDGET 16384
+#define MAX_REOPEN_DEPTH 256
+
+static gint fd_budget = DEFAULT_FD_BUDGET;
+static gint n_open_fds; /* atomic */
+static gint n_reopened_fds; /* atomic */
+static gint n_evicted_fds; /* atomic */
+G_LOCK_DEFINE (evict_fds);
+
+static void evict_idle_physical_fds (void);
 
 /* Takes ownership of the o_path fd if passed in */
 static XdpPhysicalInode *
 ensure_physical_inode (dev_t dev, ino_t ino, int o_path_fd)
 {
   DevIno devino = {ino, dev};
+  XdpPhysicalInodeShard *shard = physical_inodes_shard (&devino);
   XdpPhysicalInode *inode = NULL;
+  gboolean opened = FALSE;
 
-  G_LOCK (physical_inodes);
+  g_mutex_lock (&shard->lock);
 
-  inode = g_hash_table_lookup (physical_inodes, &devino);
+  inode = g_hash_table_lookup (shard->inodes, &devino);
   if (inode != NULL)
     {
       inode = xdp_physical_inode_ref (inode);
-      close (o_path_fd);
+
+      /* Reuse the fd if the old one was evicted */
+      g_mutex_lock (&inode->mutex);
+      if (inode->fd == -1)
+        {
+          inode->fd = xdp_steal_fd (&o_path_fd);
+          opened = TRUE;
+        }
+      inode->last_used = g_get_monotonic_time ();
+      g_mutex_unlock (&inode->mutex);
+
+      if (o_path_fd != -1)
+        close (o_path_fd);
     }
   else
     {
       /* Takes ownership of fd */
       inode = g_new0 (XdpPhysicalInode, 1);
       inode->ref_count = 1;
+      g_mutex_init (&inode->mutex);
       inode->fd = o_path_fd;
+      inode->last_used = g_get_monotonic_time ();
       inode->backing_devino = devino;
-      g_hash_table_insert (physical_inodes, &inode->backing_devino, inode);
+      g_hash_table_insert (shard->inodes, &inode->backing_devino, inode);
+      g_atomic_int_inc (&n_live_physical_inodes);
+      opened = TRUE;
     }
 
-  G_UNLOCK (physical_inodes);
+  g_mutex_unlock (&shard->lock);
+
+  if (opened && g_atomic_int_add (&n_open_fds, 1) >= fd_budget)
+    evict_idle_physical_fds ();
 
   return inode;
 }
@@ -454,21 +671,222 @@ retry_atomic_decrement1:
           return;
         }
 
+      XdpPhysicalInodeShard *shard = physical_inodes_shard (&inode->backing_devino);
+
       /* Might be revived from physical_inodes hash by this time, so protect by lock */
-      G_LOCK (physical_inodes);
+      g_mutex_lock (&shard->lock);
 
       if (!g_atomic_int_compare_and_exchange ((int *) &inode->ref_count, old_ref, old_ref - 1))
         {
-          G_UNLOCK (physical_inodes);
+          g_mutex_unlock (&shard->lock);
           goto retry_atomic_decrement1;
         }
-      g_hash_table_remove (physical_inodes, &inode->backing_devino);
+      g_hash_table_remove (shard->inodes, &inode->backing_devino);
 
-      G_UNLOCK (physical_inodes);
+      g_mutex_unlock (&shard->lock);
 
-      close (inode->fd);
+      if (inode->fd != -1)
+        {
+          close (inode->fd);
+          g_atomic_int_add (&n_open_fds, -1);
+        }
+      g_clear_pointer (&inode->parent, xdp_physical_inode_unref);
+      g_free (inode->name);
+      g_free (inode->path);
+      g_mutex_clear (&inode->mutex);
       g_free (inode);
+      g_atomic_int_add (&n_live_physical_inodes, -1);
+    }
+}
+
+static int physical_inode_dup_fd (XdpPhysicalInode *inode,
+                                  int               depth);
+
+/* Opens the inode from its last known location, verifying that it is
+ * still the same file */
+static int
+physical_inode_reopen (XdpPhysicalInode *inode,
+                       int               depth)
+{
+  g_autoptr(XdpPhysicalInode) parent = NULL;
+  g_autofree char *name = NULL;
+  g_autofree char *path = NULL;
+  xdp_autofd int fd = -1;
+  struct stat buf;
+
+  if (depth > MAX_REOPEN_DEPTH)
+    return -ELOOP;
+
+  g_mutex_lock (&inode->mutex);
+  if (inode->parent)
+    parent = xdp_physical_inode_ref (inode->parent);
+  name = g_strdup (inode->name);
+  path = g_strdup (inode->path);
+  g_mutex_unlock (&inode->mutex);
+
+  if (parent)
+    {
+      xdp_autofd int dirfd = physical_inode_dup_fd (parent, depth + 1);
+      if (dirfd < 0)
+        return dirfd;
+
+      fd = openat (dirfd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    }
+  else if (path)
+    fd = open (path, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+  else
+    return -ESTALE;
+
+  /* If it is gone from where we last saw it we can't find it again */
+  if (fd == -1 ||
+      fstatat (fd, "", &buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) != 0 ||
+      buf.st_dev != inode->backing_devino.dev ||
+      buf.st_ino != inode->backing_devino.ino)
+    return -ESTALE;
+
+  return xdp_steal_fd (&fd);
+}
+
+static int
+physical_inode_dup_fd (XdpPhysicalInode *inode,
+                       int               depth)
+{
+  int fd;
+  int errsv;
+
+  g_mutex_lock (&inode->mutex);
+
+  if (inode->fd == -1)
+    {
+      /* Don't hold the lock while reopening, that locks the parents */
+      g_mutex_unlock (&inode->mutex);
+
+      fd = physical_inode_reopen (inode, depth);
+      if (fd < 0)
+        return fd;
+
+      g_mutex_lock (&inode->mutex);
+      if (inode->fd == -1)
+        {
+          inode->fd = fd;
+          g_atomic_int_add (&n_open_fds, 1);
+          g_atomic_int_inc (&n_reopened_fds);
+        }
+      else
+        close (fd); /* Someone else reopened it */
+    }
+
+  fd = fcntl (inode->fd, F_DUPFD_CLOEXEC, 3);
+  errsv = errno;
+  inode->last_used = g_get_monotonic_time ();
+
+  g_mutex_unlock (&inode->mutex);
+
+  if (fd == -1)
+    return -errsv;
+
+  if (g_atomic_int_get (&n_open_fds) > fd_budget)
+    evict_idle_physical_fds ();
+
+  return fd;
+}
+
+/* Returns a new fd for the O_PATH fd of the inode (which may be
+ * evicted at any time), or -errno. Close it after use. */
+static int
+xdp_physical_inode_dup_fd (XdpPhysicalInode *inode)
+{
+  return physical_inode_dup_fd (inode, 0);
+}
+
+typedef struct {
+  XdpPhysicalInode *inode;
+  gint64 last_used;
+} EvictCandidate;
+
+static void
+evict_candidate_clear (EvictCandidate *candidate)
+{
+  xdp_physical_inode_unref (candidate->inode);
+}
+
+static gint
+evict_candidate_compare (gconstpointer _a,
+                         gconstpointer _b)
+{
+  const EvictCandidate *a = _a;
+  const EvictCandidate *b = _b;
+
+  if (a->last_used < b->last_used)
+    return -1;
+  return a->last_used > b->last_used;
+}
+
+/* Close the fds of the least recently used physical inodes until we
+ * are 10% below the budget, so we don't have to do this for every open */
+static void
+evict_idle_physical_fds (void)
+{
+  g_autoptr(GArray) candidates = NULL;
+  int target = fd_budget - fd_budget / 10;
+  guint i;
+
+  /* Someone else is already at it */
+  if (!G_TRYLOCK (evict_fds))
+    return;
+
+  candidates = g_array_new (FALSE, FALSE, sizeof (EvictCandidate));
+  g_array_set_clear_func (candidates, (GDestroyNotify)evict_candidate_clear);
+
+  for (i = 0; i < N_INODE_SHARDS; i++)
+    {
+      XdpPhysicalInodeShard *shard = &physical_inodes[i];
+      GHashTableIter iter;
+      gpointer value;
+
+      g_mutex_lock (&shard->lock);
+      g_hash_table_iter_init (&iter, shard->inodes);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        {
+          XdpPhysicalInode *inode = value;
+          EvictCandidate candidate = { NULL, 0 };
+
+          g_mutex_lock (&inode->mutex);
+          if (inode->fd != -1 && (inode->parent != NULL || inode->path != NULL))
+            {
+              candidate.inode = xdp_physical_inode_ref (inode);
+              candidate.last_used = inode->last_used;
+            }
+          g_mutex_unlock (&inode->mutex);
+
+          if (candidate.inode)
+            g_array_append_val (candidates, candidate);
+        }
+      g_mutex_unlock (&shard->lock);
+    }
+
+  g_array_sort (candidates, evict_candidate_compare);
+
+  for (i = 0; i < candidates->len && g_atomic_int_get (&n_open_fds) > target; i++)
+    {
+      XdpPhysicalInode *inode = g_array_index (candidates, EvictCandidate, i).inode;
+
+      g_mutex_lock (&inode->mutex);
+      if (inode->fd != -1)
+        {
+          close (inode->fd);
+          inode->fd = -1;
+          g_atomic_int_add (&n_open_fds, -1);
+          g_atomic_int_inc (&n_evicted_fds);
+        }
+      g_mutex_unlock (&inode->mutex);
     }
+
+  g_debug ("Evicted physical inode fds, %d open (budget %d), %d evicted, %d reopened in total",
+           g_atomic_int_get (&n_open_fds), fd_budget,
+           g_atomic_int_get (&n_evicted_fds), g_atomic_int_get (&n_reopened_fds));
+
+  G_UNLOCK (evict_fds);
 }
 
 static XdpDomain *
@@ -494,7 +912,9 @@ xdp_domain_unref (XdpDomain *domain)
       g_clear_pointer (&domain->parent_inode, xdp_inode_unref);
       g_clear_pointer (&domain->tempfiles, g_hash_table_unref);
       g_mutex_clear (&domain->tempfile_mutex);
+      g_mutex_clear (&domain->inodes_mutex);
       g_free (domain);
+      g_atomic_int_add (&n_live_domains, -1);
     }
 }
 
@@ -514,6 +934,8 @@ _xdp_domain_new (XdpDomainType type)
   domain->ref_count = 1;
   domain->type = type;
   g_mutex_init (&domain->tempfile_mutex);
+  g_mutex_init (&domain->inodes_mutex);
+  g_atomic_int_inc (&n_live_domains);
   return domain;
 }
 
@@ -589,34 +1011,52 @@ xdp_domain_new_document (XdpDomain *parent,
   return domain;
 }
 
-static gboolean
-xdp_document_domain_can_see (XdpDomain *domain)
+#define CACHED_PERMS_VALID 0x80
+#define CACHED_PERMS_GENERATION_MASK (G_MAXSIZE >> 8)
+
+/* The permissions of the app for the document. This is called for most
+ * operations, so the result is cached in the domain, together with the
+ * db generation it was read at, and only looked up again when the db
+ * changed. */
+static DocumentPermissionFlags
+xdp_document_domain_get_permissions (XdpDomain *domain)
 {
-  if (domain->app_id != NULL)
-    {
-      g_autoptr(PermissionDbEntry) entry = xdp_lookup_doc (domain->doc_id);
+  g_autoptr(PermissionDbEntry) entry = NULL;
+  DocumentPermissionFlags perms = 0;
+  gsize generation;
+  gsize cached;
 
-      if (entry == NULL ||
-          !app_can_see_doc (entry, domain->app_id))
-        return FALSE;
-    }
+  if (domain->app_id == NULL)
+    return DOCUMENT_PERMISSION_FLAGS_ALL;
 
-  return TRUE;
+  /* Read this before the lookup, so that a concurrent change is not
+     cached as up-to-date */
+  generation = xdp_get_db_generation () & CACHED_PERMS_GENERATION_MASK;
+
+  cached = GPOINTER_TO_SIZE (g_atomic_pointer_get (&domain->cached_perms));
+  if ((cached & CACHED_PERMS_VALID) != 0 && (cached >> 8) == generation)
+    return cached & DOCUMENT_PERMISSION_FLAGS_ALL;
+
+  entry = xdp_lookup_doc (domain->doc_id);
+  if (entry != NULL)
+    perms = document_entry_get_permissions_by_app_id (entry, domain->app_id);
+
+  g_atomic_pointer_set (&domain->cached_perms,
+                        GSIZE_TO_POINTER ((generation << 8) | CACHED_PERMS_VALID | perms));
+
+  return perms;
 }
 
 static gboolean
-xdp_document_domain_can_write (XdpDomain *domain)
+xdp_document_domain_can_see (XdpDomain *domain)
 {
-  if (domain->app_id != NULL)
-    {
-      g_autoptr(PermissionDbEntry) entry = xdp_lookup_doc (domain->doc_id);
-
-      if (entry == NULL ||
-          !app_can_write_doc (entry, domain->app_id))
-        return FALSE;
-    }
+  return (xdp_document_domain_get_permissions (domain) & DOCUMENT_PERMISSION_FLAGS_READ) != 0;
+}
 
-  return TRUE;
+static gboolean
+xdp_document_domain_can_write (XdpDomain *domain)
+{
+  return (xdp_document_domain_get_permissions (domain) & DOCUMENT_PERMISSION_FLAGS_WRITE) != 0;
 }
 
 static char **
@@ -627,13 +1067,13 @@ xdp_domain_get_inode_keys_as_string (XdpDomain *domain)
 
   g_assert (domain->type == XDP_DOMAIN_BY_APP);
 
-  G_LOCK (domain_inodes);
+  g_mutex_lock (&domain->inodes_mutex);
 
   res = (char **)g_hash_table_get_keys_as_array (domain->inodes, &length);
   for (i = 0; i < length; i++)
     res[i] = g_strdup (res[i]);
 
-  G_UNLOCK (domain_inodes);
+  g_mutex_unlock (&domain->inodes_mutex);
 
   return res;
 }
@@ -656,6 +1096,7 @@ xdp_tempfile_new (XdpInode   *inode,
   tempfile->inode = xdp_inode_ref (inode);
   tempfile->name = g_strdup (name);
   tempfile->tempname = g_strdup (tempname);
+  g_atomic_int_inc (&n_live_tempfiles);
 
   return tempfile;
 }
@@ -674,6 +1115,7 @@ xdp_tempfile_unref (XdpTempfile *tempfile)
       g_free (tempfile->tempname);
       g_clear_pointer (&tempfile->inode, xdp_inode_unref);
       g_free (tempfile);
+      g_atomic_int_add (&n_live_tempfiles, -1);
     }
 }
 
@@ -683,6 +1125,7 @@ _xdp_inode_new (void)
   XdpInode *inode = g_new0 (XdpInode, 1);
   inode->ref_count = 1;
   inode->kernel_ref_count = 0;
+  g_atomic_int_inc (&n_live_inodes);
 
   return inode;
 }
@@ -690,63 +1133,406 @@ _xdp_inode_new (void)
 /* We try to create persistent inode nr based on the backing device and inode nrs, as
  * well as the doc/app id (since the same backing dev/ino should be different inodes
  * in the fuse filesystem). We do this by hashing the data to generate a value.
- * For non-phsyical files or accidental collisions we just pick a free number
- * by incrementing.
+ * Virtual inodes are hashed the same way, with a zero dev/ino.
+ *
+ * On accidental collisions we pick the next free number, and record it in
+ * the inode map, which is saved next to the document db. On restart the
+ * recorded numbers are reused, and not given out to other inodes, so the
+ * inode numbers stay stable.
  */
+
+#define INODE_MAP_VERSION 1
+#define INODE_MAP_TYPE "(ua(ttsst))"
+#define INODE_MAP_SAVE_TIMEOUT_SEC 1
+
+typedef struct {
+  DevIno devino; /* 0/0 for virtual inodes */
+  char *doc_id;
+  char *app_id;
+  guint64 hash;
+} XdpInodeKey;
+
+static GRWLock inode_map_lock;
+static char *inode_map_path = NULL;
+static GHashTable *inode_map = NULL; /* XdpInodeKey -> guint64 ino */
+static GHashTable *inode_map_reserved = NULL; /* guint64 ino -> XdpInodeKey */
+static guint inode_map_save_id = 0; /* Protected by inode_map_lock */
+
+/* FNV-1a, this is called for every new inode so it needs to be cheap */
 static guint64
-generate_persistent_ino (DevIno *backing_devino,
-                         const char *doc_id,
-                         const char *app_id)
+ino_hash_update (guint64     hash,
+                 const void *data,
+                 gsize       len)
 {
-  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_MD5);
-  guchar digest[64];
-  gsize digest_len = 64;
-  guint64 res;
+  const guchar *p = data;
+  gsize i;
 
-  g_checksum_update (checksum, (guchar *)backing_devino, sizeof (DevIno));
+  for (i = 0; i < len; i++)
+    {
+      hash ^= p[i];
+      hash *= 0x100000001b3ULL;
+    }
+
+  return hash;
+}
+
+static guint64
+inode_key_compute_hash (const DevIno *devino,
+                        const char   *doc_id,
+                        const char   *app_id)
+{
+  guint64 hash = 0xcbf29ce484222325ULL;
+
+  hash = ino_hash_update (hash, &devino->ino, sizeof (devino->ino));
+  hash = ino_hash_update (hash, &devino->dev, sizeof (devino->dev));
+  /* Include the terminating zero so "a"+"bc" differs from "ab"+"c" */
   if (doc_id)
-    g_checksum_update (checksum, (guchar *)doc_id, strlen (doc_id));
+    hash = ino_hash_update (hash, doc_id, strlen (doc_id) + 1);
+  hash = ino_hash_update (hash, "", 1);
   if (app_id)
-    g_checksum_update (checksum, (guchar *)app_id, strlen (app_id));
+    hash = ino_hash_update (hash, app_id, strlen (app_id) + 1);
+
+  /* Final avalanche (from murmurhash3), FNV mixes the last bytes poorly */
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+
+  return hash;
+}
+
+static void
+inode_key_init (XdpInodeKey  *key,
+                const DevIno *devino,
+                const char   *doc_id,
+                const char   *app_id)
+{
+  key->devino = *devino;
+  key->doc_id = (char *)doc_id;
+  key->app_id = (char *)app_id;
+  key->hash = inode_key_compute_hash (devino, doc_id, app_id);
+}
+
+static XdpInodeKey *
+inode_key_dup (const XdpInodeKey *key)
+{
+  XdpInodeKey *copy = g_new (XdpInodeKey, 1);
+
+  copy->devino = key->devino;
+  copy->doc_id = g_strdup (key->doc_id);
+  copy->app_id = g_strdup (key->app_id);
+  copy->hash = key->hash;
+
+  return copy;
+}
+
+static void
+inode_key_free (XdpInodeKey *key)
+{
+  g_free (key->doc_id);
+  g_free (key->app_id);
+  g_free (key);
+}
+
+static guint
+inode_key_hash (gconstpointer key)
+{
+  return (guint)((const XdpInodeKey *)key)->hash;
+}
+
+static gboolean
+inode_key_equal (gconstpointer _a,
+                 gconstpointer _b)
+{
+  const XdpInodeKey *a = _a;
+  const XdpInodeKey *b = _b;
+
+  return
+    a->hash == b->hash &&
+    a->devino.ino == b->devino.ino &&
+    a->devino.dev == b->devino.dev &&
+    g_strcmp0 (a->doc_id, b->doc_id) == 0 &&
+    g_strcmp0 (a->app_id, b->app_id) == 0;
+}
+
+static gboolean
+ino_is_reserved (guint64 ino)
+{
+  return ino == 0 || ino == FUSE_ROOT_ID;
+}
+
+static guint64
+ino_next (guint64 ino)
+{
+  do
+    ino++;
+  while (ino_is_reserved (ino));
+
+  return ino;
+}
 
-  g_checksum_get_digest (checksum, digest, &digest_len);
+/* Returns TRUE and the ino if the key has a recorded inode number */
+static gboolean
+inode_map_lookup (const XdpInodeKey *key,
+                  guint64           *ino_out)
+{
+  gpointer value;
+  gboolean res = FALSE;
+
+  g_rw_lock_reader_lock (&inode_map_lock);
+  if (g_hash_table_lookup_extended (inode_map, key, NULL, &value))
+    {
+      *ino_out = *(guint64 *)value;
+      res = TRUE;
+    }
+  g_rw_lock_reader_unlock (&inode_map_lock);
 
-  res = *(guint64 *)digest;
-  if (res == FUSE_ROOT_ID || res == 0)
-    res = FUSE_ROOT_ID + 1;
   return res;
 }
 
+/* Whether ino is recorded for some other key */
+static gboolean
+inode_map_is_taken (guint64            ino,
+                    const XdpInodeKey *key)
+{
+  XdpInodeKey *owner;
+
+  g_rw_lock_reader_lock (&inode_map_lock);
+  owner = g_hash_table_lookup (inode_map_reserved, &ino);
+  g_rw_lock_reader_unlock (&inode_map_lock);
+
+  return owner != NULL && !inode_key_equal (owner, key);
+}
+
+static GVariant *
+inode_map_serialize (void)
+{
+  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a(ttsst)"));
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, inode_map);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      XdpInodeKey *k = key;
+
+      g_variant_builder_add (&builder, "(ttsst)",
+                             (guint64)k->devino.dev, (guint64)k->devino.ino,
+                             k->doc_id ? k->doc_id : "",
+                             k->app_id ? k->app_id : "",
+                             *(guint64 *)value);
+    }
+
+  return g_variant_ref_sink (g_variant_new ("(u@a(ttsst))", INODE_MAP_VERSION,
+                                            g_variant_builder_end (&builder)));
+}
+
+static gboolean
+inode_map_save_cb (gpointer user_data)
+{
+  g_autoptr(GVariant) data = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *dir = NULL;
+
+  /* Clear this first so later changes schedule a new save */
+  g_rw_lock_writer_lock (&inode_map_lock);
+  inode_map_save_id = 0;
+  g_rw_lock_writer_unlock (&inode_map_lock);
+
+  g_rw_lock_reader_lock (&inode_map_lock);
+  data = inode_map_serialize ();
+  g_rw_lock_reader_unlock (&inode_map_lock);
+
+  dir = g_path_get_dirname (inode_map_path);
+  g_mkdir_with_parents (dir, 0700);
+
+  if (!g_file_set_contents (inode_map_path,
+                            g_variant_get_data (data),
+                            g_variant_get_size (data),
+                            &error))
+    g_warning ("Unable to save inode map %s: %s", inode_map_path, error->message);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+inode_map_record (const XdpInodeKey *key,
+                  guint64            ino)
+{
+  XdpInodeKey *map_key;
+  gpointer old_ino;
+  guint64 *value;
+
+  if (inode_map_path == NULL)
+    return;
+
+  g_rw_lock_writer_lock (&inode_map_lock);
+
+  if (g_hash_table_lookup_extended (inode_map, key, NULL, &old_ino))
+    g_hash_table_remove (inode_map_reserved, old_ino);
+
+  map_key = inode_key_dup (key);
+  value = g_new (guint64, 1);
+  *value = ino;
+  g_hash_table_replace (inode_map, map_key, value);
+  g_hash_table_replace (inode_map_reserved, value, map_key);
+
+  /* Batch up the writes */
+  if (inode_map_save_id == 0)
+    inode_map_save_id = g_timeout_add_seconds (INODE_MAP_SAVE_TIMEOUT_SEC,
+                                               inode_map_save_cb, NULL);
+
+  g_rw_lock_writer_unlock (&inode_map_lock);
+}
+
+/* Entries for deleted documents are dropped on load */
+static void
+inode_map_load (void)
+{
+  g_autofree char *contents = NULL;
+  g_autoptr(GVariant) data = NULL;
+  g_autoptr(GVariant) entries = NULL;
+  g_autoptr(GError) error = NULL;
+  GVariantIter iter;
+  guint64 dev, ino, mapped_ino;
+  const char *doc_id, *app_id;
+  gsize len;
+  guint32 version;
+
+  inode_map = g_hash_table_new_full (inode_key_hash, inode_key_equal,
+                                     (GDestroyNotify)inode_key_free, g_free);
+  inode_map_reserved = g_hash_table_new (g_int64_hash, g_int64_equal);
+
+  if (inode_map_path == NULL)
+    return;
+
+  if (!g_file_get_contents (inode_map_path, &contents, &len, &error))
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_warning ("Unable to load inode map %s: %s", inode_map_path, error->message);
+      return;
+    }
+
+  data = g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE (INODE_MAP_TYPE),
+                                                      contents, len, FALSE,
+                                                      NULL, NULL));
+  g_variant_get (data, "(u@a(ttsst))", &version, &entries);
+  if (version != INODE_MAP_VERSION)
+    return;
+
+  g_variant_iter_init (&iter, entries);
+  while (g_variant_iter_next (&iter, "(tt&s&st)", &dev, &ino, &doc_id, &app_id, &mapped_ino))
+    {
+      DevIno devino = { ino, dev };
+      XdpInodeKey key;
+      XdpInodeKey *map_key;
+      guint64 *value;
+
+      if (*doc_id != 0)
+        {
+          g_autoptr(PermissionDbEntry) entry = xdp_lookup_doc (doc_id);
+          if (entry == NULL)
+            continue;
+        }
+
+      if (ino_is_reserved (mapped_ino) ||
+          g_hash_table_contains (inode_map_reserved, &mapped_ino))
+        continue;
+
+      inode_key_init (&key, &devino,
+                      *doc_id != 0 ? doc_id : NULL,
+                      *app_id != 0 ? app_id : NULL);
+      map_key = inode_key_dup (&key);
+      value = g_new (guint64, 1);
+      *value = mapped_ino;
+      g_hash_table_replace (inode_map, map_key, value);
+      g_hash_table_insert (inode_map_reserved, value, map_key);
+    }
+
+  g_debug ("Loaded %u inode numbers from %s", g_hash_table_size (inode_map), inode_map_path);
+}
+
+static void
+inode_map_flush (void)
+{
+  gboolean pending;
+
+  if (inode_map == NULL)
+    return;
+
+  g_rw_lock_writer_lock (&inode_map_lock);
+  pending = inode_map_save_id != 0;
+  if (pending)
+    g_source_remove (inode_map_save_id);
+  g_rw_lock_writer_unlock (&inode_map_lock);
+
+  if (pending)
+    inode_map_save_cb (NULL);
+}
+
 /* takes ownership of fd */
 static XdpInode *
 xdp_inode_new (XdpDomain *domain,
                XdpPhysicalInode *physical)
 {
   XdpInode *inode = _xdp_inode_new ();
-  inode->domain = xdp_domain_ref (domain);
-  guint64 persistent_ino, try_ino;
+  DevIno virtual_devino = { 0, 0 };
+  XdpInodeKey key;
+  gboolean recorded;
+  gboolean collided = FALSE;
+  guint64 try_ino;
 
+  inode->domain = xdp_domain_ref (domain);
   if (physical)
-    {
-      inode->physical = xdp_physical_inode_ref (physical);
-      persistent_ino = generate_persistent_ino (&physical->backing_devino,
-                                                domain->doc_id,
-                                                domain->app_id);
+    inode->physical = xdp_physical_inode_ref (physical);
 
-    }
+  inode_key_init (&key,
+                  physical ? &physical->backing_devino : &virtual_devino,
+                  domain->doc_id, domain->app_id);
 
-  G_LOCK (all_inodes);
-  if (physical)
-    try_ino = persistent_ino;
+  if (domain->type == XDP_DOMAIN_ROOT)
+    {
+      try_ino = FUSE_ROOT_ID;
+      recorded = TRUE;
+    }
   else
-    try_ino = next_virtual_inode++;
+    {
+      recorded = inode_map_lookup (&key, &try_ino);
+      if (!recorded)
+        {
+          try_ino = key.hash;
+          if (ino_is_reserved (try_ino))
+            try_ino = ino_next (try_ino);
+        }
+    }
 
-  if (g_hash_table_contains (all_inodes, &try_ino))
-    try_ino++;
+  while (TRUE)
+    {
+      XdpInodeShard *shard = all_inodes_shard (try_ino);
+
+      g_rw_lock_writer_lock (&shard->lock);
+      if (!g_hash_table_contains (shard->inodes, &try_ino) &&
+          (recorded || !inode_map_is_taken (try_ino, &key)))
+        {
+          inode->ino = try_ino;
+          g_hash_table_insert (shard->inodes, &inode->ino, inode);
+          g_rw_lock_writer_unlock (&shard->lock);
+          break;
+        }
+      g_rw_lock_writer_unlock (&shard->lock);
 
-  inode->ino = try_ino;
-  g_hash_table_insert (all_inodes, &inode->ino, inode);
-  G_UNLOCK (all_inodes);
+      try_ino = ino_next (try_ino);
+      recorded = FALSE;
+      collided = TRUE;
+    }
+
+  if (collided)
+    {
+      g_debug ("Inode number collision, using %" G_GINT64_MODIFIER "x instead of %" G_GINT64_MODIFIER "x",
+               inode->ino, key.hash);
+      inode_map_record (&key, inode->ino);
+    }
 
   return inode;
 }
@@ -761,11 +1547,12 @@ xdp_inode_to_ino (XdpInode *inode)
 static XdpInode *
 xdp_inode_from_ino (ino_t ino)
 {
+  XdpInodeShard *shard = all_inodes_shard (ino);
   XdpInode *inode;
 
-  G_LOCK (all_inodes);
-  inode = g_hash_table_lookup (all_inodes, &ino);
-  G_UNLOCK (all_inodes);
+  g_rw_lock_reader_lock (&shard->lock);
+  inode = g_hash_table_lookup (shard->inodes, &ino);
+  g_rw_lock_reader_unlock (&shard->lock);
 
   g_assert (inode != NULL);
 
@@ -785,6 +1572,8 @@ xdp_inode_unref (XdpInode *inode)
 {
   gint old_ref;
   XdpDomain *domain;
+  XdpDomain *table_domain;
+  XdpInodeShard *shard;
 
   /* here we want to atomically do: if (ref_count>1) { ref_count--; return; } */
 retry_atomic_decrement1:
@@ -802,30 +1591,38 @@ retry_atomic_decrement1:
           return;
         }
 
+      domain = inode->domain;
+
+      /* The domain whose inodes table has this inode, root and by-app are in none */
+      if (domain->type == XDP_DOMAIN_DOCUMENT && inode->physical)
+        table_domain = domain;
+      else if (domain->parent)
+        table_domain = domain->parent;
+      else
+        table_domain = domain;
+
       /* Might be revived from domain->inodes hash by this time, so protect by lock */
-      G_LOCK (domain_inodes);
+      g_mutex_lock (&table_domain->inodes_mutex);
 
       if (!g_atomic_int_compare_and_exchange ((int *) &inode->ref_count, old_ref, old_ref - 1))
         {
-          G_UNLOCK (domain_inodes);
+          g_mutex_unlock (&table_domain->inodes_mutex);
           goto retry_atomic_decrement1;
         }
 
-      domain = inode->domain;
-
       if (domain->type == XDP_DOMAIN_APP)
-        g_hash_table_remove (domain->parent->inodes, domain->app_id);
+        g_hash_table_remove (table_domain->inodes, domain->app_id);
       else if (domain->type == XDP_DOMAIN_DOCUMENT)
         {
           if (inode->physical)
             {
-              g_hash_table_remove (domain->inodes, inode->physical);
+              g_hash_table_remove (table_domain->inodes, inode->physical);
             }
           else
-            g_hash_table_remove (domain->parent->inodes, domain->doc_id);
+            g_hash_table_remove (table_domain->inodes, domain->doc_id);
         }
 
-      /* Run this under domain_inodes lock to avoid race condition in ensure_docdir_inode + xdp_inode_new
+      /* Run this under the inodes_mutex to avoid race condition in ensure_docdir_inode + xdp_inode_new
        * where we don't want a domain->inode lookup to fail, but then an all_inode lookup to succeed
        * when looking for an ino collision
        *
@@ -833,11 +1630,12 @@ retry_atomic_decrement1:
        * still race with an all_inodes lookup (e.g. in xdp_fuse_lookup_id_for_inode), which *is*
        * allowed and it can read the inode fields (while the lock is held) as they are still valid.
        **/
-      G_LOCK (all_inodes);
-      g_hash_table_remove (all_inodes, &inode->ino);
-      G_UNLOCK (all_inodes);
+      shard = all_inodes_shard (inode->ino);
+      g_rw_lock_writer_lock (&shard->lock);
+      g_hash_table_remove (shard->inodes, &inode->ino);
+      g_rw_lock_writer_unlock (&shard->lock);
 
-      G_UNLOCK (domain_inodes);
+      g_mutex_unlock (&table_domain->inodes_mutex);
 
       /* By now we have no refs outstanding and no way to get at the inode, so free it */
 
@@ -845,6 +1643,7 @@ retry_atomic_decrement1:
       g_clear_pointer (&inode->physical, xdp_physical_inode_unref);
       xdp_domain_unref (inode->domain);
       g_free (inode);
+      g_atomic_int_add (&n_live_inodes, -1);
     }
 
 }
@@ -931,7 +1730,14 @@ xdp_document_inode_ensure_dirfd (XdpInode *inode,
   *close_fd_out = -1;
 
   if (inode->physical)
-    return inode->physical->fd;
+    {
+      close_fd = xdp_physical_inode_dup_fd (inode->physical);
+      if (close_fd < 0)
+        return close_fd;
+
+      *close_fd_out = close_fd;
+      return close_fd;
+    }
   else
     {
       if (xdp_document_domain_is_dir (inode->domain))
@@ -1029,7 +1835,7 @@ get_tempfile_for (XdpInode *parent,
   if (o_path_fd == -1)
     return -errno;
 
-  res = ensure_docdir_inode (parent, xdp_steal_fd (&o_path_fd), NULL, &inode); /* passed ownership of o_path_fd */
+  res = ensure_docdir_inode (parent, xdp_steal_fd (&o_path_fd), tmpname, NULL, &inode); /* passed ownership of o_path_fd */
   if (res != 0)
     return res;
 
@@ -1076,7 +1882,7 @@ create_tempfile (XdpInode *parent,
   /* We can close the tmpfd early */
   close (xdp_steal_fd (&real_fd));
 
-  res = ensure_docdir_inode (parent, xdp_steal_fd (&o_path_fd), NULL, &inode); /* passed ownership of o_path_fd */
+  res = ensure_docdir_inode (parent, xdp_steal_fd (&o_path_fd), tmpname, NULL, &inode); /* passed ownership of o_path_fd */
   if (res != 0)
     return res;
 
@@ -1108,7 +1914,11 @@ xdp_document_inode_open_child_fd (XdpInode *inode, const char *name, int open_fl
 
   if (inode->physical)
     {
-      fd = openat (inode->physical->fd, name, open_flags, mode);
+      xdp_autofd int dirfd = xdp_physical_inode_dup_fd (inode->physical);
+      if (dirfd < 0)
+        return dirfd;
+
+      fd = openat (dirfd, name, open_flags, mode);
       if (fd == -1)
         return -errno;
 
@@ -1169,7 +1979,13 @@ xdp_document_inode_open_child_fd (XdpInode *inode, const char *name, int open_fl
 
           if (tempfile)
             {
-              g_autofree char *fd_path = fd_to_path (tempfile->inode->physical->fd);
+              xdp_autofd int tempfile_fd = xdp_physical_inode_dup_fd (tempfile->inode->physical);
+              g_autofree char *fd_path = NULL;
+
+              if (tempfile_fd < 0)
+                return tempfile_fd;
+
+              fd_path = fd_to_path (tempfile_fd);
               fd = open (fd_path, open_flags & ~(O_CREAT|O_EXCL|O_NOFOLLOW), mode);
               if (fd == -1)
                 return -errno;
@@ -1187,20 +2003,34 @@ xdp_document_inode_open_child_fd (XdpInode *inode, const char *name, int open_fl
   return -ENOENT;
 }
 
-/* Returns /proc/self/fds/$fd path for O_PATH fd or toplevel path */
-static char *
-xdp_document_inode_get_self_as_path (XdpInode *inode)
+/* Returns /proc/self/fds/$fd path for O_PATH fd or toplevel path, or
+ * NULL for toplevel dirs. The fd is returned in close_fd_out and has to
+ * be kept open while the path is used. */
+static int
+xdp_document_inode_get_self_as_path (XdpInode *inode,
+                                     char **path_out,
+                                     int *close_fd_out)
 {
+  int fd;
+
   g_assert (inode->domain->type == XDP_DOMAIN_DOCUMENT);
 
+  *path_out = NULL;
+  *close_fd_out = -1;
+
   if (inode->physical)
-    return fd_to_path (inode->physical->fd);
-  else
     {
-      if (xdp_document_domain_is_dir (inode->domain))
-        return NULL;
-      return g_strdup (inode->domain->doc_path);
+      fd = xdp_physical_inode_dup_fd (inode->physical);
+      if (fd < 0)
+        return fd;
+
+      *close_fd_out = fd;
+      *path_out = fd_to_path (fd);
     }
+  else if (!xdp_document_domain_is_dir (inode->domain))
+    *path_out = g_strdup (inode->domain->doc_path);
+
+  return 0;
 }
 
 static void
@@ -1337,13 +2167,9 @@ stat_virtual_inode (XdpInode *inode,
         buf->st_mode = S_IFDIR | DOC_DIR_PERMS_FILE;
       buf->st_nlink = 2;
 
-      /* Remove perms if not writable */
-      if (inode->domain->app_id != NULL)
-        {
-          g_autoptr(PermissionDbEntry) entry = xdp_lookup_doc (inode->domain->doc_id);
-          if (entry == NULL || !app_can_write_doc (entry, inode->domain->app_id))
-            buf->st_mode &= ~(0222);
-        }
+      /* Remove perms if not writable */
+      if (!xdp_document_domain_can_write (inode->domain))
+        buf->st_mode &= ~(0222);
       break;
 
     default:
@@ -1357,11 +2183,13 @@ xdp_fuse_getattr (fuse_req_t req,
                   fuse_ino_t ino,
                   struct fuse_file_info *fi)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_GETATTR);
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   XdpDomain *domain = inode->domain;
   struct stat buf;
   int res;
   double attr_valid_time = 0.0;/* Time in secs for attribute validation */
+  xdp_autofd int fd = -1;
   const char *op = "GETATTR";
 
   g_debug ("GETATTR %lx", ino);
@@ -1373,10 +2201,18 @@ xdp_fuse_getattr (fuse_req_t req,
       return;
     }
 
+  attr_valid_time = document_cache_timeout;
+
   g_assert (domain->type == XDP_DOMAIN_DOCUMENT);
 
   if (inode->physical)
-    res = fstatat (inode->physical->fd, "", &buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+    {
+      fd = xdp_physical_inode_dup_fd (inode->physical);
+      if (fd < 0)
+        return xdp_reply_err (op, req, -fd);
+
+      res = fstatat (fd, "", &buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+    }
   else
     {
       stat_virtual_inode (inode, &buf);
@@ -1397,10 +2233,12 @@ xdp_fuse_setattr (fuse_req_t             req,
                   int                    to_set,
                   struct fuse_file_info *fi)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_SETATTR);
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   g_autofree char *to_set_string = setattr_flags_to_string (to_set);
   struct stat buf;
   double attr_valid_time = 0.0;/* Time in secs for attribute validation */
+  xdp_autofd int physical_fd = -1;
   int res;
   const char *op = "SETATTR";
 
@@ -1410,6 +2248,13 @@ xdp_fuse_setattr (fuse_req_t             req,
                                   CHECK_CAN_WRITE | CHECK_IS_PHYSICAL))
     return;
 
+  if (inode->physical)
+    {
+      physical_fd = xdp_physical_inode_dup_fd (inode->physical);
+      if (physical_fd < 0)
+        return xdp_reply_err (op, req, -physical_fd);
+    }
+
   /* Truncate */
   if (to_set & FUSE_SET_ATTR_SIZE)
     {
@@ -1424,7 +2269,7 @@ xdp_fuse_setattr (fuse_req_t             req,
         }
       else if (inode->physical)
         {
-          path = fd_to_path (inode->physical->fd);
+          path = fd_to_path (physical_fd);
           res = truncate (path, attr->st_size);
           if (res == -1)
             res = -errno;
@@ -1455,7 +2300,7 @@ xdp_fuse_setattr (fuse_req_t             req,
 
       if (inode->physical)
         {
-          path = fd_to_path (inode->physical->fd);
+          path = fd_to_path (physical_fd);
           res = utimensat (AT_FDCWD, path, times, 0);
         }
       else
@@ -1479,7 +2324,7 @@ xdp_fuse_setattr (fuse_req_t             req,
 
       if (inode->physical)
         {
-          path = fd_to_path (inode->physical->fd);
+          path = fd_to_path (physical_fd);
           res = chown (path, uid, gid);
           if (res == -1)
             res = -errno;
@@ -1499,7 +2344,7 @@ xdp_fuse_setattr (fuse_req_t             req,
 
       if (inode->physical)
         {
-          path = fd_to_path (inode->physical->fd);
+          path = fd_to_path (physical_fd);
           res = chmod (path, attr->st_mode);
           if (res == -1)
             res = -errno;
@@ -1514,7 +2359,7 @@ xdp_fuse_setattr (fuse_req_t             req,
     }
 
   if (inode->physical)
-    res = fstatat (inode->physical->fd, "", &buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+    res = fstatat (physical_fd, "", &buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
   else
     res = stat (inode->domain->doc_path, &buf); /* Follow symlinks here */
 
@@ -1523,7 +2368,10 @@ xdp_fuse_setattr (fuse_req_t             req,
 
   tweak_statbuf_for_document_inode (inode, &buf);
 
+  attr_valid_time = document_cache_timeout;
   fuse_reply_attr (req, &buf, attr_valid_time);
+
+  queue_invalidate_other_views (inode, NULL);
 }
 
 static void
@@ -1535,8 +2383,9 @@ prepare_reply_entry (XdpInode *inode,
   e->ino = xdp_inode_to_ino (inode);
   e->generation = 1;
   e->attr = *buf;
-  e->attr_timeout = 0.0; /* attribute timeout */
-  e->entry_timeout = 0.0; /* dentry timeout */
+  /* Only cached if enabled, see "Inode ownership model" */
+  e->attr_timeout = document_cache_timeout; /* attribute timeout */
+  e->entry_timeout = document_cache_timeout; /* dentry timeout */
 }
 
 static void
@@ -1561,9 +2410,118 @@ abort_reply_entry (struct fuse_entry_param *e)
   xdp_inode_kernel_unref (inode, 1);
 }
 
+/* Non-physical document inodes only map doc_file directly to the file
+ * on disk, other names are tempfiles with a different name on disk */
+static const char *
+document_child_disk_name (XdpInode   *parent,
+                          const char *name)
+{
+  if (parent->physical == NULL && strcmp (name, parent->domain->doc_file) != 0)
+    return NULL;
+
+  return name;
+}
+
+static gboolean
+physical_inode_has_ancestor (XdpPhysicalInode *inode,
+                             XdpPhysicalInode *ancestor)
+{
+  g_autoptr(XdpPhysicalInode) parent = xdp_physical_inode_ref (inode);
+
+  while (parent != NULL)
+    {
+      XdpPhysicalInode *next;
+
+      if (parent == ancestor)
+        return TRUE;
+
+      g_mutex_lock (&parent->mutex);
+      next = parent->parent ? xdp_physical_inode_ref (parent->parent) : NULL;
+      g_mutex_unlock (&parent->mutex);
+
+      xdp_physical_inode_unref (parent);
+      parent = next;
+    }
+
+  return FALSE;
+}
+
+/* Remember where physical was last seen, so its fd can be reopened
+ * after it has been evicted. disk_name is the name in the parent
+ * directory on disk */
+static void
+xdp_document_inode_set_location (XdpInode         *parent,
+                                 XdpPhysicalInode *physical,
+                                 const char       *disk_name)
+{
+  XdpDomain *domain = parent->domain;
+  g_autoptr(XdpPhysicalInode) old_parent = NULL;
+  g_autofree char *old_name = NULL;
+  g_autofree char *old_path = NULL;
+  g_autofree char *dir = NULL;
+  char *path = NULL;
+
+  if (parent->physical)
+    {
+      /* Don't create reference cycles, if something was moved around
+       * under us */
+      if (physical_inode_has_ancestor (parent->physical, physical))
+        return;
+    }
+  else if (xdp_document_domain_is_dir (domain))
+    path = g_strdup (domain->doc_path);
+  else
+    {
+      dir = g_path_get_dirname (domain->doc_path);
+      path = g_build_filename (dir, disk_name, NULL);
+    }
+
+  g_mutex_lock (&physical->mutex);
+  old_parent = g_steal_pointer (&physical->parent);
+  old_name = g_steal_pointer (&physical->name);
+  old_path = g_steal_pointer (&physical->path);
+  if (parent->physical)
+    {
+      physical->parent = xdp_physical_inode_ref (parent->physical);
+      physical->name = g_strdup (disk_name);
+    }
+  else
+    physical->path = path;
+  g_mutex_unlock (&physical->mutex);
+}
+
+/* Update the location of whatever is now at disk_name in dirfd */
+static void
+xdp_document_inode_update_location (XdpInode   *parent,
+                                    int         dirfd,
+                                    const char *disk_name)
+{
+  g_autoptr(XdpPhysicalInode) physical = NULL;
+  XdpPhysicalInodeShard *shard;
+  struct stat buf;
+  DevIno devino;
+
+  if (fstatat (dirfd, disk_name, &buf, AT_SYMLINK_NOFOLLOW) != 0)
+    return;
+
+  devino.dev = buf.st_dev;
+  devino.ino = buf.st_ino;
+  shard = physical_inodes_shard (&devino);
+
+  g_mutex_lock (&shard->lock);
+  physical = g_hash_table_lookup (shard->inodes, &devino);
+  if (physical)
+    xdp_physical_inode_ref (physical);
+  g_mutex_unlock (&shard->lock);
+
+  if (physical)
+    xdp_document_inode_set_location (parent, physical, disk_name);
+}
+
 static int
 ensure_docdir_inode (XdpInode *parent,
                      int o_path_fd_in, /* Takes ownership */
+                     const char *disk_name, /* NULL if not known */
                      struct fuse_entry_param *e,
                      XdpInode **inode_out)
 {
@@ -1584,7 +2542,10 @@ ensure_docdir_inode (XdpInode *parent,
 
   physical = ensure_physical_inode (buf.st_dev, buf.st_ino, xdp_steal_fd (&o_path_fd)); /* passed ownership of fd */
 
-  G_LOCK(domain_inodes);
+  if (disk_name)
+    xdp_document_inode_set_location (parent, physical, disk_name);
+
+  g_mutex_lock (&domain->inodes_mutex);
   inode = g_hash_table_lookup (domain->inodes, physical);
   if (inode != NULL)
     inode = xdp_inode_ref (inode);
@@ -1597,7 +2558,7 @@ ensure_docdir_inode (XdpInode *parent,
         inode->domain_root_inode = xdp_inode_ref (parent);
      g_hash_table_insert (domain->inodes, physical, inode);
     }
-  G_UNLOCK(domain_inodes);
+  g_mutex_unlock (&domain->inodes_mutex);
 
   if (e)
     {
@@ -1623,7 +2584,7 @@ ensure_docdir_inode_by_name (XdpInode *parent,
   if (o_path_fd == -1)
       return -errno;
 
-  return ensure_docdir_inode (parent, o_path_fd, e, NULL); /* Takes ownershif of o_path_fd */
+  return ensure_docdir_inode (parent, o_path_fd, name, e, NULL); /* Takes ownershif of o_path_fd */
 }
 
 
@@ -1637,7 +2598,7 @@ ensure_by_app_inode (XdpInode *by_app_inode,
   if (!xdp_is_valid_app_id (app_id))
     return NULL;
 
-  G_LOCK(domain_inodes);
+  g_mutex_lock (&by_app_domain->inodes_mutex);
   inode = g_hash_table_lookup (by_app_domain->inodes, app_id);
   if (inode != NULL)
     inode = xdp_inode_ref (inode);
@@ -1647,7 +2608,7 @@ ensure_by_app_inode (XdpInode *by_app_inode,
       inode = xdp_inode_new (app_domain, NULL);
       g_hash_table_insert (by_app_domain->inodes, app_domain->app_id, inode);
     }
-  G_UNLOCK(domain_inodes);
+  g_mutex_unlock (&by_app_domain->inodes_mutex);
 
   return g_steal_pointer (&inode);
 }
@@ -1667,7 +2628,7 @@ ensure_doc_inode (XdpInode *parent,
        !app_can_see_doc (doc_entry, parent_domain->app_id)))
     return NULL;
 
-  G_LOCK(domain_inodes);
+  g_mutex_lock (&parent_domain->inodes_mutex);
   inode = g_hash_table_lookup (parent_domain->inodes, doc_id);
   if (inode != NULL)
     inode = xdp_inode_ref (inode);
@@ -1678,7 +2639,7 @@ ensure_doc_inode (XdpInode *parent,
       inode = xdp_inode_new (doc_domain, NULL);
       g_hash_table_insert (parent_domain->inodes, doc_domain->doc_id, inode);
     }
-  G_UNLOCK(domain_inodes);
+  g_mutex_unlock (&parent_domain->inodes_mutex);
 
   return g_steal_pointer (&inode);
 }
@@ -1718,28 +2679,141 @@ doc_domain_queue_entry_invalidate (XdpDomain *doc_domain)
 }
 
 static void
-xdp_fuse_lookup (fuse_req_t req,
-                 fuse_ino_t parent_ino,
-                 const char *name)
+invalidate_clear (Invalidate *invalidate)
 {
-  g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
-  XdpDomain *parent_domain = parent->domain;
-  g_autoptr(XdpInode) inode = NULL;
-  struct fuse_entry_param e;
-  int res, fd;
-  int open_flags = O_PATH|O_NOFOLLOW;
-  const char *op = "LOOKUP";
+  g_free (invalidate->filename);
+}
 
-  g_debug ("LOOKUP %lx:%s", parent_ino, name);
+static GArray *
+invalidates_new (void)
+{
+  GArray *invalidates = g_array_new (FALSE, FALSE, sizeof (Invalidate));
 
-  if (strcmp (name, ".") == 0 || strcmp (name, "..") == 0)
+  g_array_set_clear_func (invalidates, (GDestroyNotify)invalidate_clear);
+  return invalidates;
+}
+
+/* Called with session lock held */
+static void
+send_invalidates (GArray *invalidates)
+{
+  int i;
+
+  for (i = 0; i < invalidates->len; i++)
     {
-      /* We don't set FUSE_CAP_EXPORT_SUPPORT, so should not get
-       * here. But lets make sure we never ever resolve them as that
-       * could be a security issue by escaping the root. */
-      return xdp_reply_err (op, req, ESTALE);
+      Invalidate *invalidate = &g_array_index (invalidates, Invalidate, i);
+
+      if (invalidate->filename)
+        fuse_lowlevel_notify_inval_entry (session, invalidate->ino,
+                                          invalidate->filename, strlen (invalidate->filename));
+      else
+        fuse_lowlevel_notify_inval_inode (session, invalidate->ino, 0, 0);
+    }
+}
+
+static gboolean
+send_invalidates_idle (gpointer user_data)
+{
+  g_autoptr(GArray) invalidates = user_data;
+  XDP_AUTOLOCK (session);
+
+  if (session)
+    send_invalidates (invalidates);
+
+  return FALSE;
+}
+
+/* Don't block, this takes inodes_mutex of the view and document domains */
+static void
+invalidate_other_view (XdpInode   *view_inode,
+                       XdpInode   *inode,
+                       const char *name,
+                       GArray     *invalidates)
+{
+  XdpDomain *view_domain = view_inode->domain;
+  XdpInode *doc_inode;
+  XdpInode *other = NULL;
+  Invalidate inval;
+
+  g_mutex_lock (&view_domain->inodes_mutex);
+
+  doc_inode = g_hash_table_lookup (view_domain->inodes, inode->domain->doc_id);
+  if (doc_inode != NULL && doc_inode->domain != inode->domain)
+    {
+      if (inode->physical)
+        {
+          g_mutex_lock (&doc_inode->domain->inodes_mutex);
+          other = g_hash_table_lookup (doc_inode->domain->inodes, inode->physical);
+          /* If the kernel doesn't know the inode it can't have cached anything about it */
+          if (other != NULL && g_atomic_int_get (&other->kernel_ref_count) > 0)
+            {
+              inval.ino = xdp_inode_to_ino (other);
+              inval.filename = g_strdup (name);
+              g_array_append_val (invalidates, inval);
+            }
+          g_mutex_unlock (&doc_inode->domain->inodes_mutex);
+        }
+      else if (g_atomic_int_get (&doc_inode->kernel_ref_count) > 0)
+        {
+          inval.ino = xdp_inode_to_ino (doc_inode);
+          inval.filename = g_strdup (name);
+          g_array_append_val (invalidates, inval);
+        }
     }
 
+  g_mutex_unlock (&view_domain->inodes_mutex);
+}
+
+/* When the kernel is allowed to cache entries and attributes, a change
+ * done through one view of a document (i.e. root/$DOC or
+ * by-app/$APP/$DOC) has to be invalidated in all the other views,
+ * because the kernel doesn't know they are backed by the same files.
+ * If @name is non-NULL the entry @name in @inode is invalidated,
+ * otherwise the attributes of @inode are.
+ *
+ * This is typically called from the handler of the operation that did
+ * the change, where calling into the kernel could deadlock, so the
+ * actual notification is sent from the main thread.
+ */
+static void
+queue_invalidate_other_views (XdpInode   *inode,
+                              const char *name)
+{
+  g_autoptr(GArray) invalidates = NULL;
+  GHashTableIter iter;
+  gpointer value;
+
+  if (document_cache_timeout <= 0.0)
+    return;
+
+  g_assert (inode->domain->type == XDP_DOMAIN_DOCUMENT);
+
+  invalidates = invalidates_new ();
+
+  invalidate_other_view (root_inode, inode, name, invalidates);
+
+  g_mutex_lock (&by_app_inode->domain->inodes_mutex);
+  g_hash_table_iter_init (&iter, by_app_inode->domain->inodes);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    invalidate_other_view ((XdpInode *)value, inode, name, invalidates);
+  g_mutex_unlock (&by_app_inode->domain->inodes_mutex);
+
+  if (invalidates->len > 0)
+    g_idle_add (send_invalidates_idle, g_steal_pointer (&invalidates));
+}
+
+/* Looks up @name in @parent, and on success fills in @e, including a
+ * kernel ref on the resulting inode. */
+static int
+xdp_lookup_entry (XdpInode                *parent,
+                  const char              *name,
+                  struct fuse_entry_param *e)
+{
+  XdpDomain *parent_domain = parent->domain;
+  g_autoptr(XdpInode) inode = NULL;
+  int res, fd;
+  int open_flags = O_PATH|O_NOFOLLOW;
+
   if (xdp_domain_is_virtual_type (parent_domain))
     {
       switch (parent_domain->type)
@@ -1761,9 +2835,9 @@ xdp_fuse_lookup (fuse_req_t req,
         }
 
       if (inode == NULL)
-        return xdp_reply_err (op, req, ENOENT);
+        return -ENOENT;
 
-      prepare_reply_virtual_entry (inode, &e);
+      prepare_reply_virtual_entry (inode, e);
     }
   else
     {
@@ -1771,15 +2845,44 @@ xdp_fuse_lookup (fuse_req_t req,
 
       fd = xdp_document_inode_open_child_fd (parent, name, open_flags, 0);
       if (fd < 0)
-        return xdp_reply_err (op, req, -fd);
+        return fd;
 
-      res = ensure_docdir_inode (parent, fd, &e, NULL); /* Takes ownershif of fd */
+      res = ensure_docdir_inode (parent, fd, document_child_disk_name (parent, name),
+                                 e, NULL); /* Takes ownershif of fd */
       if (res != 0)
-        return xdp_reply_err (op, req, -res);
+        return res;
 
       doc_domain_queue_entry_invalidate (parent_domain);
     }
 
+  return 0;
+}
+
+static void
+xdp_fuse_lookup (fuse_req_t req,
+                 fuse_ino_t parent_ino,
+                 const char *name)
+{
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_LOOKUP);
+  g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
+  struct fuse_entry_param e;
+  int res;
+  const char *op = "LOOKUP";
+
+  g_debug ("LOOKUP %lx:%s", parent_ino, name);
+
+  if (strcmp (name, ".") == 0 || strcmp (name, "..") == 0)
+    {
+      /* We don't set FUSE_CAP_EXPORT_SUPPORT, so should not get
+       * here. But lets make sure we never ever resolve them as that
+       * could be a security issue by escaping the root. */
+      return xdp_reply_err (op, req, ESTALE);
+    }
+
+  res = xdp_lookup_entry (parent, name, &e);
+  if (res != 0)
+    return xdp_reply_err (op, req, -res);
+
   g_debug ("LOOKUP %lx:%s => %lx", parent_ino, name, e.ino);
 
   if (fuse_reply_entry (req, &e) == -ENOENT)
@@ -1795,22 +2898,64 @@ xdp_file_new (int fd)
 }
 
 static void
-xdp_file_free (XdpFile *file)
+xdp_file_free (fuse_req_t req,
+               XdpFile   *file)
 {
+#ifdef HAVE_FUSE_PASSTHROUGH
+  if (file->backing_id > 0)
+    fuse_passthrough_close (req, file->backing_id);
+#endif
   close (file->fd);
   g_free (file);
 }
 
+/* If possible, have the kernel do read and write directly on the
+ * backing fd, otherwise they go through xdp_fuse_read() and
+ * xdp_fuse_write_buf() as before. */
+static void
+xdp_file_setup_passthrough (fuse_req_t             req,
+                            XdpFile               *file,
+                            struct fuse_file_info *fi)
+{
+#ifdef HAVE_FUSE_PASSTHROUGH
+  int backing_id;
+  int errsv;
+
+  if (!g_atomic_int_get (&use_passthrough))
+    return;
+
+  backing_id = fuse_passthrough_open (req, file->fd);
+  errsv = errno;
+  if (backing_id <= 0)
+    {
+      /* The kernel only allows CAP_SYS_ADMIN to register backing files,
+       * so don't try again. Other errors (like the backing file being on
+       * a stacked filesystem) only affect this file. */
+      if (errsv == EPERM)
+        {
+          g_debug ("Passthrough not permitted, disabling");
+          g_atomic_int_set (&use_passthrough, 0);
+        }
+      return;
+    }
+
+  file->backing_id = backing_id;
+  fi->backing_id = backing_id;
+#endif
+}
+
 static void
 xdp_fuse_open (fuse_req_t req,
                fuse_ino_t ino,
                struct fuse_file_info *fi)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_OPEN);
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   int open_flags = fi->flags;
   g_autofree char *open_flags_string = open_flags_to_string (open_flags);
   int fd;
   g_autofree char *path = NULL;
+  xdp_autofd int physical_fd = -1;
   XdpFile *file = NULL;
   XdpDocumentChecks checks;
   const char *op = "OPEN";
@@ -1825,18 +2970,23 @@ xdp_fuse_open (fuse_req_t req,
   if (!xdp_document_inode_checks (op, req, inode, checks))
     return;
 
-  path = fd_to_path (inode->physical->fd);
+  physical_fd = xdp_physical_inode_dup_fd (inode->physical);
+  if (physical_fd < 0)
+    return xdp_reply_err (op, req, -physical_fd);
+
+  path = fd_to_path (physical_fd);
   fd = open (path, open_flags, 0);
   if (fd == -1)
     return xdp_reply_err (op, req, errno);
 
   file = xdp_file_new (fd);
+  xdp_file_setup_passthrough (req, file, fi);
 
   fi->fh = (gsize)file;
   if (fuse_reply_open (req, fi) == -ENOENT)
     {
       /* The open syscall was interrupted, so it  must be cancelled */
-      xdp_file_free (file);
+      xdp_file_free (req, file);
     }
 }
 
@@ -1847,6 +2997,7 @@ xdp_fuse_create (fuse_req_t             req,
                  mode_t                 mode,
                  struct fuse_file_info *fi)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_CREATE);
   g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
   int open_flags = fi->flags;
   g_autofree char *open_flags_string = open_flags_to_string (open_flags);
@@ -1874,17 +3025,20 @@ xdp_fuse_create (fuse_req_t             req,
   if (o_path_fd < 0)
     return xdp_reply_err (op, req, errno);
 
-  res = ensure_docdir_inode (parent, xdp_steal_fd (&o_path_fd), &e, NULL); /* Takes ownershif of o_path_fd */
+  res = ensure_docdir_inode (parent, xdp_steal_fd (&o_path_fd),
+                             document_child_disk_name (parent, filename),
+                             &e, NULL); /* Takes ownershif of o_path_fd */
   if (res != 0)
     return xdp_reply_err (op, req, -res);
 
   file = xdp_file_new (xdp_steal_fd (&fd)); /* Takes ownership of fd */
+  xdp_file_setup_passthrough (req, file, fi);
 
   fi->fh = (gsize)file;
   if (fuse_reply_create (req, &e, fi) == -ENOENT)
     {
       /* The open syscall was interrupted, so it  must be cancelled */
-      xdp_file_free (file);
+      xdp_file_free (req, file);
       abort_reply_entry (&e);
     }
 }
@@ -1896,6 +3050,7 @@ xdp_fuse_read (fuse_req_t req,
                off_t off,
                struct fuse_file_info *fi)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_READ);
   struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
   XdpFile *file = (XdpFile *)fi->fh;
 
@@ -1917,6 +3072,7 @@ xdp_fuse_write (fuse_req_t             req,
                 off_t                  off,
                 struct fuse_file_info *fi)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_WRITE);
   XdpFile *file = (XdpFile *)fi->fh;
   ssize_t res;
   const char *op = "WRITE";
@@ -1938,6 +3094,7 @@ xdp_fuse_write_buf (fuse_req_t             req,
                     off_t                  off,
                     struct fuse_file_info *fi)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_WRITE);
   XdpFile *file = (XdpFile *)fi->fh;
   struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
   ssize_t res;
@@ -1962,6 +3119,7 @@ xdp_fuse_fsync (fuse_req_t             req,
                 int                    datasync,
                 struct fuse_file_info *fi)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_FSYNC);
   XdpFile *file = (XdpFile *)fi->fh;
   int res;
   const char *op = "FSYNC";
@@ -1986,6 +3144,7 @@ xdp_fuse_fallocate (fuse_req_t req,
                     off_t length,
                     struct fuse_file_info *fi)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_FALLOCATE);
   XdpFile *file = (XdpFile *)fi->fh;
   int res;
   const char *op = "FALLOCATE";
@@ -2000,11 +3159,66 @@ xdp_fuse_fallocate (fuse_req_t req,
     xdp_reply_err (op, req, errno);
 }
 
+/* This lets the backing filesystem do the copy, which can be a reflink
+ * or a server side copy, instead of passing all the data through us */
+static void
+xdp_fuse_copy_file_range (fuse_req_t             req,
+                          fuse_ino_t             ino_in,
+                          off_t                  off_in,
+                          struct fuse_file_info *fi_in,
+                          fuse_ino_t             ino_out,
+                          off_t                  off_out,
+                          struct fuse_file_info *fi_out,
+                          size_t                 len,
+                          int                    flags)
+{
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_COPY_FILE_RANGE);
+  XdpFile *file_in = (XdpFile *)fi_in->fh;
+  XdpFile *file_out = (XdpFile *)fi_out->fh;
+  ssize_t res;
+  const char *op = "COPY_FILE_RANGE";
+
+  g_debug ("COPY_FILE_RANGE %lx %lu -> %lx %lu (%lu bytes)",
+           ino_in, (unsigned long)off_in, ino_out, (unsigned long)off_out, len);
+
+  res = copy_file_range (file_in->fd, &off_in, file_out->fd, &off_out, len, flags);
+  if (res < 0)
+    return xdp_reply_err (op, req, errno);
+
+  fuse_reply_write (req, res);
+}
+
+static void
+xdp_fuse_lseek (fuse_req_t             req,
+                fuse_ino_t             ino,
+                off_t                  off,
+                int                    whence,
+                struct fuse_file_info *fi)
+{
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_LSEEK);
+  XdpFile *file = (XdpFile *)fi->fh;
+  off_t res;
+  const char *op = "LSEEK";
+
+  g_debug ("LSEEK %lx %lu %d", ino, (unsigned long)off, whence);
+
+  /* The kernel handles the other cases itself */
+  if (whence != SEEK_DATA && whence != SEEK_HOLE)
+    return xdp_reply_err (op, req, EINVAL);
+
+  res = lseek (file->fd, off, whence);
+  if (res < 0)
+    return xdp_reply_err (op, req, errno);
+
+  fuse_reply_lseek (req, res);
+}
+
 static void
 xdp_fuse_flush (fuse_req_t req,
                 fuse_ino_t ino,
                 struct fuse_file_info *fi)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_FLUSH);
   const char *op = "FLUSH";
 
   g_debug ("FLUSH %lx", ino);
@@ -2016,12 +3230,20 @@ xdp_fuse_release (fuse_req_t             req,
                   fuse_ino_t             ino,
                   struct fuse_file_info *fi)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_RELEASE);
   XdpFile *file = (XdpFile *)fi->fh;
   const char *op = "RELEASE";
 
   g_debug ("RELEASE %lx", ino);
 
-  xdp_file_free (file);
+  xdp_file_free (req, file);
+
+  /* Writes change size and mtime, which other views may have cached */
+  if (document_cache_timeout > 0.0 && (fi->flags & O_ACCMODE) != O_RDONLY)
+    {
+      g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
+      queue_invalidate_other_views (inode, NULL);
+    }
 
   xdp_reply_err (op, req, 0);
 }
@@ -2041,6 +3263,7 @@ xdp_fuse_forget (fuse_req_t req,
                  fuse_ino_t ino,
                  unsigned long nlookup)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_FORGET);
   forget_one (ino, nlookup);
   fuse_reply_none (req);
 }
@@ -2050,6 +3273,7 @@ xdp_fuse_forget_multi (fuse_req_t req,
                        size_t count,
                        struct fuse_forget_data *forgets)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_FORGET);
   size_t i;
 
   g_debug ("FORGET_MULTI %ld", count);
@@ -2060,34 +3284,31 @@ xdp_fuse_forget_multi (fuse_req_t req,
   fuse_reply_none (req);
 }
 
+static void
+xdp_dir_entry_clear (XdpDirEntry *entry)
+{
+  g_free (entry->name);
+}
+
 static void
 xdp_dir_free (XdpDir *d)
 {
   if (d->dir)
     closedir (d->dir);
-  g_free (d->dirbuf);
+  g_clear_pointer (&d->entries, g_array_unref);
   g_free (d);
 }
 
 static void
 xdp_dir_add (XdpDir        *d,
-             fuse_req_t     req,
              const char    *name,
              mode_t         mode)
 {
-  struct stat stbuf;
+  XdpDirEntry entry;
 
-  size_t oldsize = d->dirbuf_size;
-
-  d->dirbuf_size += fuse_add_direntry (req, NULL, 0, name, NULL, 0);
-  d->dirbuf = (char *) g_realloc (d->dirbuf, d->dirbuf_size);
-  memset (&stbuf, 0, sizeof (stbuf));
-  stbuf.st_ino = FUSE_UNKNOWN_INO;
-  stbuf.st_mode = mode;
-  fuse_add_direntry (req, d->dirbuf + oldsize,
-                     d->dirbuf_size - oldsize,
-                     name, &stbuf,
-                     d->dirbuf_size);
+  entry.name = g_strdup (name);
+  entry.mode = mode;
+  g_array_append_val (d->entries, entry);
 }
 
 static XdpDir *
@@ -2101,41 +3322,35 @@ xdp_dir_new_physical (DIR *dir)
 }
 
 static XdpDir *
-xdp_dir_new_buffered (fuse_req_t  req)
+xdp_dir_new_buffered (void)
 {
   XdpDir *d = g_new0 (XdpDir, 1);
-  xdp_dir_add (d, req, ".", S_IFDIR);
-  xdp_dir_add (d, req, "..", S_IFDIR);
+  d->entries = g_array_new (FALSE, FALSE, sizeof (XdpDirEntry));
+  g_array_set_clear_func (d->entries, (GDestroyNotify)xdp_dir_entry_clear);
+  xdp_dir_add (d, ".", S_IFDIR);
+  xdp_dir_add (d, "..", S_IFDIR);
   return d;
 }
 
 static void
 xdp_dir_add_docs (XdpDir     *d,
-                  fuse_req_t  req,
                   const char *for_app_id)
 {
   g_auto(GStrv) docs = NULL;
   int i;
 
-  docs = xdp_list_docs ();
-  for (i = 0; docs[i] != NULL; i++)
-    {
-      if (for_app_id)
-        {
-          g_autoptr(PermissionDbEntry) entry = xdp_lookup_doc (docs[i]);
-          if (entry == NULL ||
-              !app_can_see_doc (entry, for_app_id))
-            continue;
-        }
+  if (for_app_id)
+    docs = xdp_list_docs_for_app (for_app_id);
+  else
+    docs = xdp_list_docs ();
 
-      xdp_dir_add (d, req, docs[i], S_IFDIR);
-    }
+  for (i = 0; docs[i] != NULL; i++)
+    xdp_dir_add (d, docs[i], S_IFDIR);
 }
 
 static void
 xdp_dir_add_apps (XdpDir     *d,
                   XdpDomain  *domain,
-                  fuse_req_t  req,
                   const char *for_app_id)
 {
   g_auto(GStrv) apps = NULL;
@@ -2145,7 +3360,7 @@ xdp_dir_add_apps (XdpDir     *d,
   /* First all pre-used apps as these can be created on demand */
   names = xdp_domain_get_inode_keys_as_string (domain);
   for (i = 0; names[i] != NULL; i++)
-    xdp_dir_add (d, req, names[i], S_IFDIR);
+    xdp_dir_add (d, names[i], S_IFDIR);
 
   /* Then all in the db (that don't already have inodes) */
   apps = xdp_list_apps ();
@@ -2153,7 +3368,7 @@ xdp_dir_add_apps (XdpDir     *d,
     {
       const char *app = apps[i];
       if (!g_strv_contains ((const gchar * const *)names, app))
-        xdp_dir_add (d, req, app, S_IFDIR);
+        xdp_dir_add (d, app, S_IFDIR);
     }
 }
 
@@ -2162,6 +3377,7 @@ xdp_fuse_opendir (fuse_req_t             req,
                   fuse_ino_t             ino,
                   struct fuse_file_info *fi)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_OPENDIR);
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   XdpDomain *domain = inode->domain;
   XdpDir *d = NULL;
@@ -2173,18 +3389,18 @@ xdp_fuse_opendir (fuse_req_t             req,
 
   if (xdp_domain_is_virtual_type (domain))
     {
-      d = xdp_dir_new_buffered (req);
+      d = xdp_dir_new_buffered ();
       switch (domain->type)
         {
         case XDP_DOMAIN_ROOT:
-          xdp_dir_add (d, req, BY_APP_NAME, S_IFDIR);
-          xdp_dir_add_docs (d, req, NULL);
+          xdp_dir_add (d, BY_APP_NAME, S_IFDIR);
+          xdp_dir_add_docs (d, NULL);
           break;
         case XDP_DOMAIN_APP:
-          xdp_dir_add_docs (d, req, domain->app_id);
+          xdp_dir_add_docs (d, domain->app_id);
           break;
         case XDP_DOMAIN_BY_APP:
-          xdp_dir_add_apps (d, inode->domain, req, NULL);
+          xdp_dir_add_apps (d, inode->domain, NULL);
           break;
         default:
           g_assert_not_reached ();
@@ -2198,7 +3414,13 @@ xdp_fuse_opendir (fuse_req_t             req,
         {
           if (inode->physical)
             {
-              int fd = openat (inode->physical->fd, ".", open_flags, 0);
+              xdp_autofd int physical_fd = xdp_physical_inode_dup_fd (inode->physical);
+              int fd;
+
+              if (physical_fd < 0)
+                return xdp_reply_err (op, req, -physical_fd);
+
+              fd = openat (physical_fd, ".", open_flags, 0);
               if (fd < 0)
                 return xdp_reply_err (op, req, errno);
 
@@ -2216,13 +3438,13 @@ xdp_fuse_opendir (fuse_req_t             req,
             {
               struct stat buf;
 
-              d = xdp_dir_new_buffered (req);
+              d = xdp_dir_new_buffered ();
 
               if (stat (domain->doc_path, &buf) == 0 &&
                   buf.st_ino == domain->doc_dir_inode &&
                   buf.st_dev == domain->doc_dir_device)
                 {
-                  xdp_dir_add (d, req, domain->doc_file, buf.st_mode);
+                  xdp_dir_add (d, domain->doc_file, buf.st_mode);
                 }
             }
         }
@@ -2233,10 +3455,10 @@ xdp_fuse_opendir (fuse_req_t             req,
           GHashTableIter iter;
           gpointer key, value;
 
-          d = xdp_dir_new_buffered (req);
+          d = xdp_dir_new_buffered ();
 
           if (stat (main_path, &buf) == 0)
-            xdp_dir_add (d, req, domain->doc_file, buf.st_mode);
+            xdp_dir_add (d, domain->doc_file, buf.st_mode);
 
           g_mutex_lock (&domain->tempfile_mutex);
 
@@ -2244,7 +3466,7 @@ xdp_fuse_opendir (fuse_req_t             req,
           while (g_hash_table_iter_next (&iter, &key, &value))
             {
               const char *tempname = key;
-              xdp_dir_add (d, req, tempname, S_IFREG);
+              xdp_dir_add (d, tempname, S_IFREG);
             }
 
           g_mutex_unlock (&domain->tempfile_mutex);
@@ -2260,30 +3482,102 @@ xdp_fuse_opendir (fuse_req_t             req,
     }
 }
 
+/* Adds an entry to the reply buffer at @p, returning the size used,
+ * or 0 if it doesn't fit. For readdirplus this looks up the entry,
+ * and the kernel ref taken for it is recorded in @entry_inos. */
+static size_t
+xdp_dir_add_reply_entry (fuse_req_t  req,
+                         XdpInode   *parent,
+                         char       *p,
+                         size_t      rem,
+                         const char *name,
+                         mode_t      mode,
+                         off_t       nextoff,
+                         GArray     *entry_inos)
+{
+  size_t entsize;
+
+  if (entry_inos)
+    {
+      struct fuse_entry_param e = {0};
+
+      /* Check the size first to avoid a lookup we can't return */
+      entsize = fuse_add_direntry_plus (req, NULL, 0, name, NULL, 0);
+      if (entsize > rem)
+        return 0;
+
+      /* An ino of 0 tells the kernel we did no lookup for the entry (and
+       * took no ref). We do that for entries in documents when caching
+       * is disabled, as the kernel would just look them up again anyway. */
+      if (strcmp (name, ".") == 0 || strcmp (name, "..") == 0 ||
+          (parent->domain->type == XDP_DOMAIN_DOCUMENT && document_cache_timeout <= 0.0) ||
+          xdp_lookup_entry (parent, name, &e) != 0)
+        {
+          memset (&e, 0, sizeof (e));
+          e.attr.st_ino = FUSE_UNKNOWN_INO;
+          e.attr.st_mode = mode;
+        }
+      else
+        g_array_append_val (entry_inos, e.ino);
+
+      fuse_add_direntry_plus (req, p, rem, name, &e, nextoff);
+    }
+  else
+    {
+      struct stat st = {
+        .st_ino = FUSE_UNKNOWN_INO,
+        .st_mode = mode,
+      };
+
+      entsize = fuse_add_direntry (req, p, rem, name, &st, nextoff);
+      /* The above function returns the size of the entry size even though
+       * the copy failed due to smaller buf size, so I'm checking after this
+       * function and breaking out incase we exceed the size.
+       */
+      if (entsize > rem)
+        return 0;
+    }
+
+  return entsize;
+}
+
 static void
-xdp_fuse_readdir (fuse_req_t req,
-                  fuse_ino_t ino,
-                  size_t size,
-                  off_t off,
-                  struct fuse_file_info *fi)
+xdp_fuse_do_readdir (fuse_req_t             req,
+                     fuse_ino_t             ino,
+                     size_t                 size,
+                     off_t                  off,
+                     struct fuse_file_info *fi,
+                     gboolean               plus)
 {
   XdpDir *d = (XdpDir *)fi->fh;
+  g_autoptr(XdpInode) parent = NULL;
+  g_autoptr(GArray) entry_inos = NULL;
+  g_autofree char *buf = NULL;
   char *p;
   size_t rem;
-  const char *op = "READDIR";
+  int i;
+  const char *op = plus ? "READDIRPLUS" : "READDIR";
 
-  g_debug ("READDIR %lx %ld %ld", ino, size, off);
+  g_debug ("%s %lx %ld %ld", op, ino, size, off);
 
-  if (d->dir)
+  if (plus)
     {
-      g_autofree char *buf = g_try_malloc (size);
+      parent = xdp_inode_from_ino (ino);
+      entry_inos = g_array_new (FALSE, FALSE, sizeof (fuse_ino_t));
+    }
 
-      if (buf == NULL)
-        {
-          xdp_reply_err (op, req, ENOMEM);
-          return;
-        }
+  buf = g_try_malloc (size);
+  if (buf == NULL)
+    {
+      xdp_reply_err (op, req, ENOMEM);
+      return;
+    }
+
+  p = buf;
+  rem = size;
 
+  if (d->dir)
+    {
       /* If offset is not same, need to seek it */
       if (off != d->offset)
         {
@@ -2292,8 +3586,6 @@ xdp_fuse_readdir (fuse_req_t req,
           d->offset = off;
         }
 
-      p = buf;
-      rem = size;
       while (TRUE)
         {
           size_t entsize;
@@ -2315,17 +3607,10 @@ xdp_fuse_readdir (fuse_req_t req,
             }
           nextoff = telldir (d->dir);
 
-          struct stat st = {
-            .st_ino = FUSE_UNKNOWN_INO,
-            .st_mode = d->entry->d_type << 12,
-          };
-          entsize = fuse_add_direntry (req, p, rem,
-                                       d->entry->d_name, &st, nextoff);
-          /* The above function returns the size of the entry size even though
-           * the copy failed due to smaller buf size, so I'm checking after this
-           * function and breaking out incase we exceed the size.
-           */
-          if (entsize > rem)
+          entsize = xdp_dir_add_reply_entry (req, parent, p, rem,
+                                             d->entry->d_name, d->entry->d_type << 12,
+                                             nextoff, entry_inos);
+          if (entsize == 0)
             break;
 
           p += entsize;
@@ -2334,27 +3619,65 @@ xdp_fuse_readdir (fuse_req_t req,
           d->entry = NULL;
           d->offset = nextoff;
         }
-
-      fuse_reply_buf(req, buf, size - rem);
     }
   else
     {
-      if (off < d->dirbuf_size)
+      /* For buffered dirs the offset is the index of the next entry */
+      for (i = MAX (off, 0); i < d->entries->len; i++)
         {
-          gsize reply_size = MIN (d->dirbuf_size - off, size);
-          g_autofree char *buf = g_memdup (d->dirbuf + off, reply_size);
-          fuse_reply_buf (req, buf, reply_size);
+          XdpDirEntry *entry = &g_array_index (d->entries, XdpDirEntry, i);
+          size_t entsize;
+
+          entsize = xdp_dir_add_reply_entry (req, parent, p, rem,
+                                             entry->name, entry->mode,
+                                             i + 1, entry_inos);
+          if (entsize == 0)
+            break;
+
+          p += entsize;
+          rem -= entsize;
+        }
+    }
+
+  if (fuse_reply_buf (req, buf, size - rem) == -ENOENT && entry_inos)
+    {
+      /* The readdir was interrupted, so return the refs we took for the kernel */
+      for (i = 0; i < entry_inos->len; i++)
+        {
+          g_autoptr(XdpInode) inode = xdp_inode_from_ino (g_array_index (entry_inos, fuse_ino_t, i));
+          xdp_inode_kernel_unref (inode, 1);
         }
-      else
-        fuse_reply_buf (req, NULL, 0);
     }
 }
 
+static void
+xdp_fuse_readdir (fuse_req_t req,
+                  fuse_ino_t ino,
+                  size_t size,
+                  off_t off,
+                  struct fuse_file_info *fi)
+{
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_READDIR);
+  xdp_fuse_do_readdir (req, ino, size, off, fi, FALSE);
+}
+
+static void
+xdp_fuse_readdirplus (fuse_req_t req,
+                      fuse_ino_t ino,
+                      size_t size,
+                      off_t off,
+                      struct fuse_file_info *fi)
+{
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_READDIR);
+  xdp_fuse_do_readdir (req, ino, size, off, fi, TRUE);
+}
+
 static void
 xdp_fuse_releasedir (fuse_req_t             req,
                      fuse_ino_t             ino,
                      struct fuse_file_info *fi)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_RELEASEDIR);
   XdpDir *d = (XdpDir *)fi->fh;
   const char *op = "RELEASEDIR";
 
@@ -2371,6 +3694,7 @@ xdp_fuse_fsyncdir (fuse_req_t             req,
                    int                    datasync,
                    struct fuse_file_info *fi)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_FSYNCDIR);
   XdpDir *dir = (XdpDir *)fi->fh;
   int fd, res;
   const char *op = "FSYNCDIR";
@@ -2400,6 +3724,7 @@ xdp_fuse_mkdir (fuse_req_t  req,
                 const char *name,
                 mode_t mode)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_MKDIR);
   g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
   struct fuse_entry_param e;
   int res;
@@ -2436,6 +3761,7 @@ xdp_fuse_unlink (fuse_req_t  req,
                  fuse_ino_t  parent_ino,
                  const char *filename)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_UNLINK);
   g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
   XdpDomain *parent_domain = parent->domain;
   int res = -1;
@@ -2450,7 +3776,11 @@ xdp_fuse_unlink (fuse_req_t  req,
 
   if (parent->physical)
     {
-      res = unlinkat (parent->physical->fd, filename, 0);
+      xdp_autofd int dirfd = xdp_physical_inode_dup_fd (parent->physical);
+      if (dirfd < 0)
+        return xdp_reply_err (op, req, -dirfd);
+
+      res = unlinkat (dirfd, filename, 0);
       if (res != 0)
         return xdp_reply_err (op, req, errno);
     }
@@ -2485,6 +3815,8 @@ xdp_fuse_unlink (fuse_req_t  req,
     }
 
   xdp_reply_err (op, req, 0);
+
+  queue_invalidate_other_views (parent, filename);
 }
 
 static int
@@ -2517,6 +3849,7 @@ xdp_fuse_rename (fuse_req_t  req,
                  const char *newname,
                  unsigned int flags)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_RENAME);
   g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
   g_autoptr(XdpInode) newparent = xdp_inode_from_ino (newparent_ino);
   g_autofree char *rename_flags_string = renameat2_flags_to_string (flags);
@@ -2554,7 +3887,14 @@ xdp_fuse_rename (fuse_req_t  req,
       if (res != 0)
         return xdp_reply_err (op, req, errno);
 
+      xdp_document_inode_update_location (newparent, newdirfd, newname);
+      if (flags & RENAME_EXCHANGE)
+        xdp_document_inode_update_location (parent, olddirfd, name);
+
       xdp_reply_err (op, req, 0);
+
+      queue_invalidate_other_views (parent, name);
+      queue_invalidate_other_views (newparent, newname);
     }
   else
     {
@@ -2602,6 +3942,9 @@ xdp_fuse_rename (fuse_req_t  req,
             return xdp_reply_err (op, req, -res);
 
           xdp_reply_err (op, req, 0);
+
+          queue_invalidate_other_views (parent, name);
+          queue_invalidate_other_views (parent, newname);
         }
       else if (strcmp (newname, domain->doc_file) == 0)
         {
@@ -2638,7 +3981,12 @@ xdp_fuse_rename (fuse_req_t  req,
           if (res != 0)
             return xdp_reply_err (op, req, errsv);
 
+          xdp_document_inode_update_location (parent, dirfd, newname);
+
           xdp_reply_err (op, req, 0);
+
+          queue_invalidate_other_views (parent, name);
+          queue_invalidate_other_views (parent, newname);
         }
       else
         {
@@ -2667,6 +4015,9 @@ xdp_fuse_rename (fuse_req_t  req,
             return xdp_reply_err (op, req, ENOENT);
 
           xdp_reply_err (op, req, 0);
+
+          queue_invalidate_other_views (parent, name);
+          queue_invalidate_other_views (parent, newname);
         }
     }
 }
@@ -2676,8 +4027,10 @@ xdp_fuse_access (fuse_req_t req,
                  fuse_ino_t ino,
                  int mask)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_ACCESS);
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   g_autofree char *path = NULL;
+  xdp_autofd int physical_fd = -1;
   int res;
   const char *op = "ACCESS";
 
@@ -2699,7 +4052,11 @@ xdp_fuse_access (fuse_req_t req,
 
   if (inode->physical)
     {
-      path = fd_to_path (inode->physical->fd);
+      physical_fd = xdp_physical_inode_dup_fd (inode->physical);
+      if (physical_fd < 0)
+        return xdp_reply_err (op, req, -physical_fd);
+
+      path = fd_to_path (physical_fd);
       res = access (path, mask);
     }
   else
@@ -2726,6 +4083,7 @@ xdp_fuse_rmdir (fuse_req_t req,
                 fuse_ino_t parent_ino,
                 const char *filename)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_RMDIR);
   g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
   xdp_autofd int close_fd = -1;
   int dirfd;
@@ -2746,18 +4104,22 @@ xdp_fuse_rmdir (fuse_req_t req,
 
   res = unlinkat (dirfd, filename, AT_REMOVEDIR);
   if (res != 0)
-    xdp_reply_err (op, req, errno);
+    return xdp_reply_err (op, req, errno);
 
   xdp_reply_err (op, req, 0);
+
+  queue_invalidate_other_views (parent, filename);
 }
 
 static void
 xdp_fuse_readlink (fuse_req_t req,
                    fuse_ino_t ino)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_READLINK);
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   char linkname[PATH_MAX + 1];
   ssize_t res;
+  xdp_autofd int physical_fd = -1;
   const char *op = "READLINK";
 
   g_debug ("READLINK %lx", ino);
@@ -2770,7 +4132,11 @@ xdp_fuse_readlink (fuse_req_t req,
   if (inode->physical == NULL)
     return xdp_reply_err (op, req, EINVAL);
 
-  res = readlinkat (inode->physical->fd, "", linkname, sizeof(linkname));
+  physical_fd = xdp_physical_inode_dup_fd (inode->physical);
+  if (physical_fd < 0)
+    return xdp_reply_err (op, req, -physical_fd);
+
+  res = readlinkat (physical_fd, "", linkname, sizeof(linkname));
   if (res < 0)
     return xdp_reply_err (op, req, errno);
 
@@ -2784,6 +4150,7 @@ xdp_fuse_symlink (fuse_req_t req,
                   fuse_ino_t parent_ino,
                   const char *name)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_SYMLINK);
   g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
   int res;
   int dirfd;
@@ -2821,12 +4188,14 @@ xdp_fuse_link (fuse_req_t req,
                fuse_ino_t newparent_ino,
                const char *newname)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_LINK);
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   g_autoptr(XdpInode) newparent = xdp_inode_from_ino (newparent_ino);
   int res;
   g_autofree char *proc_path = NULL;
   int newparent_dirfd;
   xdp_autofd int close_fd = -1;
+  xdp_autofd int physical_fd = -1;
   struct fuse_entry_param e;
   const char * op = "LINK";
 
@@ -2843,7 +4212,11 @@ xdp_fuse_link (fuse_req_t req,
   if (inode->domain != newparent->domain)
     return xdp_reply_err (op, req, EXDEV);
 
-  proc_path = fd_to_path (inode->physical->fd);
+  physical_fd = xdp_physical_inode_dup_fd (inode->physical);
+  if (physical_fd < 0)
+    return xdp_reply_err (op, req, -physical_fd);
+
+  proc_path = fd_to_path (physical_fd);
   newparent_dirfd = xdp_document_inode_ensure_dirfd (newparent, &close_fd);
   if (newparent_dirfd < 0)
     return xdp_reply_err (op, req, -newparent_dirfd);
@@ -2865,9 +4238,11 @@ static void
 xdp_fuse_statfs (fuse_req_t req,
                  fuse_ino_t ino)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_STATFS);
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   struct statvfs buf;
   int res;
+  xdp_autofd int physical_fd = -1;
   const char *op = "STATFS";
 
   g_debug ("STATFS %lx", ino);
@@ -2876,7 +4251,13 @@ xdp_fuse_statfs (fuse_req_t req,
     return;
 
   if (inode->physical)
-    res = fstatvfs (inode->physical->fd, &buf);
+    {
+      physical_fd = xdp_physical_inode_dup_fd (inode->physical);
+      if (physical_fd < 0)
+        return xdp_reply_err (op, req, -physical_fd);
+
+      res = fstatvfs (physical_fd, &buf);
+    }
   else
     res = statvfs (inode->domain->doc_path, &buf);
 
@@ -2894,9 +4275,11 @@ xdp_fuse_setxattr (fuse_req_t req,
                    size_t size,
                    int flags)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_XATTR);
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   ssize_t res;
   g_autofree char *path = NULL;
+  xdp_autofd int physical_fd = -1;
   const char *op = "SETXATTR";
 
   g_debug ("SETXATTR %lx %s", ino, name);
@@ -2907,7 +4290,11 @@ xdp_fuse_setxattr (fuse_req_t req,
                                   CHECK_IS_PHYSICAL))
     return;
 
-  path = fd_to_path (inode->physical->fd);
+  physical_fd = xdp_physical_inode_dup_fd (inode->physical);
+  if (physical_fd < 0)
+    return xdp_reply_err (op, req, -physical_fd);
+
+  path = fd_to_path (physical_fd);
   res = setxattr (path, name, value, size, flags);
 
   if (res < 0)
@@ -2922,10 +4309,12 @@ xdp_fuse_getxattr (fuse_req_t req,
                    const char *name,
                    size_t size)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_XATTR);
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   ssize_t res;
   g_autofree char *buf = NULL;
   g_autofree char *path = NULL;
+  xdp_autofd int close_fd = -1;
   const char *op = "GETXATTR";
 
   g_debug ("GETXATTR %lx %s %ld", ino, name, size);
@@ -2936,7 +4325,10 @@ xdp_fuse_getxattr (fuse_req_t req,
   if (size != 0)
     buf = g_malloc (size);
 
-  path = xdp_document_inode_get_self_as_path (inode);
+  res = xdp_document_inode_get_self_as_path (inode, &path, &close_fd);
+  if (res < 0)
+    return xdp_reply_err (op, req, -res);
+
   if (path == NULL)
     res = ENODATA;
   else
@@ -2955,10 +4347,12 @@ xdp_fuse_listxattr (fuse_req_t req,
                     fuse_ino_t ino,
                     size_t size)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_XATTR);
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   ssize_t res;
   g_autofree char *buf = NULL;
   g_autofree char *path = NULL;
+  xdp_autofd int close_fd = -1;
   const char *op = "LISTXATTR";
 
   g_debug ("LISTXATTR %lx %ld", ino, size);
@@ -2969,7 +4363,10 @@ xdp_fuse_listxattr (fuse_req_t req,
   if (size != 0)
     buf = g_malloc (size);
 
-  path = xdp_document_inode_get_self_as_path (inode);
+  res = xdp_document_inode_get_self_as_path (inode, &path, &close_fd);
+  if (res < 0)
+    return xdp_reply_err (op, req, -res);
+
   if (path)
     res = listxattr (path, buf, size);
   else
@@ -2989,8 +4386,10 @@ xdp_fuse_removexattr (fuse_req_t req,
                       fuse_ino_t ino,
                       const char *name)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_XATTR);
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   g_autofree char *path = NULL;
+  xdp_autofd int physical_fd = -1;
   ssize_t res;
   const char *op = "REMOVEXATTR";
 
@@ -3002,7 +4401,11 @@ xdp_fuse_removexattr (fuse_req_t req,
                                   CHECK_IS_PHYSICAL))
     return;
 
-  path = fd_to_path (inode->physical->fd);
+  physical_fd = xdp_physical_inode_dup_fd (inode->physical);
+  if (physical_fd < 0)
+    return xdp_reply_err (op, req, -physical_fd);
+
+  path = fd_to_path (physical_fd);
   res = removexattr (path, name);
 
   if (res < 0)
@@ -3017,6 +4420,7 @@ xdp_fuse_getlk (fuse_req_t req,
                 struct fuse_file_info *fi,
                 struct flock *lock)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_LOCK);
   const char *op = "GETLK";
 
   g_debug ("GETLK %lx", ino);
@@ -3031,6 +4435,7 @@ xdp_fuse_setlk (fuse_req_t req,
                 struct flock *lock,
                 int sleep)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_LOCK);
   const char *op = "SETLK";
 
   g_debug ("SETLK %lx", ino);
@@ -3044,6 +4449,7 @@ xdp_fuse_flock (fuse_req_t req,
                 struct fuse_file_info *fi,
                 int lock_op)
 {
+  XDP_FUSE_OP_STATS (XDP_FUSE_OP_LOCK);
   const char *op = "FLOCK";
 
   g_debug ("FLOCK %lx", ino);
@@ -3065,6 +4471,17 @@ xdp_fuse_init_cb (void                  *userdata,
   conn->want |= FUSE_CAP_SPLICE_MOVE;
   /* atomic_o_trunc: We handle O_TRUNC in create() */
   conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+  /* readdirplus: return entries with attributes, if the kernel thinks it helps */
+  if (conn->capable & FUSE_CAP_READDIRPLUS)
+    conn->want |= FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO;
+#ifdef HAVE_FUSE_PASSTHROUGH
+  /* passthrough: kernel does read/write directly on our fds, see xdp_file_setup_passthrough() */
+  if (conn->capable & FUSE_CAP_PASSTHROUGH)
+    {
+      conn->want |= FUSE_CAP_PASSTHROUGH;
+      g_atomic_int_set (&use_passthrough, 1);
+    }
+#endif
 }
 
 extern int on_fuse_unmount (void);
@@ -3085,6 +4502,7 @@ static struct fuse_lowlevel_ops xdp_fuse_oper = {
  .getattr      = xdp_fuse_getattr,
  .setattr      = xdp_fuse_setattr,
  .readdir      = xdp_fuse_readdir,
+ .readdirplus  = xdp_fuse_readdirplus,
  .open         = xdp_fuse_open,
  .read         = xdp_fuse_read,
  .write        = xdp_fuse_write,
@@ -3115,6 +4533,8 @@ static struct fuse_lowlevel_ops xdp_fuse_oper = {
  .setlk        = xdp_fuse_setlk,
  .flock        = xdp_fuse_flock,
  .fallocate    = xdp_fuse_fallocate,
+ .copy_file_range = xdp_fuse_copy_file_range,
+ .lseek        = xdp_fuse_lseek,
 };
 
 typedef struct {
@@ -3219,6 +4639,104 @@ xdp_fuse_thread (gpointer data)
   return NULL;
 }
 
+/* Must be called before xdp_fuse_init() */
+void
+xdp_fuse_set_cache_timeout (double timeout)
+{
+  document_cache_timeout = MAX (timeout, 0.0);
+}
+
+/* Must be called before xdp_fuse_init() */
+void
+xdp_fuse_set_inode_map_path (const char *path)
+{
+  g_free (inode_map_path);
+  inode_map_path = g_strdup (path);
+}
+
+/* Must be called before xdp_fuse_init() */
+void
+xdp_fuse_set_fd_budget (guint budget)
+{
+  fd_budget = budget > 0 ? MIN (budget, G_MAXINT) : DEFAULT_FD_BUDGET;
+}
+
+void
+xdp_fuse_get_fd_stats (guint *n_open,
+                       guint *budget,
+                       guint *n_reopened,
+                       guint *n_evicted)
+{
+  if (n_open)
+    *n_open = g_atomic_int_get (&n_open_fds);
+  if (budget)
+    *budget = fd_budget;
+  if (n_reopened)
+    *n_reopened = g_atomic_int_get (&n_reopened_fds);
+  if (n_evicted)
+    *n_evicted = g_atomic_int_get (&n_evicted_fds);
+}
+
+/* Must be called before xdp_fuse_init() */
+void
+xdp_fuse_set_stats_enabled (gboolean enabled)
+{
+  op_stats_enabled = enabled;
+}
+
+void
+xdp_fuse_get_object_stats (guint *n_inodes,
+                           guint *n_domains,
+                           guint *n_physical_inodes,
+                           guint *n_tempfiles)
+{
+  if (n_inodes)
+    *n_inodes = g_atomic_int_get (&n_live_inodes);
+  if (n_domains)
+    *n_domains = g_atomic_int_get (&n_live_domains);
+  if (n_physical_inodes)
+    *n_physical_inodes = g_atomic_int_get (&n_live_physical_inodes);
+  if (n_tempfiles)
+    *n_tempfiles = g_atomic_int_get (&n_live_tempfiles);
+}
+
+/* Returns a floating a{s(ttat)} of op name to (calls, total µs, latency
+ * histogram), only listing ops that have been called */
+GVariant *
+xdp_fuse_get_op_stats (void)
+{
+  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a{s(ttat)}"));
+  XdpFuseOpStats stats[N_XDP_FUSE_OPS];
+  int i, j;
+
+  /* The counters of an op may be slightly out of sync with each other,
+   * as they are not updated together */
+  for (i = 0; i < N_XDP_FUSE_OPS; i++)
+    {
+      stats[i].calls = __atomic_load_n (&op_stats[i].calls, __ATOMIC_RELAXED);
+      stats[i].total_usec = __atomic_load_n (&op_stats[i].total_usec, __ATOMIC_RELAXED);
+      for (j = 0; j < N_LATENCY_BUCKETS; j++)
+        stats[i].latency[j] = __atomic_load_n (&op_stats[i].latency[j], __ATOMIC_RELAXED);
+    }
+
+  for (i = 0; i < N_XDP_FUSE_OPS; i++)
+    {
+      if (stats[i].calls == 0)
+        continue;
+
+      g_variant_builder_add (&builder, "{s(tt@at)}",
+                             xdp_fuse_op_names[i],
+                             stats[i].calls,
+                             stats[i].total_usec,
+                             g_variant_new_fixed_array (G_VARIANT_TYPE_UINT64,
+                                                        stats[i].latency,
+                                                        N_LATENCY_BUCKETS,
+                                                        sizeof (guint64)));
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
 gboolean
 xdp_fuse_init (GError **error)
 {
@@ -3228,22 +4746,26 @@ xdp_fuse_init (GError **error)
   const char *path;
   struct rlimit rl;
   int statfs_res;
+  int i;
   g_autoptr(XdpDomain) root_domain = NULL;
   g_autoptr(XdpDomain) by_app_domain = NULL;
 
   my_uid = getuid ();
   my_gid = getgid ();
 
-  all_inodes = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL, NULL);
+  for (i = 0; i < N_INODE_SHARDS; i++)
+    {
+      all_inodes[i].inodes = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL, NULL);
+      physical_inodes[i].inodes = g_hash_table_new_full (devino_hash, devino_equal, NULL, NULL);
+    }
+
+  inode_map_load ();
 
   root_domain = xdp_domain_new_root ();
   root_inode = xdp_inode_new (root_domain, NULL);
   by_app_domain = xdp_domain_new_by_app (root_inode);
   by_app_inode = xdp_inode_new (by_app_domain, NULL);
 
-  physical_inodes =
-    g_hash_table_new_full (devino_hash, devino_equal, NULL, NULL);
-
     /* Bump nr of filedescriptor limit to max */
   if (getrlimit (RLIMIT_NOFILE , &rl) == 0 &&
       rl.rlim_cur != rl.rlim_max)
@@ -3252,6 +4774,12 @@ xdp_fuse_init (GError **error)
       setrlimit (RLIMIT_NOFILE, &rl);
     }
 
+  /* Leave room for open files, dups and other users of fds */
+  if (getrlimit (RLIMIT_NOFILE , &rl) == 0 &&
+      rl.rlim_cur != RLIM_INFINITY &&
+      (rlim_t) fd_budget > rl.rlim_cur / 2)
+    fd_budget = MAX (rl.rlim_cur / 2, 64);
+
   path = xdp_fuse_get_mountpoint ();
 
   if ((stat (path, &st) == -1 && errno == ENOTCONN) ||
@@ -3299,12 +4827,16 @@ xdp_fuse_init (GError **error)
 
   g_assert (session != NULL);
 
+  xdp_invalidate_thread_start ();
+
   return TRUE;
 }
 
 void
 xdp_fuse_exit (void)
 {
+  xdp_invalidate_thread_stop ();
+
   {
     XDP_AUTOLOCK (session);
 
@@ -3317,6 +4849,8 @@ xdp_fuse_exit (void)
 
   g_clear_pointer (&fuse_thread, g_thread_join);
   g_assert (session == NULL);
+
+  inode_map_flush ();
 }
 
 const char *
@@ -3327,22 +4861,24 @@ xdp_fuse_get_mountpoint (void)
   return mount_path;
 }
 
-typedef struct {
-  fuse_ino_t ino;
-  char *filename;
-} Invalidate;
-
-/* Called with domain_inodes lock held, don't block */
+/* Don't block, this takes inodes_mutex of the parent and document domains */
 static void
 invalidate_doc_inode (XdpInode *parent_inode,
                       const char *doc_id,
                       GArray *invalidates)
 {
-  XdpInode *doc_inode = g_hash_table_lookup (parent_inode->domain->inodes, doc_id);
+  XdpDomain *parent_domain = parent_inode->domain;
+  XdpInode *doc_inode;
   Invalidate inval;
 
+  g_mutex_lock (&parent_domain->inodes_mutex);
+
+  doc_inode = g_hash_table_lookup (parent_domain->inodes, doc_id);
   if (doc_inode == NULL)
-    return;
+    {
+      g_mutex_unlock (&parent_domain->inodes_mutex);
+      return;
+    }
 
   inval.ino = xdp_inode_to_ino (doc_inode);
   inval.filename = NULL;
@@ -3352,30 +4888,93 @@ invalidate_doc_inode (XdpInode *parent_inode,
   inval.filename = g_strdup (doc_id);
   g_array_append_val (invalidates, inval);
 
-  /* No need to invalidate doc children, we don't cache them */
+  /* Doc children are only cached if caching is enabled */
+  if (document_cache_timeout > 0.0)
+    {
+      GHashTableIter iter;
+      gpointer value;
+
+      g_mutex_lock (&doc_inode->domain->inodes_mutex);
+      g_hash_table_iter_init (&iter, doc_inode->domain->inodes);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        {
+          inval.ino = xdp_inode_to_ino ((XdpInode *)value);
+          inval.filename = NULL;
+          g_array_append_val (invalidates, inval);
+        }
+      g_mutex_unlock (&doc_inode->domain->inodes_mutex);
+    }
+
+  g_mutex_unlock (&parent_domain->inodes_mutex);
 }
 
 
-/* Called when a apps permissions to see a document is changed,
-   and with null opt_app_id when the doc is created/removed */
-void
-xdp_fuse_invalidate_doc_app (const char *doc_id,
-                             const char *opt_app_id)
+/* Invalidations for permission changes are done by a separate thread,
+ * so that the dbus handlers don't have to iterate over all the inodes
+ * and wait for the kernel. Requests that arrive close together are
+ * merged, and the resulting invalidations deduplicated.
+ * xdp_fuse_flush_invalidates_async() can be used to wait until the
+ * kernel has seen all invalidations queued so far.
+ */
+
+#define INVALIDATE_COALESCE_USEC (2 * G_TIME_SPAN_MILLISECOND)
+
+typedef struct {
+  char *doc_id;
+  char *app_id; /* NULL for root and all apps */
+} InvalidateRequest;
+
+typedef struct {
+  GTask *task;
+  guint64 seq;
+} InvalidateFlush;
+
+static GMutex invalidate_mutex;
+static GCond invalidate_cond;
+static GThread *invalidate_thread = NULL;
+static gboolean invalidate_thread_exit = FALSE;
+/* Below protected by invalidate_mutex */
+static GHashTable *invalidate_requests = NULL; /* "$doc_id/$app_id" -> InvalidateRequest */
+static guint64 invalidate_queued_seq = 0;
+static guint64 invalidate_done_seq = 0;
+static GQueue invalidate_flushes = G_QUEUE_INIT; /* InvalidateFlush */
+
+static void
+invalidate_request_free (InvalidateRequest *request)
 {
-  g_autoptr(GArray) invalidates = NULL;
-  XDP_AUTOLOCK (session);
-  int i;
+  g_free (request->doc_id);
+  g_free (request->app_id);
+  g_free (request);
+}
 
-  /* This can happen if fuse is not initialized yet for the very
-     first dbus message that activated the service */
-  if (session == NULL)
-    return;
+static guint
+invalidate_hash (gconstpointer key)
+{
+  const Invalidate *invalidate = key;
 
-  g_debug ("invalidate %s/%s", doc_id, opt_app_id ? opt_app_id : "*");
+  return g_int64_hash (&invalidate->ino) ^ (invalidate->filename ? g_str_hash (invalidate->filename) : 0);
+}
+
+static gboolean
+invalidate_equal (gconstpointer _a,
+                  gconstpointer _b)
+{
+  const Invalidate *a = _a;
+  const Invalidate *b = _b;
+
+  return a->ino == b->ino && g_strcmp0 (a->filename, b->filename) == 0;
+}
 
-  invalidates = g_array_new (FALSE, FALSE, sizeof (Invalidate));
+/* Takes the inodes_mutex of the domains */
+static void
+collect_doc_app_invalidates (const char *doc_id,
+                             const char *opt_app_id,
+                             GArray     *invalidates)
+{
+  if (opt_app_id == NULL)
+    invalidate_doc_inode (root_inode, doc_id, invalidates);
 
-  G_LOCK (domain_inodes);
+  g_mutex_lock (&by_app_inode->domain->inodes_mutex);
   if (opt_app_id != NULL)
     {
       XdpInode *app_inode = g_hash_table_lookup (by_app_inode->domain->inodes, opt_app_id);
@@ -3387,27 +4986,236 @@ xdp_fuse_invalidate_doc_app (const char *doc_id,
       GHashTableIter iter;
       gpointer key, value;
 
-      invalidate_doc_inode (root_inode, doc_id, invalidates);
       g_hash_table_iter_init (&iter, by_app_inode->domain->inodes);
       while (g_hash_table_iter_next (&iter, &key, &value))
         invalidate_doc_inode ((XdpInode *)value, doc_id, invalidates);
     }
+  g_mutex_unlock (&by_app_inode->domain->inodes_mutex);
+}
+
+static void
+process_invalidate_requests (GHashTable *requests)
+{
+  g_autoptr(GArray) invalidates = invalidates_new ();
+  g_autoptr(GArray) unique = invalidates_new ();
+  g_autoptr(GHashTable) seen = NULL;
+  g_autofree char *all_key = NULL;
+  GHashTableIter iter;
+  gpointer value;
+  guint i;
+
+  g_hash_table_iter_init (&iter, requests);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      InvalidateRequest *request = value;
+
+      /* Invalidating for all apps covers the app specific ones */
+      if (request->app_id != NULL)
+        {
+          g_free (all_key);
+          all_key = g_strconcat (request->doc_id, "/", NULL);
+          if (g_hash_table_contains (requests, all_key))
+            continue;
+        }
 
-  G_UNLOCK (domain_inodes);
+      collect_doc_app_invalidates (request->doc_id, request->app_id, invalidates);
+    }
 
+  seen = g_hash_table_new (invalidate_hash, invalidate_equal);
   for (i = 0; i < invalidates->len; i++)
     {
       Invalidate *invalidate = &g_array_index (invalidates, Invalidate, i);
 
-      if (invalidate->filename)
+      if (g_hash_table_add (seen, invalidate))
         {
-          fuse_lowlevel_notify_inval_entry (session, invalidate->ino,
-                                            invalidate->filename, strlen (invalidate->filename));
-          g_free (invalidate->filename);
+          Invalidate copy = { invalidate->ino, g_strdup (invalidate->filename) };
+          g_array_append_val (unique, copy);
         }
-      else
-        fuse_lowlevel_notify_inval_inode (session, invalidate->ino, 0, 0);
     }
+
+  g_debug ("Sending %u invalidations for %u requests (%u before merging)",
+           unique->len, g_hash_table_size (requests), invalidates->len);
+
+  {
+    XDP_AUTOLOCK (session);
+
+    if (session)
+      send_invalidates (unique);
+  }
+}
+
+static gpointer
+xdp_invalidate_thread (gpointer data)
+{
+  g_mutex_lock (&invalidate_mutex);
+
+  while (TRUE)
+    {
+      g_autoptr(GHashTable) requests = NULL;
+      GQueue done = G_QUEUE_INIT;
+      InvalidateFlush *flush;
+      guint64 seq;
+
+      while (!invalidate_thread_exit &&
+             invalidate_done_seq == invalidate_queued_seq)
+        g_cond_wait (&invalidate_cond, &invalidate_mutex);
+
+      if (invalidate_done_seq == invalidate_queued_seq)
+        break;
+
+      /* Wait a bit for more requests, unless someone is waiting for them */
+      if (g_queue_is_empty (&invalidate_flushes) && !invalidate_thread_exit)
+        {
+          gint64 end_time = g_get_monotonic_time () + INVALIDATE_COALESCE_USEC;
+
+          while (g_queue_is_empty (&invalidate_flushes) && !invalidate_thread_exit &&
+                 g_cond_wait_until (&invalidate_cond, &invalidate_mutex, end_time))
+            ;
+        }
+
+      requests = g_steal_pointer (&invalidate_requests);
+      invalidate_requests = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                   (GDestroyNotify)invalidate_request_free);
+      seq = invalidate_queued_seq;
+
+      g_mutex_unlock (&invalidate_mutex);
+
+      process_invalidate_requests (requests);
+
+      g_mutex_lock (&invalidate_mutex);
+
+      invalidate_done_seq = seq;
+
+      while ((flush = g_queue_peek_head (&invalidate_flushes)) != NULL &&
+             flush->seq <= seq)
+        g_queue_push_tail (&done, g_queue_pop_head (&invalidate_flushes));
+
+      g_mutex_unlock (&invalidate_mutex);
+
+      /* Completes in the thread the flush was started from */
+      while ((flush = g_queue_pop_head (&done)) != NULL)
+        {
+          g_task_return_boolean (flush->task, TRUE);
+          g_object_unref (flush->task);
+          g_free (flush);
+        }
+
+      g_mutex_lock (&invalidate_mutex);
+    }
+
+  g_mutex_unlock (&invalidate_mutex);
+
+  return NULL;
+}
+
+static void
+xdp_invalidate_thread_start (void)
+{
+  invalidate_requests = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify)invalidate_request_free);
+  invalidate_thread = g_thread_new ("fuse invalidate", xdp_invalidate_thread, NULL);
+}
+
+static void
+xdp_invalidate_thread_stop (void)
+{
+  InvalidateFlush *flush;
+
+  if (invalidate_thread == NULL)
+    return;
+
+  g_mutex_lock (&invalidate_mutex);
+  invalidate_thread_exit = TRUE;
+  g_cond_signal (&invalidate_cond);
+  g_mutex_unlock (&invalidate_mutex);
+
+  g_clear_pointer (&invalidate_thread, g_thread_join);
+
+  /* All queued requests are processed before exiting, so only flushes
+     started after that can be left */
+  while ((flush = g_queue_pop_head (&invalidate_flushes)) != NULL)
+    {
+      g_task_return_boolean (flush->task, TRUE);
+      g_object_unref (flush->task);
+      g_free (flush);
+    }
+}
+
+/* Called when a apps permissions to see a document is changed,
+   and with null opt_app_id when the doc is created/removed.
+   This only queues the invalidation, see xdp_fuse_flush_invalidates_async() */
+void
+xdp_fuse_invalidate_doc_app (const char *doc_id,
+                             const char *opt_app_id)
+{
+  InvalidateRequest *request;
+  char *key;
+
+  g_mutex_lock (&invalidate_mutex);
+
+  /* This can happen if fuse is not initialized yet for the very
+     first dbus message that activated the service */
+  if (invalidate_thread == NULL || invalidate_thread_exit)
+    {
+      g_mutex_unlock (&invalidate_mutex);
+      return;
+    }
+
+  g_debug ("invalidate %s/%s", doc_id, opt_app_id ? opt_app_id : "*");
+
+  key = g_strconcat (doc_id, "/", opt_app_id, NULL);
+  if (!g_hash_table_contains (invalidate_requests, key))
+    {
+      request = g_new0 (InvalidateRequest, 1);
+      request->doc_id = g_strdup (doc_id);
+      request->app_id = g_strdup (opt_app_id);
+      g_hash_table_insert (invalidate_requests, key, request);
+    }
+  else
+    g_free (key);
+
+  invalidate_queued_seq++;
+  g_cond_signal (&invalidate_cond);
+
+  g_mutex_unlock (&invalidate_mutex);
+}
+
+/* Completes (in the thread-default main context) once all the
+   invalidations queued before the call have been sent to the kernel */
+void
+xdp_fuse_flush_invalidates_async (GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data)
+{
+  g_autoptr(GTask) task = g_task_new (NULL, cancellable, callback, user_data);
+  InvalidateFlush *flush;
+
+  g_task_set_source_tag (task, xdp_fuse_flush_invalidates_async);
+
+  g_mutex_lock (&invalidate_mutex);
+
+  if (invalidate_thread == NULL || invalidate_thread_exit ||
+      invalidate_done_seq == invalidate_queued_seq)
+    {
+      g_mutex_unlock (&invalidate_mutex);
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
+
+  flush = g_new0 (InvalidateFlush, 1);
+  flush->task = g_steal_pointer (&task);
+  flush->seq = invalidate_queued_seq;
+  g_queue_push_tail (&invalidate_flushes, flush);
+  g_cond_signal (&invalidate_cond);
+
+  g_mutex_unlock (&invalidate_mutex);
+}
+
+gboolean
+xdp_fuse_flush_invalidates_finish (GAsyncResult  *result,
+                                   GError       **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
 }
 
 char *
@@ -3422,9 +5230,12 @@ xdp_fuse_lookup_id_for_inode (ino_t ino, gboolean directory,
   if (real_path_out)
     *real_path_out = NULL;
 
-  G_LOCK (all_inodes);
   {
-    XdpInode *inode = g_hash_table_lookup (all_inodes, &ino);
+    XdpInodeShard *shard = all_inodes_shard (ino);
+    XdpInode *inode;
+
+    g_rw_lock_reader_lock (&shard->lock);
+    inode = g_hash_table_lookup (shard->inodes, &ino);
     if (inode)
       {
         /* We're not allowed to ressurect the inode here, but we can get the data while in the lock */
@@ -3432,8 +5243,8 @@ xdp_fuse_lookup_id_for_inode (ino_t ino, gboolean directory,
         if (inode->physical)
           physical = xdp_physical_inode_ref (inode->physical);
       }
+    g_rw_lock_reader_unlock (&shard->lock);
   }
-  G_UNLOCK (all_inodes);
 
   if (domain == NULL)
     return NULL;
@@ -3473,12 +5284,18 @@ xdp_fuse_lookup_id_for_inode (ino_t ino, gboolean directory,
       /* But maybe its a subfile of the document */
       if (real_path_out)
         {
-          g_autofree char *fd_path = fd_to_path (physical->fd);
+          xdp_autofd int physical_fd = xdp_physical_inode_dup_fd (physical);
+          g_autofree char *fd_path = NULL;
           char path_buffer[PATH_MAX + 1];
           DevIno file_devino = physical->backing_devino;
           ssize_t symlink_size;
           struct stat buf;
 
+          if (physical_fd < 0)
+            return NULL;
+
+          fd_path = fd_to_path (physical_fd);
+
           /* Try to extract a real path to the file (and verify it goes to the same place as the fd) */
           symlink_size = readlink (fd_path, path_buffer, PATH_MAX);
           if (symlink_size >= 1)
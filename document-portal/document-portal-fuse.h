@@ -1,20 +1,40 @@
 #ifndef XDP_FUSE_H
 #define XDP_FUSE_H
 
-#include <glib.h>
+#include <gio/gio.h>
 #include "permission-db.h"
 
 G_BEGIN_DECLS
 
 char **        xdp_list_apps (void);
 char **        xdp_list_docs (void);
+char **        xdp_list_docs_for_app (const char *app_id);
 PermissionDbEntry *xdp_lookup_doc (const char *doc_id);
+guint       xdp_get_db_generation (void);
 
+void        xdp_fuse_set_cache_timeout (double timeout);
+void        xdp_fuse_set_fd_budget (guint budget);
+void        xdp_fuse_set_inode_map_path (const char *path);
+void        xdp_fuse_get_fd_stats (guint *n_open,
+                                   guint *budget,
+                                   guint *n_reopened,
+                                   guint *n_evicted);
+void        xdp_fuse_set_stats_enabled (gboolean enabled);
+void        xdp_fuse_get_object_stats (guint *n_inodes,
+                                       guint *n_domains,
+                                       guint *n_physical_inodes,
+                                       guint *n_tempfiles);
+GVariant *  xdp_fuse_get_op_stats (void);
 gboolean    xdp_fuse_init (GError **error);
 void        xdp_fuse_exit (void);
 const char *xdp_fuse_get_mountpoint (void);
 void        xdp_fuse_invalidate_doc_app (const char *doc_id,
                                          const char *opt_app_id);
+void        xdp_fuse_flush_invalidates_async (GCancellable        *cancellable,
+                                              GAsyncReadyCallback  callback,
+                                              gpointer             user_data);
+gboolean    xdp_fuse_flush_invalidates_finish (GAsyncResult  *result,
+                                               GError       **error);
 char      *xdp_fuse_lookup_id_for_inode (ino_t    inode,
                                          gboolean directory,
                                          char   **real_path_out);
@@ -19,6 +19,7 @@
 #include "permission-store-dbus.h"
 #include "document-portal-fuse.h"
 #include "file-transfer.h"
+#include "app-file-access.h"
 #include "document-portal.h"
 
 #include <sys/eventfd.h>
@@ -44,9 +45,334 @@ static GError *exit_error = NULL;
 static dev_t fuse_dev = 0;
 static GQueue get_mount_point_invocations = G_QUEUE_INIT;
 static XdpDbusDocuments *dbus_api;
+static XdpDbusDocumentsStats *stats_api;
 
 G_LOCK_DEFINE (db);
 
+/* app id -> set of ids of the documents the app can see, i.e. has read
+ * permissions for. Built on first use, then kept up to date by
+ * do_set_permissions() and document deletion. Protected by the db lock. */
+static GHashTable *app_docs = NULL;
+
+/* Called with db lock held */
+static GHashTable *
+ensure_app_docs_set (const char *app_id)
+{
+  GHashTable *docs = g_hash_table_lookup (app_docs, app_id);
+
+  if (docs == NULL)
+    {
+      docs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      g_hash_table_insert (app_docs, g_strdup (app_id), docs);
+    }
+
+  return docs;
+}
+
+/* Called with db lock held */
+static void
+ensure_app_docs (void)
+{
+  g_auto(GStrv) ids = NULL;
+  int i, j;
+
+  if (app_docs != NULL)
+    return;
+
+  app_docs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                    g_free, (GDestroyNotify)g_hash_table_unref);
+
+  ids = permission_db_list_ids (db);
+  for (i = 0; ids[i] != NULL; i++)
+    {
+      g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, ids[i]);
+      g_autofree const char **apps = NULL;
+
+      if (entry == NULL)
+        continue;
+
+      apps = permission_db_entry_list_apps (entry);
+      for (j = 0; apps[j] != NULL; j++)
+        {
+          DocumentPermissionFlags perms = document_entry_get_permissions_by_app_id (entry, apps[j]);
+
+          if (perms & DOCUMENT_PERMISSION_FLAGS_READ)
+            g_hash_table_add (ensure_app_docs_set (apps[j]), g_strdup (ids[i]));
+        }
+    }
+}
+
+/* Called with db lock held */
+static void
+app_docs_update (const char *doc_id,
+                 const char *app_id,
+                 DocumentPermissionFlags perms)
+{
+  GHashTable *docs;
+
+  /* Not built yet, will be read from the db when needed */
+  if (app_docs == NULL)
+    return;
+
+  if (perms & DOCUMENT_PERMISSION_FLAGS_READ)
+    g_hash_table_add (ensure_app_docs_set (app_id), g_strdup (doc_id));
+  else
+    {
+      docs = g_hash_table_lookup (app_docs, app_id);
+      if (docs != NULL)
+        {
+          g_hash_table_remove (docs, doc_id);
+          if (g_hash_table_size (docs) == 0)
+            g_hash_table_remove (app_docs, app_id);
+        }
+    }
+}
+
+/* An immutable view of the documents in the db, which the fuse threads
+ * use so that they don't have to wait for the db lock. Writers (with
+ * the db lock held) publish a new snapshot for each change, or batch of
+ * changes. To avoid copying the whole db each time, a snapshot is a base
+ * table shared with older snapshots plus the changes made since, which
+ * are folded into a new base once there are more than
+ * DB_SNAPSHOT_MAX_CHANGES. */
+typedef struct
+{
+  gint        ref_count;
+  GHashTable *base;    /* id -> entry */
+  GHashTable *changes; /* id -> entry, or NULL if deleted */
+} DbSnapshot;
+
+#define DB_SNAPSHOT_MAX_CHANGES 256
+
+/* Only held to swap or ref db_snapshot */
+G_LOCK_DEFINE_STATIC (db_snapshot);
+static DbSnapshot *db_snapshot = NULL;
+/* Bumped after a new snapshot is published */
+static gint db_snapshot_generation = 0;
+
+static GHashTable *
+db_snapshot_table_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal,
+                                g_free, (GDestroyNotify) permission_db_entry_unref);
+}
+
+static DbSnapshot *
+db_snapshot_ref (DbSnapshot *snapshot)
+{
+  g_atomic_int_inc (&snapshot->ref_count);
+  return snapshot;
+}
+
+static void
+db_snapshot_unref (DbSnapshot *snapshot)
+{
+  if (g_atomic_int_dec_and_test (&snapshot->ref_count))
+    {
+      g_hash_table_unref (snapshot->base);
+      g_hash_table_unref (snapshot->changes);
+      g_free (snapshot);
+    }
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (DbSnapshot, db_snapshot_unref)
+
+static DbSnapshot *
+db_snapshot_get (void)
+{
+  DbSnapshot *snapshot;
+
+  G_LOCK (db_snapshot);
+  snapshot = db_snapshot_ref (db_snapshot);
+  G_UNLOCK (db_snapshot);
+
+  return snapshot;
+}
+
+static PermissionDbEntry *
+db_snapshot_lookup (DbSnapshot *snapshot,
+                    const char *id)
+{
+  gpointer value;
+
+  if (g_hash_table_lookup_extended (snapshot->changes, id, NULL, &value))
+    return permission_db_entry_ref (value);
+
+  return permission_db_entry_ref (g_hash_table_lookup (snapshot->base, id));
+}
+
+static guint
+db_snapshot_count (DbSnapshot *snapshot)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  guint count;
+
+  count = g_hash_table_size (snapshot->base);
+
+  g_hash_table_iter_init (&iter, snapshot->changes);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      gboolean in_base = g_hash_table_contains (snapshot->base, key);
+
+      if (value != NULL && !in_base)
+        count++;
+      else if (value == NULL && in_base)
+        count--;
+    }
+
+  return count;
+}
+
+static char **
+db_snapshot_list_ids (DbSnapshot *snapshot)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  GPtrArray *res;
+
+  res = g_ptr_array_new ();
+
+  g_hash_table_iter_init (&iter, snapshot->base);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      if (!g_hash_table_contains (snapshot->changes, key))
+        g_ptr_array_add (res, g_strdup (key));
+    }
+
+  g_hash_table_iter_init (&iter, snapshot->changes);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      if (value != NULL)
+        g_ptr_array_add (res, g_strdup (key));
+    }
+
+  g_ptr_array_add (res, NULL);
+  return (char **) g_ptr_array_free (res, FALSE);
+}
+
+static void
+db_snapshot_table_set (GHashTable        *table,
+                       const char        *id,
+                       PermissionDbEntry *entry,
+                       gboolean           keep_deleted)
+{
+  if (entry != NULL || keep_deleted)
+    g_hash_table_insert (table, g_strdup (id), permission_db_entry_ref (entry));
+  else
+    g_hash_table_remove (table, id);
+}
+
+static void
+db_snapshot_publish (DbSnapshot *snapshot)
+{
+  DbSnapshot *old;
+
+  G_LOCK (db_snapshot);
+  old = db_snapshot;
+  db_snapshot = snapshot;
+  G_UNLOCK (db_snapshot);
+
+  g_atomic_int_inc (&db_snapshot_generation);
+
+  if (old)
+    db_snapshot_unref (old);
+}
+
+/* Called with db lock held */
+static void
+db_snapshot_init (void)
+{
+  DbSnapshot *snapshot;
+  g_auto(GStrv) ids = NULL;
+  int i;
+
+  snapshot = g_new0 (DbSnapshot, 1);
+  snapshot->ref_count = 1;
+  snapshot->base = db_snapshot_table_new ();
+  snapshot->changes = db_snapshot_table_new ();
+
+  ids = permission_db_list_ids (db);
+  for (i = 0; ids[i] != NULL; i++)
+    {
+      g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, ids[i]);
+      db_snapshot_table_set (snapshot->base, ids[i], entry, FALSE);
+    }
+
+  db_snapshot_publish (snapshot);
+}
+
+/* Called with db lock held, so there are no concurrent updates */
+static void
+db_snapshot_update_many (const char        **ids,
+                         PermissionDbEntry **entries,
+                         int                 n_entries)
+{
+  DbSnapshot *old = db_snapshot;
+  DbSnapshot *snapshot;
+  GHashTableIter iter;
+  gpointer key, value;
+  int i;
+
+  snapshot = g_new0 (DbSnapshot, 1);
+  snapshot->ref_count = 1;
+
+  if (g_hash_table_size (old->changes) + n_entries <= DB_SNAPSHOT_MAX_CHANGES)
+    {
+      snapshot->base = g_hash_table_ref (old->base);
+      snapshot->changes = db_snapshot_table_new ();
+
+      g_hash_table_iter_init (&iter, old->changes);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        db_snapshot_table_set (snapshot->changes, key, value, TRUE);
+
+      for (i = 0; i < n_entries; i++)
+        db_snapshot_table_set (snapshot->changes, ids[i], entries[i], TRUE);
+    }
+  else
+    {
+      snapshot->base = db_snapshot_table_new ();
+      snapshot->changes = db_snapshot_table_new ();
+
+      g_hash_table_iter_init (&iter, old->base);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        db_snapshot_table_set (snapshot->base, key, value, FALSE);
+
+      g_hash_table_iter_init (&iter, old->changes);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        db_snapshot_table_set (snapshot->base, key, value, FALSE);
+
+      for (i = 0; i < n_entries; i++)
+        db_snapshot_table_set (snapshot->base, ids[i], entries[i], FALSE);
+    }
+
+  db_snapshot_publish (snapshot);
+}
+
+/* Called with db lock held */
+static void
+set_db_entries (const char        **ids,
+                PermissionDbEntry **entries,
+                int                 n_entries)
+{
+  int i;
+
+  if (n_entries == 0)
+    return;
+
+  for (i = 0; i < n_entries; i++)
+    permission_db_set_entry (db, ids[i], entries[i]);
+  db_snapshot_update_many (ids, entries, n_entries);
+}
+
+/* Called with db lock held */
+static void
+set_db_entry (const char        *id,
+              PermissionDbEntry *entry)
+{
+  set_db_entries (&id, &entry, 1);
+}
+
 char **
 xdp_list_apps (void)
 {
@@ -54,18 +380,85 @@ xdp_list_apps (void)
   return permission_db_list_apps (db);
 }
 
+/* Doesn't take the db lock */
 char **
 xdp_list_docs (void)
 {
+  g_autoptr(DbSnapshot) snapshot = db_snapshot_get ();
+
+  return db_snapshot_list_ids (snapshot);
+}
+
+/* The same as filtering xdp_list_docs() by read permissions for app_id,
+ * but only costs the number of docs the app can see */
+char **
+xdp_list_docs_for_app (const char *app_id)
+{
+  GHashTable *docs;
+  GHashTableIter iter;
+  gpointer key;
+  GPtrArray *res;
   XDP_AUTOLOCK (db);
-  return permission_db_list_ids (db);
+
+  ensure_app_docs ();
+
+  res = g_ptr_array_new ();
+
+  docs = g_hash_table_lookup (app_docs, app_id);
+  if (docs != NULL)
+    {
+      g_hash_table_iter_init (&iter, docs);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        g_ptr_array_add (res, g_strdup (key));
+    }
+
+  g_ptr_array_add (res, NULL);
+  return (char **)g_ptr_array_free (res, FALSE);
 }
 
+/* Doesn't take the db lock */
 PermissionDbEntry *
 xdp_lookup_doc (const char *doc_id)
 {
-  XDP_AUTOLOCK (db);
-  return permission_db_lookup (db, doc_id);
+  g_autoptr(DbSnapshot) snapshot = db_snapshot_get ();
+
+  return db_snapshot_lookup (snapshot, doc_id);
+}
+
+/* Doesn't take the db lock. This changes after the change is visible
+ * to xdp_lookup_doc(), so anything derived from a lookup made after
+ * reading the generation is valid for that generation. */
+guint
+xdp_get_db_generation (void)
+{
+  return (guint) g_atomic_int_get (&db_snapshot_generation);
+}
+
+/* Writes to the permission store that haven't been acknowledged yet.
+ * Access atomically. */
+static gint n_pending_store_calls = 0;
+
+/* Must be called right before each permission store call that uses
+ * store_call_done() as callback */
+static void
+store_call_started (void)
+{
+  g_atomic_int_inc (&n_pending_store_calls);
+}
+
+static void
+store_call_done (GObject      *source_object,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  g_autoptr(GVariant) res = NULL;
+  g_autoptr(GError) error = NULL;
+
+  res = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), result, &error);
+  if (res == NULL)
+    g_debug ("Failed to update permission store: %s", error->message);
+
+  g_atomic_int_add (&n_pending_store_calls, -1);
 }
 
 static gboolean
@@ -89,10 +482,12 @@ do_set_permissions (PermissionDbEntry    *entry,
   g_debug ("set_permissions %s %s %x", doc_id, app_id, perms);
 
   new_entry = permission_db_entry_set_app_permissions (entry, app_id, perms_s);
-  permission_db_set_entry (db, doc_id, new_entry);
+  set_db_entry (doc_id, new_entry);
+  app_docs_update (doc_id, app_id, perms);
 
   if (persist_entry (new_entry))
     {
+      store_call_started ();
       xdg_permission_store_call_set_permission (permission_store,
                                                 TABLE_NAME,
                                                 FALSE,
@@ -100,10 +495,43 @@ do_set_permissions (PermissionDbEntry    *entry,
                                                 app_id,
                                                 perms_s,
                                                 NULL,
-                                                NULL, NULL);
+                                                store_call_done, NULL);
     }
 }
 
+typedef struct {
+  GDBusMethodInvocation *invocation;
+  GVariant *value;
+} DelayedReply;
+
+static void
+invalidates_flushed_cb (GObject      *source_object,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  DelayedReply *reply = user_data;
+
+  xdp_fuse_flush_invalidates_finish (result, NULL);
+
+  g_dbus_method_invocation_return_value (reply->invocation, reply->value);
+  g_variant_unref (reply->value);
+  g_free (reply);
+}
+
+/* The fuse invalidations are sent from another thread, wait until the
+ * fuse view is up-to-date before returning the call */
+void
+return_value_after_invalidates (GDBusMethodInvocation *invocation,
+                                GVariant              *value)
+{
+  DelayedReply *reply = g_new0 (DelayedReply, 1);
+
+  reply->invocation = invocation;
+  reply->value = g_variant_ref_sink (value);
+
+  xdp_fuse_flush_invalidates_async (NULL, invalidates_flushed_cb, reply);
+}
+
 static void
 portal_grant_permissions (GDBusMethodInvocation *invocation,
                           GVariant              *parameters,
@@ -163,7 +591,7 @@ portal_grant_permissions (GDBusMethodInvocation *invocation,
   /* Invalidate with lock dropped to avoid deadlock */
   xdp_fuse_invalidate_doc_app (id, target_app_id);
 
-  g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
+  return_value_after_invalidates (invocation, g_variant_new ("()"));
 }
 
 static void
@@ -227,7 +655,7 @@ portal_revoke_permissions (GDBusMethodInvocation *invocation,
   /* Invalidate with lock dropped to avoid deadlock */
   xdp_fuse_invalidate_doc_app (id, target_app_id);
 
-  g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
+  return_value_after_invalidates (invocation, g_variant_new ("()"));
 }
 
 static void
@@ -266,21 +694,49 @@ portal_delete (GDBusMethodInvocation *invocation,
 
     g_debug ("delete %s", id);
 
-    permission_db_set_entry (db, id, NULL);
+    set_db_entry (id, NULL);
+
+    old_apps = permission_db_entry_list_apps (entry);
+    for (i = 0; old_apps[i] != NULL; i++)
+      app_docs_update (id, old_apps[i], 0);
 
     if (persist_entry (entry))
-      xdg_permission_store_call_delete (permission_store, TABLE_NAME,
-                                        id, NULL, NULL, NULL);
+      {
+        store_call_started ();
+        xdg_permission_store_call_delete (permission_store, TABLE_NAME,
+                                          id, NULL, store_call_done, NULL);
+      }
   }
 
   /* All i/o is done now, so drop the lock so we can invalidate the fuse caches */
-  old_apps = permission_db_entry_list_apps (entry);
   for (i = 0; old_apps[i] != NULL; i++)
     xdp_fuse_invalidate_doc_app (id, old_apps[i]);
   xdp_fuse_invalidate_doc_app (id, NULL);
 
-  /* Now fuse view is up-to-date, so we can return the call */
-  g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
+  return_value_after_invalidates (invocation, g_variant_new ("()"));
+}
+
+static GVariant *
+make_doc_data (struct stat *parent_st_buf,
+               const char  *path,
+               gboolean     reuse_existing,
+               gboolean     persistent,
+               gboolean     directory)
+{
+  guint32 flags = 0;
+
+  if (!reuse_existing)
+    flags |= DOCUMENT_ENTRY_FLAG_UNIQUE;
+  if (!persistent)
+    flags |= DOCUMENT_ENTRY_FLAG_TRANSIENT;
+  if (directory)
+    flags |= DOCUMENT_ENTRY_FLAG_DIRECTORY;
+
+  return g_variant_ref_sink (g_variant_new ("(^ayttu)",
+                                            path,
+                                            (guint64) parent_st_buf->st_dev,
+                                            (guint64) parent_st_buf->st_ino,
+                                            flags));
 }
 
 static char *
@@ -290,22 +746,10 @@ do_create_doc (struct stat *parent_st_buf, const char *path, gboolean reuse_exis
   g_autoptr(PermissionDbEntry) entry = NULL;
   g_auto(GStrv) ids = NULL;
   char *id = NULL;
-  guint32 flags = 0;
 
   g_debug ("Creating document at path '%s', resuse_existing: %d, persistent: %d, directory: %d", path, reuse_existing, persistent, directory);
 
-  if (!reuse_existing)
-    flags |= DOCUMENT_ENTRY_FLAG_UNIQUE;
-  if (!persistent)
-    flags |= DOCUMENT_ENTRY_FLAG_TRANSIENT;
-  if (directory)
-    flags |= DOCUMENT_ENTRY_FLAG_DIRECTORY;
-  data =
-    g_variant_ref_sink (g_variant_new ("(^ayttu)",
-                                       path,
-                                       (guint64) parent_st_buf->st_dev,
-                                       (guint64) parent_st_buf->st_ino,
-                                       flags));
+  data = make_doc_data (parent_st_buf, path, reuse_existing, persistent, directory);
 
   if (reuse_existing)
     {
@@ -329,22 +773,246 @@ do_create_doc (struct stat *parent_st_buf, const char *path, gboolean reuse_exis
   g_debug ("create_doc %s", id);
 
   entry = permission_db_entry_new (data);
-  permission_db_set_entry (db, id, entry);
+  set_db_entry (id, entry);
 
   if (persistent)
     {
+      store_call_started ();
       xdg_permission_store_call_set (permission_store,
                                      TABLE_NAME,
                                      TRUE,
                                      id,
                                      g_variant_new_array (G_VARIANT_TYPE ("{sas}"), NULL, 0),
                                      g_variant_new_variant (data),
-                                     NULL, NULL, NULL);
+                                     NULL, store_call_done, NULL);
+    }
+
+  return id;
+}
+
+/* Changes to the db for several documents, which are applied and
+ * sent to the permission store at once by doc_batch_commit() */
+typedef struct {
+  GHashTable *entries;      /* id -> new PermissionDbEntry */
+  GPtrArray  *ids;          /* changed ids, in order, owns the keys */
+  GHashTable *created;      /* ids of the new documents */
+  GHashTable *created_data; /* serialized data -> id of a new document */
+  GVariantBuilder permissions;
+  gboolean    has_permissions;
+} DocBatch;
+
+static void
+doc_batch_init (DocBatch *batch)
+{
+  batch->entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          NULL, (GDestroyNotify) permission_db_entry_unref);
+  batch->ids = g_ptr_array_new_with_free_func (g_free);
+  batch->created = g_hash_table_new (g_str_hash, g_str_equal);
+  batch->created_data = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+                                               (GDestroyNotify) g_bytes_unref, NULL);
+  g_variant_builder_init (&batch->permissions, G_VARIANT_TYPE ("a(ssas)"));
+  batch->has_permissions = FALSE;
+}
+
+static void
+doc_batch_clear (DocBatch *batch)
+{
+  g_clear_pointer (&batch->created_data, g_hash_table_unref);
+  g_clear_pointer (&batch->created, g_hash_table_unref);
+  g_clear_pointer (&batch->entries, g_hash_table_unref);
+  g_clear_pointer (&batch->ids, g_ptr_array_unref);
+  g_variant_builder_clear (&batch->permissions);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (DocBatch, doc_batch_clear)
+
+/* Called with db lock held */
+static PermissionDbEntry *
+doc_batch_lookup (DocBatch   *batch,
+                  const char *id)
+{
+  PermissionDbEntry *entry = g_hash_table_lookup (batch->entries, id);
+
+  if (entry != NULL)
+    return permission_db_entry_ref (entry);
+
+  return permission_db_lookup (db, id);
+}
+
+static void
+doc_batch_set (DocBatch          *batch,
+               const char        *id,
+               PermissionDbEntry *entry)
+{
+  gpointer key;
+
+  if (!g_hash_table_lookup_extended (batch->entries, id, &key, NULL))
+    {
+      key = g_strdup (id);
+      g_ptr_array_add (batch->ids, key);
+    }
+  g_hash_table_insert (batch->entries, key, permission_db_entry_ref (entry));
+}
+
+/* Like do_create_doc(), but only records the new document in the batch */
+static char *
+doc_batch_create_doc (DocBatch    *batch,
+                      struct stat *parent_st_buf,
+                      const char  *path,
+                      gboolean     reuse_existing,
+                      gboolean     persistent,
+                      gboolean     directory)
+{
+  g_autoptr(GVariant) data = NULL;
+  g_autoptr(PermissionDbEntry) entry = NULL;
+  g_autoptr(GBytes) data_bytes = NULL;
+  char *id = NULL;
+
+  g_debug ("Creating document at path '%s', resuse_existing: %d, persistent: %d, directory: %d", path, reuse_existing, persistent, directory);
+
+  data = make_doc_data (parent_st_buf, path, reuse_existing, persistent, directory);
+  data_bytes = g_variant_get_data_as_bytes (data);
+
+  if (reuse_existing)
+    {
+      g_auto(GStrv) ids = NULL;
+      const char *created_id;
+
+      /* The same file may be passed more than once */
+      created_id = g_hash_table_lookup (batch->created_data, data_bytes);
+      if (created_id != NULL)
+        return g_strdup (created_id);
+
+      ids = permission_db_list_ids_by_value (db, data);
+      if (ids[0] != NULL)
+        return g_strdup (ids[0]);  /* Reuse pre-existing entry with same path */
+    }
+
+  while (TRUE)
+    {
+      g_autoptr(PermissionDbEntry) existing = NULL;
+
+      g_clear_pointer (&id, g_free);
+      id = xdp_name_from_id ((guint32) g_random_int ());
+      existing = doc_batch_lookup (batch, id);
+      if (existing == NULL)
+        break;
     }
 
+  g_debug ("create_doc %s", id);
+
+  entry = permission_db_entry_new (data);
+  doc_batch_set (batch, id, entry);
+
+  g_hash_table_add (batch->created, g_ptr_array_index (batch->ids, batch->ids->len - 1));
+  if (reuse_existing)
+    g_hash_table_insert (batch->created_data, g_steal_pointer (&data_bytes),
+                         g_ptr_array_index (batch->ids, batch->ids->len - 1));
+
   return id;
 }
 
+/* Like do_set_permissions(), but only records the change in the batch */
+static void
+doc_batch_set_permissions (DocBatch               *batch,
+                           const char             *doc_id,
+                           const char             *app_id,
+                           DocumentPermissionFlags perms)
+{
+  g_autofree const char **perms_s = xdg_unparse_permissions (perms);
+  g_autoptr(PermissionDbEntry) entry = NULL;
+  g_autoptr(PermissionDbEntry) new_entry = NULL;
+
+  g_debug ("set_permissions %s %s %x", doc_id, app_id, perms);
+
+  entry = doc_batch_lookup (batch, doc_id);
+  new_entry = permission_db_entry_set_app_permissions (entry, app_id, perms_s);
+  doc_batch_set (batch, doc_id, new_entry);
+  app_docs_update (doc_id, app_id, perms);
+
+  /* New documents are sent to the permission store as a whole */
+  if (persist_entry (new_entry) && !g_hash_table_contains (batch->created, doc_id))
+    {
+      g_variant_builder_add (&batch->permissions, "(ss^as)", doc_id, app_id, perms_s);
+      batch->has_permissions = TRUE;
+    }
+}
+
+static GVariant *
+entry_get_app_permissions (PermissionDbEntry *entry)
+{
+  g_autofree const char **apps = NULL;
+  GVariantBuilder builder;
+  int i;
+
+  apps = permission_db_entry_list_apps (entry);
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sas}"));
+
+  for (i = 0; apps[i] != NULL; i++)
+    {
+      g_autofree const char **permissions = permission_db_entry_list_permissions (entry, apps[i]);
+      g_variant_builder_add (&builder, "{s^as}", apps[i], permissions);
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+/* Called with db lock held. Applies all the changes to the db at once,
+ * and sends them to the permission store in at most two calls, one
+ * for the new documents and one for changes to existing ones */
+static void
+doc_batch_commit (DocBatch *batch)
+{
+  g_autofree PermissionDbEntry **entries = NULL;
+  GVariantBuilder new_docs;
+  gboolean has_new_docs = FALSE;
+  int i;
+
+  entries = g_new (PermissionDbEntry *, batch->ids->len);
+  for (i = 0; i < batch->ids->len; i++)
+    entries[i] = g_hash_table_lookup (batch->entries, g_ptr_array_index (batch->ids, i));
+
+  set_db_entries ((const char **) batch->ids->pdata, entries, batch->ids->len);
+
+  g_variant_builder_init (&new_docs, G_VARIANT_TYPE ("a{s(a{sas}v)}"));
+
+  for (i = 0; i < batch->ids->len; i++)
+    {
+      const char *id = g_ptr_array_index (batch->ids, i);
+      g_autoptr(GVariant) data = NULL;
+
+      if (!g_hash_table_contains (batch->created, id) || !persist_entry (entries[i]))
+        continue;
+
+      data = permission_db_entry_get_data (entries[i]);
+      g_variant_builder_add (&new_docs, "{s(@a{sas}v)}",
+                             id, entry_get_app_permissions (entries[i]), data);
+      has_new_docs = TRUE;
+    }
+
+  if (has_new_docs)
+    {
+      store_call_started ();
+      xdg_permission_store_call_set_entries (permission_store,
+                                             TABLE_NAME,
+                                             g_variant_builder_end (&new_docs),
+                                             NULL, store_call_done, NULL);
+    }
+  else
+    g_variant_builder_clear (&new_docs);
+
+  if (batch->has_permissions)
+    {
+      store_call_started ();
+      xdg_permission_store_call_set_many (permission_store,
+                                          TABLE_NAME,
+                                          FALSE,
+                                          g_variant_builder_end (&batch->permissions),
+                                          NULL, store_call_done, NULL);
+      batch->has_permissions = FALSE;
+    }
+}
+
 gboolean
 validate_fd (int fd,
              XdpAppInfo *app_info,
@@ -497,7 +1165,7 @@ portal_add (GDBusMethodInvocation *invocation,
       return;
     }
 
-  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(s)", ids[0]));
+  return_value_after_invalidates (invocation, g_variant_new ("(s)", ids[0]));
 }
 
 static char *
@@ -521,108 +1189,6 @@ get_output (GError     **error,
   return NULL;
 }
 
-/* out =>
-     0 == hidden
-     1 == read-only
-     2 == read-write
-*/
-static void
-metadata_check_file_access (const char *keyfile_path,
-                            int *allow_host_out,
-                            int *allow_home_out)
-{
-  g_autoptr(GKeyFile) keyfile = NULL;
-  g_auto(GStrv) fss = NULL;
-
-  keyfile = g_key_file_new ();
-  if (!g_key_file_load_from_file (keyfile, keyfile_path, G_KEY_FILE_NONE, NULL))
-    return;
-
-  fss = g_key_file_get_string_list (keyfile, "Context",  "filesystems", NULL, NULL);
-  if (fss)
-    {
-      int i;
-      for (i = 0; fss[i] != NULL; i++)
-        {
-          const char *fs = fss[i];
-
-          if (strcmp (fs, "!host") == 0)
-            *allow_host_out = 0;
-          if (strcmp (fs, "host:ro") == 0)
-            *allow_host_out = 1;
-          if (strcmp (fs, "host") == 0)
-            *allow_host_out = 2;
-
-          if (strcmp (fs, "!home") == 0)
-            *allow_home_out = 0;
-          if (strcmp (fs, "home:ro") == 0)
-            *allow_home_out = 1;
-          if (strcmp (fs, "home") == 0)
-            *allow_home_out = 2;
-        }
-    }
-}
-
-/* This is a simplified version that only looks at filesystem=host and
- * filesystem=home, as such it should not cause false positives, but
- * be may create a document for files that the app should have access
- * to (e.g. when the app has a more strict access but the file is
- * still accessible) */
-static gboolean
-app_has_file_access_fallback (const char *target_app_id,
-                              DocumentPermissionFlags target_perms,
-                              const char *path)
-{
-  g_autofree char *user_metadata = NULL;
-  g_autofree char *system_metadata = NULL;
-  g_autofree char *user_override = NULL;
-  g_autofree char *system_override = NULL;
-  g_autofree char *user_global_override = NULL;
-  g_autofree char *system_global_override = NULL;
-  g_autofree char *homedir = NULL;
-  g_autofree char *canonical_path = NULL;
-  gboolean is_in_home = FALSE;
-  g_autofree char *user_installation = g_build_filename (g_get_user_data_dir (), "flatpak", NULL);
-  const char *system_installation = "/var/lib/flatpak";
-  int allow_host = 0;
-  int allow_home = 0;
-
-  if (g_str_has_prefix (path, "/usr") || g_str_has_prefix (path, "/app") || g_str_has_prefix (path, "/tmp"))
-    return FALSE;
-
-  user_metadata = g_build_filename (user_installation, "app", target_app_id, "current/active/metadata", NULL);
-  system_metadata = g_build_filename (system_installation, "app", target_app_id, "current/active/metadata", NULL);
-  user_override = g_build_filename (user_installation, "overrides", target_app_id, NULL);
-  system_override = g_build_filename (system_installation, "overrides", target_app_id, NULL);
-  user_global_override = g_build_filename (user_installation, "overrides", "global", NULL);
-  system_global_override = g_build_filename (system_installation, "overrides", "global", NULL);
-
-  metadata_check_file_access (system_metadata, &allow_host, &allow_home);
-  metadata_check_file_access (user_metadata, &allow_host, &allow_home);
-  metadata_check_file_access (system_global_override, &allow_host, &allow_home);
-  metadata_check_file_access (system_override, &allow_host, &allow_home);
-  metadata_check_file_access (user_global_override, &allow_host, &allow_home);
-  metadata_check_file_access (user_override, &allow_host, &allow_home);
-
-  if (allow_host == 2 ||
-      ((allow_host == 1) &&
-       (target_perms & DOCUMENT_PERMISSION_FLAGS_WRITE) == 0))
-    return TRUE;
-
-  homedir = xdp_canonicalize_filename (g_get_home_dir ());
-  canonical_path = xdp_canonicalize_filename (path);
-
-  is_in_home = xdp_has_path_prefix (canonical_path, homedir);
-
-  if (is_in_home &&
-      ((allow_home == 2) ||
-       (allow_home == 1 && (target_perms & DOCUMENT_PERMISSION_FLAGS_WRITE) == 0)))
-    return TRUE;
-
-  return FALSE;
-}
-
-
 static gboolean
 app_has_file_access (const char *target_app_id,
                      DocumentPermissionFlags target_perms,
@@ -642,7 +1208,20 @@ app_has_file_access (const char *target_app_id,
     }
   else
     {
-      /* First we try flatpak info --file-access=PATH APPID, which is supported on new versions */
+      AppFileAccess access;
+
+      if (g_str_has_prefix (path, "/usr") || g_str_has_prefix (path, "/app") || g_str_has_prefix (path, "/tmp"))
+        return FALSE;
+
+      /* Evaluate the app metadata and overrides ourselves, which is
+         a lot cheaper than spawning flatpak for every file */
+      access = app_file_access_lookup (target_app_id, path);
+      if (access != APP_FILE_ACCESS_UNKNOWN)
+        return access == APP_FILE_ACCESS_READ_WRITE ||
+               (access == APP_FILE_ACCESS_READ_ONLY &&
+                (target_perms & DOCUMENT_PERMISSION_FLAGS_WRITE) == 0);
+
+      /* The app is not in one of the default installations, ask flatpak */
       arg = g_strdup_printf ("--file-access=%s", path);
       res = get_output (&error, "flatpak", "info", arg, target_app_id, NULL);
     }
@@ -655,13 +1234,9 @@ app_has_file_access (const char *target_app_id,
       if (strcmp (res, "read-only") == 0 &&
           ((target_perms & DOCUMENT_PERMISSION_FLAGS_WRITE) == 0))
         return TRUE;
-
-      return FALSE;
     }
 
-  /* Secondly we fall back to a simple check that will not be perfect but should not
-     cause false positives. */
-  return app_has_file_access_fallback (target_app_id, target_perms, path);
+  return FALSE;
 }
 
 static void
@@ -740,54 +1315,43 @@ portal_add_full (GDBusMethodInvocation *invocation,
   g_variant_builder_add (&builder, "{sv}", "mountpoint",
                          g_variant_new_bytestring (xdp_fuse_get_mountpoint ()));
 
-  g_dbus_method_invocation_return_value (invocation,
-                                         g_variant_new ("(^as@a{sv})",
-                                                        (char **)ids,
-                                                        g_variant_builder_end (&builder)));
+  return_value_after_invalidates (invocation,
+                                  g_variant_new ("(^as@a{sv})",
+                                                 (char **)ids,
+                                                 g_variant_builder_end (&builder)));
 }
 
-/*
- * if the fd array contains fds that were not opened by the client itself,
- * parent_dev and parent_ino must contain the st_dev/st_ino fields for the
- * parent directory to check for, to prevent symlink attacks.
- */
-char **
-document_add_full (int                      *fd,
-                   int                      *parent_dev,
-                   int                      *parent_ino,
-                   int                       n_args,
-                   DocumentAddFullFlags      flags,
-                   XdpAppInfo               *app_info,
-                   const char               *target_app_id,
-                   DocumentPermissionFlags   target_perms,
-                   GError                  **error)
+/* Checks the fds passed to document_add_full(), and fills in the real
+ * paths, parent dirs and writability of the files, and the ids of the
+ * ones that already are documents. */
+static gboolean
+validate_add_full_fds (int                      *fd,
+                       int                      *parent_dev,
+                       int                      *parent_ino,
+                       int                       n_args,
+                       DocumentAddFullFlags      flags,
+                       XdpAppInfo               *app_info,
+                       DocumentPermissionFlags   target_perms,
+                       GPtrArray                *ids,
+                       GPtrArray                *paths,
+                       struct stat              *real_dir_st_bufs,
+                       gboolean                 *writable,
+                       GError                  **error)
 {
-  const char *app_id = xdp_app_info_get_id (app_info);
-  g_autoptr(GPtrArray) ids = g_ptr_array_new_with_free_func (g_free);
-  g_autoptr(GPtrArray) paths = g_ptr_array_new_with_free_func (g_free);
-  gboolean reuse_existing, persistent, as_needed_by_app, allow_write, is_dir;
-  g_autofree struct stat *real_dir_st_bufs = NULL;
+  gboolean reuse_existing, allow_write, is_dir;
   struct stat st_buf;
-  g_autofree gboolean *writable = NULL;
   int i;
 
   reuse_existing = (flags & DOCUMENT_ADD_FLAGS_REUSE_EXISTING) != 0;
-  persistent = (flags & DOCUMENT_ADD_FLAGS_PERSISTENT) != 0;
-  as_needed_by_app = (flags & DOCUMENT_ADD_FLAGS_AS_NEEDED_BY_APP) != 0;
   is_dir = (flags & DOCUMENT_ADD_FLAGS_DIRECTORY) != 0;
   allow_write = (target_perms & DOCUMENT_PERMISSION_FLAGS_WRITE) != 0;
 
-  g_ptr_array_set_size (paths, n_args + 1);
-  g_ptr_array_set_size (ids, n_args + 1);
-  real_dir_st_bufs = g_new0 (struct stat, n_args);
-  writable = g_new0 (gboolean, n_args);
-
   for (i = 0; i < n_args; i++)
     {
       g_autofree char *path = NULL;
 
       if (!validate_fd (fd[i], app_info, is_dir ? VALIDATE_FD_FILE_TYPE_DIR : VALIDATE_FD_FILE_TYPE_REGULAR, &st_buf, &real_dir_st_bufs[i], &path, &writable[i], error))
-        return NULL;
+        return FALSE;
 
       if (parent_dev != NULL && parent_ino != NULL)
         {
@@ -797,7 +1361,7 @@ document_add_full (int                      *fd,
               g_set_error (error,
                            XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
                            "Invalid parent directory");
-              return NULL;
+              return FALSE;
             }
         }
 
@@ -806,7 +1370,7 @@ document_add_full (int                      *fd,
           g_set_error (error,
                        XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
                        "Not enough permissions");
-          return NULL;
+          return FALSE;
         }
 
       if (st_buf.st_dev == fuse_dev)
@@ -821,7 +1385,7 @@ document_add_full (int                      *fd,
               g_set_error (error,
                            XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_INVALID_ARGUMENT,
                            "Invalid fd passed");
-              return NULL;
+              return FALSE;
             }
 
           /* Maybe this was a file on a directory document and we can expose the real path instead */
@@ -841,7 +1405,7 @@ document_add_full (int                      *fd,
                   g_set_error (error,
                                XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_INVALID_ARGUMENT,
                                "Invalid fd passed");
-                  return NULL;
+                  return FALSE;
                 }
             }
           else
@@ -851,6 +1415,73 @@ document_add_full (int                      *fd,
       g_ptr_array_index(paths,i) = g_steal_pointer (&path);
     }
 
+  return TRUE;
+}
+
+/* Checks whether document_add_full() would accept the fds, without
+ * adding anything. */
+gboolean
+document_check_add_full (int                      *fd,
+                         int                      *parent_dev,
+                         int                      *parent_ino,
+                         int                       n_args,
+                         DocumentAddFullFlags      flags,
+                         XdpAppInfo               *app_info,
+                         DocumentPermissionFlags   target_perms,
+                         GError                  **error)
+{
+  g_autoptr(GPtrArray) ids = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) paths = g_ptr_array_new_with_free_func (g_free);
+  g_autofree struct stat *real_dir_st_bufs = NULL;
+  g_autofree gboolean *writable = NULL;
+
+  g_ptr_array_set_size (paths, n_args);
+  g_ptr_array_set_size (ids, n_args);
+  real_dir_st_bufs = g_new0 (struct stat, n_args);
+  writable = g_new0 (gboolean, n_args);
+
+  return validate_add_full_fds (fd, parent_dev, parent_ino, n_args, flags, app_info, target_perms,
+                                ids, paths, real_dir_st_bufs, writable, error);
+}
+
+/*
+ * if the fd array contains fds that were not opened by the client itself,
+ * parent_dev and parent_ino must contain the st_dev/st_ino fields for the
+ * parent directory to check for, to prevent symlink attacks.
+ */
+char **
+document_add_full (int                      *fd,
+                   int                      *parent_dev,
+                   int                      *parent_ino,
+                   int                       n_args,
+                   DocumentAddFullFlags      flags,
+                   XdpAppInfo               *app_info,
+                   const char               *target_app_id,
+                   DocumentPermissionFlags   target_perms,
+                   GError                  **error)
+{
+  const char *app_id = xdp_app_info_get_id (app_info);
+  g_autoptr(GPtrArray) ids = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) paths = g_ptr_array_new_with_free_func (g_free);
+  gboolean reuse_existing, persistent, as_needed_by_app, is_dir;
+  g_autofree struct stat *real_dir_st_bufs = NULL;
+  g_autofree gboolean *writable = NULL;
+  int i;
+
+  reuse_existing = (flags & DOCUMENT_ADD_FLAGS_REUSE_EXISTING) != 0;
+  persistent = (flags & DOCUMENT_ADD_FLAGS_PERSISTENT) != 0;
+  as_needed_by_app = (flags & DOCUMENT_ADD_FLAGS_AS_NEEDED_BY_APP) != 0;
+  is_dir = (flags & DOCUMENT_ADD_FLAGS_DIRECTORY) != 0;
+
+  g_ptr_array_set_size (paths, n_args + 1);
+  g_ptr_array_set_size (ids, n_args + 1);
+  real_dir_st_bufs = g_new0 (struct stat, n_args);
+  writable = g_new0 (gboolean, n_args);
+
+  if (!validate_add_full_fds (fd, parent_dev, parent_ino, n_args, flags, app_info, target_perms,
+                              ids, paths, real_dir_st_bufs, writable, error))
+    return NULL;
+
   {
     DocumentPermissionFlags caller_base_perms = DOCUMENT_PERMISSION_FLAGS_GRANT_PERMISSIONS |
                                                 DOCUMENT_PERMISSION_FLAGS_READ;
@@ -860,8 +1491,12 @@ document_add_full (int                      *fd,
     if (!reuse_existing)
       caller_write_perms |= DOCUMENT_PERMISSION_FLAGS_DELETE;
 
+    g_auto(DocBatch) batch = { NULL, };
+
     XDP_AUTOLOCK (db); /* Lock once for all ops */
 
+    doc_batch_init (&batch);
+
     for (i = 0; i < n_args; i++)
       {
         const char *path = g_ptr_array_index(paths,i);
@@ -877,7 +1512,7 @@ document_add_full (int                      *fd,
 
         if (g_ptr_array_index(ids,i) == NULL)
           {
-            char *id = do_create_doc (&real_dir_st_bufs[i], path, reuse_existing, persistent, is_dir);
+            char *id = doc_batch_create_doc (&batch, &real_dir_st_bufs[i], path, reuse_existing, persistent, is_dir);
             g_ptr_array_index(ids,i) = id;
 
             if (app_id[0] != '\0' && strcmp (app_id, target_app_id) != 0)
@@ -887,17 +1522,16 @@ document_add_full (int                      *fd,
                 if (writable[i])
                   caller_perms |= caller_write_perms;
 
-                g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, id);;
-                do_set_permissions (entry, id, app_id, caller_perms);
+                doc_batch_set_permissions (&batch, id, app_id, caller_perms);
               }
 
             if (target_app_id[0] != '\0' && target_perms != 0)
-              {
-                g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, id);
-                do_set_permissions (entry, id, target_app_id, target_perms);
-              }
+              doc_batch_set_permissions (&batch, id, target_app_id, target_perms);
           }
       }
+
+    /* One db update and permission store write for all the documents */
+    doc_batch_commit (&batch);
   }
 
   /* Invalidate with lock dropped to avoid deadlock */
@@ -1069,10 +1703,10 @@ portal_add_named_full (GDBusMethodInvocation *invocation,
   g_variant_builder_add (&builder, "{sv}", "mountpoint",
                          g_variant_new_bytestring (xdp_fuse_get_mountpoint ()));
 
-  g_dbus_method_invocation_return_value (invocation,
-                                         g_variant_new ("(s@a{sv})",
-                                                        id,
-                                                        g_variant_builder_end (&builder)));
+  return_value_after_invalidates (invocation,
+                                  g_variant_new ("(s@a{sv})",
+                                                 id,
+                                                 g_variant_builder_end (&builder)));
 }
 
 static void
@@ -1186,6 +1820,53 @@ handle_get_mount_point (XdpDbusDocuments *object, GDBusMethodInvocation *invocat
   return TRUE;
 }
 
+static gboolean
+handle_get_stats (XdpDbusDocumentsStats *object,
+                  GDBusMethodInvocation *invocation)
+{
+  g_autoptr(XdpAppInfo) app_info = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(DbSnapshot) snapshot = NULL;
+  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE_VARDICT);
+  guint n_inodes, n_domains, n_physical_inodes, n_tempfiles;
+  guint n_open_fds, fd_budget, n_reopened_fds, n_evicted_fds;
+
+  app_info = xdp_invocation_lookup_app_info_sync (invocation, NULL, &error);
+  if (app_info == NULL)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return TRUE;
+    }
+
+  if (!xdp_app_info_is_host (app_info))
+    {
+      g_dbus_method_invocation_return_error (invocation, XDG_DESKTOP_PORTAL_ERROR,
+                                             XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
+                                             "Not allowed inside sandbox");
+      return TRUE;
+    }
+
+  xdp_fuse_get_object_stats (&n_inodes, &n_domains, &n_physical_inodes, &n_tempfiles);
+  xdp_fuse_get_fd_stats (&n_open_fds, &fd_budget, &n_reopened_fds, &n_evicted_fds);
+  snapshot = db_snapshot_get ();
+
+  g_variant_builder_add (&builder, "{sv}", "inodes", g_variant_new_uint32 (n_inodes));
+  g_variant_builder_add (&builder, "{sv}", "domains", g_variant_new_uint32 (n_domains));
+  g_variant_builder_add (&builder, "{sv}", "physical-inodes", g_variant_new_uint32 (n_physical_inodes));
+  g_variant_builder_add (&builder, "{sv}", "open-fds", g_variant_new_uint32 (n_open_fds));
+  g_variant_builder_add (&builder, "{sv}", "fd-budget", g_variant_new_uint32 (fd_budget));
+  g_variant_builder_add (&builder, "{sv}", "reopened-fds", g_variant_new_uint32 (n_reopened_fds));
+  g_variant_builder_add (&builder, "{sv}", "evicted-fds", g_variant_new_uint32 (n_evicted_fds));
+  g_variant_builder_add (&builder, "{sv}", "tempfiles", g_variant_new_uint32 (n_tempfiles));
+  g_variant_builder_add (&builder, "{sv}", "db-entries", g_variant_new_uint32 (db_snapshot_count (snapshot)));
+  g_variant_builder_add (&builder, "{sv}", "pending-store-writes",
+                         g_variant_new_uint32 (g_atomic_int_get (&n_pending_store_calls)));
+  g_variant_builder_add (&builder, "{sv}", "fuse-ops", xdp_fuse_get_op_stats ());
+
+  xdp_dbus_documents_stats_complete_get_stats (object, invocation, g_variant_builder_end (&builder));
+  return TRUE;
+}
+
 static gboolean
 portal_lookup (GDBusMethodInvocation *invocation,
                GVariant *parameters,
@@ -1240,6 +1921,9 @@ portal_lookup (GDBusMethodInvocation *invocation,
       g_auto(GStrv) ids = NULL;
       guint32 flags = 0;
 
+      /* The value index is built and updated under the db lock */
+      XDP_AUTOLOCK (db);
+
       if (is_dir)
         flags |= DOCUMENT_ENTRY_FLAG_DIRECTORY;
 
@@ -1441,6 +2125,20 @@ on_bus_acquired (GDBusConnection *connection,
     }
 
   g_debug ("Providing portal %s", g_dbus_interface_skeleton_get_info (G_DBUS_INTERFACE_SKELETON (file_transfer))->name);
+
+  if (stats_api)
+    {
+      if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (stats_api),
+                                             connection,
+                                             "/org/freedesktop/portal/documents",
+                                             &error))
+        {
+          g_warning ("error: %s", error->message);
+          g_clear_error (&error);
+        }
+
+      g_debug ("Providing %s", g_dbus_interface_skeleton_get_info (G_DBUS_INTERFACE_SKELETON (stats_api))->name);
+    }
 }
 
 static void
@@ -1568,11 +2266,17 @@ set_one_signal_handler (int    sig,
 static gboolean opt_verbose;
 static gboolean opt_replace;
 static gboolean opt_version;
+static double opt_cache_timeout;
+static int opt_fd_budget;
+static gboolean opt_stats;
 
 static GOptionEntry entries[] = {
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print debug information", NULL },
   { "replace", 'r', 0, G_OPTION_ARG_NONE, &opt_replace, "Replace", NULL },
   { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Print version and exit", NULL },
+  { "cache-timeout", 0, 0, G_OPTION_ARG_DOUBLE, &opt_cache_timeout, "Let the kernel cache document entries and attributes for SECONDS", "SECONDS" },
+  { "fd-budget", 0, 0, G_OPTION_ARG_INT, &opt_fd_budget, "Keep at most N files open for looked up documents", "N" },
+  { "stats", 0, 0, G_OPTION_ARG_NONE, &opt_stats, "Collect statistics and export them on D-Bus", NULL },
   { NULL }
 };
 
@@ -1603,6 +2307,7 @@ main (int    argc,
 
   g_autoptr(GError) error = NULL;
   g_autofree char *path = NULL;
+  g_autofree char *inode_map_path = NULL;
   GDBusConnection *session_bus;
   g_autoptr(GOptionContext) context = NULL;
   GDBusMethodInvocation *invocation;
@@ -1631,18 +2336,37 @@ main (int    argc,
   if (opt_verbose)
     g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, message_handler, NULL);
 
+  xdp_fuse_set_cache_timeout (opt_cache_timeout);
+  xdp_fuse_set_fd_budget (MAX (opt_fd_budget, 0));
+  xdp_fuse_set_stats_enabled (opt_stats);
+
+  if (opt_stats)
+    {
+      stats_api = xdp_dbus_documents_stats_skeleton_new ();
+      xdp_dbus_documents_stats_set_version (stats_api, 1);
+      g_signal_connect (stats_api, "handle-get-stats", G_CALLBACK (handle_get_stats), NULL);
+    }
+
   g_set_prgname (argv[0]);
 
   loop = g_main_loop_new (NULL, FALSE);
 
   path = g_build_filename (g_get_user_data_dir (), "flatpak/db", TABLE_NAME, NULL);
-  db = permission_db_new (path, FALSE, &error);
+  db = permission_db_new_read_only (path, FALSE, &error);
   if (db == NULL)
     {
       g_printerr ("Failed to load db from '%s': %s", path, error->message);
       exit (2);
     }
 
+  {
+    XDP_AUTOLOCK (db);
+    db_snapshot_init ();
+  }
+
+  inode_map_path = g_strconcat (path, ".inodes", NULL);
+  xdp_fuse_set_inode_map_path (inode_map_path);
+
   session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
   if (session_bus == NULL)
     {
@@ -1650,7 +2374,9 @@ main (int    argc,
       exit (3);
     }
 
-  permission_store = xdg_permission_store_proxy_new_sync (session_bus, G_DBUS_PROXY_FLAGS_NONE,
+  /* We don't use the Changed signals, and would otherwise
+   * get woken up for every change in every table */
+  permission_store = xdg_permission_store_proxy_new_sync (session_bus, G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
                                                           "org.freedesktop.impl.portal.PermissionStore",
                                                           "/org/freedesktop/impl/portal/PermissionStore",
                                                           NULL, &error);
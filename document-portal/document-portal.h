@@ -38,6 +38,15 @@ gboolean validate_fd (int           fd,
                       gboolean     *writable_out,
                       GError      **error);
 
+gboolean document_check_add_full (int                      *fd,
+                                  int                      *parent_dev,
+                                  int                      *parent_ino,
+                                  int                       n_args,
+                                  DocumentAddFullFlags      flags,
+                                  XdpAppInfo               *app_info,
+                                  DocumentPermissionFlags   target_perms,
+                                  GError                  **error);
+
 char ** document_add_full (int                      *fd,
                            int                      *parent_dev,
                            int                      *parent_ino,
@@ -47,3 +56,6 @@ char ** document_add_full (int                      *fd,
                            const char               *target_app_id,
                            DocumentPermissionFlags   target_perms,
                            GError                  **error);
+
+void return_value_after_invalidates (GDBusMethodInvocation *invocation,
+                                     GVariant              *value);
@@ -234,39 +234,45 @@ file_transfer_add_file (FileTransfer *transfer,
   g_ptr_array_add (transfer->files, file);
 }
 
-static char **
-file_transfer_execute (FileTransfer *transfer,
-                       XdpAppInfo *target_app_info,
-                       GError **error)
+/* Upper bound on the number of files exported per document_add_full()
+ * call, and on the size of a RetrieveFilesChunk() reply. This keeps the
+ * number of O_PATH fds open at any one time bounded, no matter how many
+ * files were added to the transfer.
+ */
+#define FILE_TRANSFER_CHUNK_SIZE 256
+
+/* Exports the files in [start, start + n_files) for the target and
+ * appends the resulting paths to @paths. If @paths is NULL, this only
+ * checks that they can be exported.
+ */
+static gboolean
+file_transfer_execute_range (FileTransfer *transfer,
+                             XdpAppInfo *target_app_info,
+                             guint start,
+                             guint n_files,
+                             GPtrArray *paths,
+                             GError **error)
 {
   guint32 flags;
   DocumentPermissionFlags perms;
   const char *target_app_id;
-  int n_fds;
+  const char *mountpoint;
   g_autofree int *fds = NULL;
   g_autofree int *parent_devs = NULL;
   g_autofree int *parent_inos = NULL;
   int i;
   g_auto(GStrv) ids = NULL;
-  char **files = NULL;
-
-  g_debug ("retrieve %d files for %s from file transfer owned by '%s' (%s)",
-           transfer->files->len,
-           xdp_app_info_get_id (target_app_info),
-           xdp_app_info_get_id (transfer->app_info),
-           transfer->sender);
+  gboolean ok;
 
   /* if the target is unsandboxed, just return the files as-is */
   if (xdp_app_info_is_host (target_app_info))
     {
-      files = g_new (char *, transfer->files->len + 1);
-      for (i = 0; i < transfer->files->len; i++)
+      for (i = 0; paths != NULL && i < n_files; i++)
         {
-          ExportedFile *file = (ExportedFile*)g_ptr_array_index (transfer->files, i);
-          files[i] = g_strdup (file->path);
+          ExportedFile *file = (ExportedFile*)g_ptr_array_index (transfer->files, start + i);
+          g_ptr_array_add (paths, g_strdup (file->path));
         }
-      files[i] = NULL;
-      return files;
+      return TRUE;
     }
 
   flags = DOCUMENT_ADD_FLAGS_REUSE_EXISTING | DOCUMENT_ADD_FLAGS_AS_NEEDED_BY_APP;
@@ -277,13 +283,12 @@ file_transfer_execute (FileTransfer *transfer,
 
   target_app_id = xdp_app_info_get_id (target_app_info);
 
-  n_fds = transfer->files->len;
-  fds = g_new (int, n_fds);
-  parent_devs = g_new (int, n_fds);
-  parent_inos = g_new (int, n_fds);
-  for (i = 0; i < n_fds; i++)
+  fds = g_new (int, n_files);
+  parent_devs = g_new (int, n_files);
+  parent_inos = g_new (int, n_files);
+  for (i = 0; i < n_files; i++)
     {
-      ExportedFile *file = (ExportedFile*)g_ptr_array_index (transfer->files, i);
+      ExportedFile *file = (ExportedFile*)g_ptr_array_index (transfer->files, start + i);
 
       fds[i] = open (file->path, O_PATH | O_CLOEXEC);
       if (fds[i] == -1)
@@ -291,38 +296,96 @@ file_transfer_execute (FileTransfer *transfer,
           g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "File transfer %s failed", transfer->key);
           for (; i > 0; i--)
             close (fds[i - 1]);
-          return NULL;
+          return FALSE;
         }
 
       parent_devs[i] = file->parent_dev;
       parent_inos[i] = file->parent_ino;
     }
 
-  ids = document_add_full (fds, parent_devs, parent_inos, n_fds, flags, transfer->app_info, target_app_id, perms, error);
+  if (paths == NULL)
+    ok = document_check_add_full (fds, parent_devs, parent_inos, n_files, flags, transfer->app_info, perms, error);
+  else
+    {
+      ids = document_add_full (fds, parent_devs, parent_inos, n_files, flags, transfer->app_info, target_app_id, perms, error);
+      ok = ids != NULL;
+    }
 
-  for (i = 0; i < n_fds; i++)
+  for (i = 0; i < n_files; i++)
     close (fds[i]);
 
-  if (ids)
+  if (!ok || paths == NULL)
+    return ok;
+
+  mountpoint = xdp_fuse_get_mountpoint ();
+  for (i = 0; i < n_files; i++)
     {
-      const char *mountpoint = xdp_fuse_get_mountpoint ();
-      files = g_new (char *, n_fds + 1);
-      for (i = 0; i < n_fds; i++)
+      ExportedFile *file = (ExportedFile *) g_ptr_array_index (transfer->files, start + i);
+
+      if (ids[i][0] == '\0')
+        g_ptr_array_add (paths, g_strdup (file->path));
+      else
         {
-          ExportedFile *file = (ExportedFile *) g_ptr_array_index (transfer->files, i);
+          g_autofree char *name = g_path_get_basename (file->path);
+          g_ptr_array_add (paths, g_build_filename (mountpoint, ids[i], name, NULL));
+        }
+    }
 
-          if (ids[i][0] == '\0')
-            files[i] = g_strdup (file->path);
-          else
-            {
-              g_autofree char *name = g_path_get_basename (file->path);
-              files[i] = g_build_filename (mountpoint, ids[i], name, NULL);
-            }
+  return TRUE;
+}
+
+static char **
+file_transfer_execute (FileTransfer *transfer,
+                       XdpAppInfo *target_app_info,
+                       guint cursor,
+                       guint max_files,
+                       guint *next_cursor,
+                       GError **error)
+{
+  g_autoptr(GPtrArray) paths = NULL;
+  guint end;
+  guint i;
+
+  end = cursor + MIN (max_files, transfer->files->len - cursor);
+
+  g_debug ("retrieve files %u-%u of %u for %s from file transfer owned by '%s' (%s)",
+           cursor, end, transfer->files->len,
+           xdp_app_info_get_id (target_app_info),
+           xdp_app_info_get_id (transfer->app_info),
+           transfer->sender);
+
+  /* The files are exported in several batches, so check all of them
+   * first. Otherwise a failure in a later batch would leave the target
+   * with the documents of the earlier ones, but get an error. */
+  if (end - cursor > FILE_TRANSFER_CHUNK_SIZE)
+    {
+      for (i = cursor; i < end; i += FILE_TRANSFER_CHUNK_SIZE)
+        {
+          if (!file_transfer_execute_range (transfer, target_app_info, i,
+                                            MIN (end - i, FILE_TRANSFER_CHUNK_SIZE),
+                                            NULL, error))
+            return NULL;
         }
-      files[n_fds] = NULL;
     }
 
-  return files;
+  paths = g_ptr_array_new_full (end - cursor + 1, g_free);
+
+  while (cursor < end)
+    {
+      guint n_files = MIN (end - cursor, FILE_TRANSFER_CHUNK_SIZE);
+
+      if (!file_transfer_execute_range (transfer, target_app_info, cursor, n_files, paths, error))
+        return NULL;
+
+      cursor += n_files;
+    }
+
+  g_ptr_array_add (paths, NULL);
+
+  if (next_cursor)
+    *next_cursor = end < transfer->files->len ? end : 0;
+
+  return (char **)g_ptr_array_free (g_steal_pointer (&paths), FALSE);
 }
 
 static void
@@ -458,16 +521,68 @@ retrieve_files (GDBusMethodInvocation *invocation,
 
   TRANSFER_AUTOLOCK_UNREF (transfer);
 
-  files = file_transfer_execute (transfer, app_info, &error);
+  files = file_transfer_execute (transfer, app_info, 0, transfer->files->len, NULL, &error);
   if (files == NULL)
     g_dbus_method_invocation_return_gerror (invocation, error);
-  else
-    g_dbus_method_invocation_return_value (invocation, g_variant_new ("(^as)", files));
+  else /* The paths must be usable once the caller gets them */
+    return_value_after_invalidates (invocation, g_variant_new ("(^as)", files));
 
   if (transfer->autostop)
     file_transfer_stop (transfer);
 }
 
+static void
+retrieve_files_chunk (GDBusMethodInvocation *invocation,
+                      GVariant *parameters,
+                      XdpAppInfo *app_info)
+{
+  const char *key;
+  guint32 cursor;
+  guint32 max_files;
+  guint next_cursor;
+  g_autoptr(GVariant) options = NULL;
+  FileTransfer *transfer;
+  g_auto(GStrv) files = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_variant_get (parameters, "(&su@a{sv})", &key, &cursor, &options);
+
+  if (!g_variant_lookup (options, "max-files", "u", &max_files) ||
+      max_files == 0 || max_files > FILE_TRANSFER_CHUNK_SIZE)
+    max_files = FILE_TRANSFER_CHUNK_SIZE;
+
+  transfer = lookup_transfer (key);
+  if (transfer == NULL)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_DBUS_ERROR,
+                                             G_DBUS_ERROR_ACCESS_DENIED,
+                                             "Invalid transfer");
+      return;
+    }
+
+  TRANSFER_AUTOLOCK_UNREF (transfer);
+
+  if (cursor > transfer->files->len)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_DBUS_ERROR,
+                                             G_DBUS_ERROR_INVALID_ARGS,
+                                             "Invalid cursor");
+      return;
+    }
+
+  files = file_transfer_execute (transfer, app_info, cursor, max_files, &next_cursor, &error);
+  if (files == NULL)
+    g_dbus_method_invocation_return_gerror (invocation, error);
+  else
+    return_value_after_invalidates (invocation, g_variant_new ("(^asu)", files, next_cursor));
+
+  /* Only the last chunk (or a failure) ends an autostop transfer */
+  if (transfer->autostop && (files == NULL || next_cursor == 0))
+    file_transfer_stop (transfer);
+}
+
 static void
 stop_transfer (GDBusMethodInvocation *invocation,
                 GVariant *parameters,
@@ -524,9 +639,10 @@ file_transfer_create (void)
   g_signal_connect_swapped (file_transfer, "handle-start-transfer", G_CALLBACK (handle_method), start_transfer);
   g_signal_connect_swapped (file_transfer, "handle-add-files", G_CALLBACK (handle_method), add_files);
   g_signal_connect_swapped (file_transfer, "handle-retrieve-files", G_CALLBACK (handle_method), retrieve_files);
+  g_signal_connect_swapped (file_transfer, "handle-retrieve-files-chunk", G_CALLBACK (handle_method), retrieve_files_chunk);
   g_signal_connect_swapped (file_transfer, "handle-stop-transfer", G_CALLBACK (handle_method), stop_transfer);
 
-  xdp_dbus_file_transfer_set_version (XDP_DBUS_FILE_TRANSFER (file_transfer), 1);
+  xdp_dbus_file_transfer_set_version (XDP_DBUS_FILE_TRANSFER (file_transfer), 2);
 
   transfers = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_object_unref);
 
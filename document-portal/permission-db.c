@@ -25,6 +25,8 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/statfs.h>
 
 #include "permission-db.h"
@@ -37,10 +39,12 @@ struct PermissionDb
 
   char      *path;
   gboolean   fail_if_not_found;
+  gboolean   read_only; /* Never modify the files, e.g. the journal */
   GvdbTable *gvdb;
   GBytes    *gvdb_contents;
 
   gboolean   dirty;
+  gint       generation; /* atomic, bumped on each change */
 
   /* Map id => GVariant (data, sorted-dict[appid->perms]) */
   GvdbTable  *main_table;
@@ -48,15 +52,60 @@ struct PermissionDb
 
   /* (reverse) Map app id => [ id ]*/
   GvdbTable  *app_table;
-  GHashTable *app_additions;
-  GHashTable *app_removals;
+  gboolean    app_table_sorted; /* id arrays in app_table are sorted */
+  GHashTable *app_updates; /* app id => AppUpdates */
+
+  /* (reverse) Map entry data => [ id ], built on first use */
+  GHashTable *value_index;
+
+  /* Changes not in the journal yet, id => entry (NULL if removed) */
+  GHashTable *journal_pending;
+  goffset     journal_size; /* 0 if there is no journal */
+  gint64      journal_start; /* Monotonic time of first journal write */
+  gboolean    journal_broken; /* A failed append left garbage at the end */
+  gboolean    journaled_since_update;
+  guint       gvdb_generation; /* generation at last update */
 };
 
+/* Stored as "version" in the root table. Files without it were written
+ * before the id arrays in the apps table were guaranteed to be sorted. */
+#define PERMISSION_DB_FORMAT_VERSION 1
+#define PERMISSION_DB_FORMAT_SORTED_APPS 1
+
+/* Changes are appended to a journal next to the db file, as
+ * (id, maybe entry) records. This is replayed on load, and removed
+ * when the whole db is written out again. */
+
+#define JOURNAL_MAGIC "XDPJNL\0\1"
+#define JOURNAL_MAGIC_LEN 8
+#define JOURNAL_RECORD_TYPE "(sm(va{sas}))"
+#define JOURNAL_MIN_COMPACT_SIZE (64 * 1024)
+#define JOURNAL_MAX_COMPACT_SIZE (1024 * 1024)
+#define JOURNAL_MAX_AGE (10 * 60 * G_USEC_PER_SEC)
+
 typedef struct
 {
   GObjectClass parent_class;
 } PermissionDbClass;
 
+/* Changes to the ids of an app relative to app_table. additions never
+ * contains ids that are in app_table, and removals only contains ids
+ * that are, so n_ids is the number of ids the app currently has. */
+typedef struct
+{
+  GHashTable *additions;
+  GHashTable *removals;
+  gsize       n_ids;
+} AppUpdates;
+
+static void
+app_updates_free (AppUpdates *updates)
+{
+  g_hash_table_unref (updates->additions);
+  g_hash_table_unref (updates->removals);
+  g_free (updates);
+}
+
 static void initable_iface_init (GInitableIface *initable_iface);
 
 G_DEFINE_TYPE_WITH_CODE (PermissionDb, permission_db, G_TYPE_OBJECT,
@@ -66,6 +115,7 @@ enum {
   PROP_0,
   PROP_PATH,
   PROP_FAIL_IF_NOT_FOUND,
+  PROP_READ_ONLY,
   LAST_PROP
 };
 
@@ -94,13 +144,6 @@ str_ptr_array_find (GPtrArray  *array,
   return -1;
 }
 
-static gboolean
-str_ptr_array_contains (GPtrArray  *array,
-                        const char *str)
-{
-  return str_ptr_array_find (array, str) >= 0;
-}
-
 const char *
 permission_db_get_path (PermissionDb *self)
 {
@@ -132,6 +175,23 @@ permission_db_new (const char *path,
                          NULL);
 }
 
+/* For processes other than the one owning the db (i.e. the permission
+ * store). Loading such a db never repairs or removes the journal, as
+ * the owner may be appending to it at the same time. */
+PermissionDb *
+permission_db_new_read_only (const char *path,
+                             gboolean    fail_if_not_found,
+                             GError    **error)
+{
+  return g_initable_new (PERMISSION_TYPE_DB,
+                         NULL,
+                         error,
+                         "path", path,
+                         "fail-if-not-found", fail_if_not_found,
+                         "read-only", TRUE,
+                         NULL);
+}
+
 static void
 permission_db_finalize (GObject *object)
 {
@@ -143,8 +203,9 @@ permission_db_finalize (GObject *object)
   g_clear_pointer (&self->main_table, gvdb_table_free);
   g_clear_pointer (&self->app_table, gvdb_table_free);
   g_clear_pointer (&self->main_updates, g_hash_table_unref);
-  g_clear_pointer (&self->app_additions, g_hash_table_unref);
-  g_clear_pointer (&self->app_removals, g_hash_table_unref);
+  g_clear_pointer (&self->app_updates, g_hash_table_unref);
+  g_clear_pointer (&self->journal_pending, g_hash_table_unref);
+  g_clear_pointer (&self->value_index, g_hash_table_unref);
 
   G_OBJECT_CLASS (permission_db_parent_class)->finalize (object);
 }
@@ -167,6 +228,10 @@ permission_db_get_property (GObject    *object,
       g_value_set_boolean (value, self->fail_if_not_found);
       break;
 
+    case PROP_READ_ONLY:
+      g_value_set_boolean (value, self->read_only);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -191,6 +256,10 @@ permission_db_set_property (GObject      *object,
       self->fail_if_not_found = g_value_get_boolean (value);
       break;
 
+    case PROP_READ_ONLY:
+      self->read_only = g_value_get_boolean (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -219,6 +288,13 @@ permission_db_class_init (PermissionDbClass *klass)
                                                          "",
                                                          TRUE,
                                                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+  g_object_class_install_property (object_class,
+                                   PROP_READ_ONLY,
+                                   g_param_spec_boolean ("read-only",
+                                                         "",
+                                                         "",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
 }
 
 static void
@@ -229,12 +305,105 @@ permission_db_init (PermissionDb *self)
   self->main_updates =
     g_hash_table_new_full (g_str_hash, g_str_equal,
                            g_free, (GDestroyNotify) permission_db_entry_unref);
-  self->app_additions =
+  self->app_updates =
     g_hash_table_new_full (g_str_hash, g_str_equal,
-                           g_free, (GDestroyNotify) g_ptr_array_unref);
-  self->app_removals =
+                           g_free, (GDestroyNotify) app_updates_free);
+  self->journal_pending =
     g_hash_table_new_full (g_str_hash, g_str_equal,
-                           g_free, (GDestroyNotify) g_ptr_array_unref);
+                           g_free, (GDestroyNotify) permission_db_entry_unref);
+}
+
+static char *
+get_journal_path (PermissionDb *self)
+{
+  return g_strconcat (self->path, ".journal", NULL);
+}
+
+static void
+replay_journal (PermissionDb *self)
+{
+  g_autofree char *journal_path = get_journal_path (self);
+  g_autofree char *contents = NULL;
+  g_autoptr(GError) error = NULL;
+  gsize length, offset;
+  guint n_records = 0;
+
+  if (!g_file_get_contents (journal_path, &contents, &length, &error))
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_warning ("Unable to read journal %s: %s", journal_path, error->message);
+      return;
+    }
+
+  if (length < JOURNAL_MAGIC_LEN ||
+      memcmp (contents, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0)
+    {
+      /* The owner may just have created it, so only it may remove it */
+      if (self->read_only)
+        return;
+
+      g_warning ("Ignoring invalid journal %s", journal_path);
+      unlink (journal_path);
+      return;
+    }
+
+  /* Each record is a 32bit little endian size, 4 bytes padding and the
+     serialized record, padded to 8 bytes so the next one is aligned */
+  offset = JOURNAL_MAGIC_LEN;
+  while (offset + 8 <= length)
+    {
+      g_autoptr(GVariant) record = NULL;
+      g_autoptr(GVariant) maybe_entry = NULL;
+      g_autoptr(GVariant) entry = NULL;
+      const char *id;
+      guint32 size;
+
+      memcpy (&size, contents + offset, sizeof (size));
+      size = GUINT32_FROM_LE (size);
+      if (((gsize) size + 7) / 8 * 8 > length - offset - 8)
+        break; /* Partially written */
+
+      /* Everything after a bad record is unreadable, as we don't know
+         where the next one starts */
+      record = g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE (JOURNAL_RECORD_TYPE),
+                                                            contents + offset + 8, size,
+                                                            FALSE, NULL, NULL));
+      if (size == 0 || !g_variant_is_normal_form (record))
+        {
+          g_warning ("Invalid record at offset %" G_GSIZE_FORMAT " in journal %s, ignoring the rest",
+                     offset, journal_path);
+          break;
+        }
+
+      g_variant_get (record, "(&s@m(va{sas}))", &id, &maybe_entry);
+      entry = g_variant_get_maybe (maybe_entry);
+
+      /* Make sure the data is not referencing contents */
+      if (entry)
+        {
+          GVariant *copy = g_variant_get_normal_form (entry);
+          g_variant_unref (entry);
+          entry = copy;
+        }
+
+      permission_db_set_entry (self, id, (PermissionDbEntry *) entry);
+      n_records++;
+
+      offset += 8 + ((size + 7) & ~7);
+    }
+
+  /* Drop any partially written or invalid record at the end, so we can
+   * append after it. When read-only it might still be being written, so
+   * leave it. */
+  if (!self->read_only && offset < length && truncate (journal_path, MIN (offset, length)) != 0)
+    g_warning ("Unable to truncate journal %s: %s", journal_path, g_strerror (errno));
+
+  /* Its all in the journal already */
+  g_hash_table_remove_all (self->journal_pending);
+  self->journal_size = MIN (offset, length);
+  self->journal_start = g_get_monotonic_time ();
+
+  g_debug ("Replayed %u records from %s", n_records, journal_path);
 }
 
 static gboolean
@@ -260,6 +429,7 @@ initable_init (GInitable    *initable,
 {
   PermissionDb *self = (PermissionDb *) initable;
   GError *my_error = NULL;
+  g_autoptr(GVariant) version = NULL;
 
   if (self->path == NULL)
     return TRUE;
@@ -320,8 +490,14 @@ initable_init (GInitable    *initable,
                        "No app table in db");
           return FALSE;
         }
+
+      version = gvdb_table_get_value (self->gvdb, "version");
+      if (version != NULL && g_variant_is_of_type (version, G_VARIANT_TYPE_UINT32))
+        self->app_table_sorted = g_variant_get_uint32 (version) >= PERMISSION_DB_FORMAT_SORTED_APPS;
     }
 
+  replay_journal (self);
+
   return TRUE;
 }
 
@@ -371,23 +547,11 @@ permission_db_list_ids (PermissionDb *self)
   return (char **) g_ptr_array_free (res, FALSE);
 }
 
-static gboolean
-app_update_empty (GHashTable *ht, const char *app)
-{
-  GPtrArray *array;
-
-  array = g_hash_table_lookup (ht, app);
-  if (array == NULL)
-    return TRUE;
-
-  return array->len == 0;
-}
-
 /* Transfer: full */
 char **
 permission_db_list_apps (PermissionDb *self)
 {
-  gpointer key, _value;
+  gpointer key, value;
   GHashTableIter iter;
   GPtrArray *res;
   int i;
@@ -396,11 +560,11 @@ permission_db_list_apps (PermissionDb *self)
 
   res = g_ptr_array_new ();
 
-  g_hash_table_iter_init (&iter, self->app_additions);
-  while (g_hash_table_iter_next (&iter, &key, &_value))
+  g_hash_table_iter_init (&iter, self->app_updates);
+  while (g_hash_table_iter_next (&iter, &key, &value))
     {
-      GPtrArray *value = _value;
-      if (value->len > 0)
+      AppUpdates *updates = value;
+      if (updates->n_ids > 0)
         g_ptr_array_add (res, g_strdup (key));
     }
 
@@ -412,37 +576,10 @@ permission_db_list_apps (PermissionDb *self)
       for (i = 0; apps[i] != NULL; i++)
         {
           char *app = apps[i];
-          gboolean empty = TRUE;
-          GPtrArray *removals;
-          int j;
-
-          /* Don't use if we already added above */
-          if (app_update_empty (self->app_additions, app))
-            {
-              g_autoptr(GVariant) ids_v = NULL;
-
-              removals = g_hash_table_lookup (self->app_removals, app);
 
-              /* Add unless all items are removed */
-              ids_v = gvdb_table_get_value (self->app_table, app);
-
-              if (ids_v)
-                {
-                  g_autofree const char **ids = g_variant_get_strv (ids_v, NULL);
-
-                  for (j = 0; ids[j] != NULL; j++)
-                    {
-                      if (removals == NULL ||
-                          !str_ptr_array_contains (removals, ids[j]))
-                        {
-                          empty = FALSE;
-                          break;
-                        }
-                    }
-                }
-            }
-
-          if (empty)
+          /* Apps with changes were handled above, and the table
+           * never has apps without ids */
+          if (g_hash_table_contains (self->app_updates, app))
             g_free (app);
           else
             g_ptr_array_add (res, app);
@@ -459,22 +596,23 @@ permission_db_list_ids_by_app (PermissionDb  *self,
                                const char *app)
 {
   GPtrArray *res;
-  GPtrArray *additions;
-  GPtrArray *removals;
+  AppUpdates *updates;
   int i;
 
   g_return_val_if_fail (PERMISSION_IS_DB (self), NULL);
 
   res = g_ptr_array_new ();
 
-  additions = g_hash_table_lookup (self->app_additions, app);
-  removals = g_hash_table_lookup (self->app_removals, app);
+  updates = g_hash_table_lookup (self->app_updates, app);
 
-  if (additions)
+  if (updates)
     {
-      for (i = 0; i < additions->len; i++)
-        g_ptr_array_add (res,
-                         g_strdup (g_ptr_array_index (additions, i)));
+      GHashTableIter iter;
+      gpointer key;
+
+      g_hash_table_iter_init (&iter, updates->additions);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        g_ptr_array_add (res, g_strdup (key));
     }
 
   if (self->app_table)
@@ -486,8 +624,8 @@ permission_db_list_ids_by_app (PermissionDb  *self,
 
           for (i = 0; ids[i] != NULL; i++)
             {
-              if (removals == NULL ||
-                  !str_ptr_array_contains (removals, ids[i]))
+              if (updates == NULL ||
+                  !g_hash_table_contains (updates->removals, ids[i]))
                 g_ptr_array_add (res, g_strdup (ids[i]));
             }
         }
@@ -522,23 +660,80 @@ permission_db_lookup (PermissionDb  *self,
 }
 
 /* Transfer: full */
-char **
-permission_db_list_ids_by_value (PermissionDb *self,
-                                 GVariant  *data)
+/* Entry data is hashed by its serialized form, so the keys in the
+ * value index must be in normal form */
+static guint
+value_hash (gconstpointer key)
+{
+  GVariant *value = (GVariant *) key;
+  const guchar *data = g_variant_get_data (value);
+  gsize size = g_variant_get_size (value);
+  guint32 h = g_str_hash (g_variant_get_type_string (value));
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    h = (h << 5) + h + data[i];
+
+  return h;
+}
+
+static void
+value_index_add (PermissionDb *self,
+                 GVariant     *data,
+                 const char   *id)
+{
+  g_autoptr(GVariant) key = g_variant_get_normal_form (data);
+  GPtrArray *ids;
+
+  ids = g_hash_table_lookup (self->value_index, key);
+  if (ids == NULL)
+    {
+      ids = g_ptr_array_new_with_free_func (g_free);
+      g_hash_table_insert (self->value_index, g_steal_pointer (&key), ids);
+    }
+
+  g_ptr_array_add (ids, g_strdup (id));
+}
+
+static void
+value_index_remove (PermissionDb *self,
+                    GVariant     *data,
+                    const char   *id)
 {
-  g_autofree char **ids = permission_db_list_ids (self);
+  g_autoptr(GVariant) key = g_variant_get_normal_form (data);
+  GPtrArray *ids;
   int i;
-  GPtrArray *res;
 
-  g_return_val_if_fail (PERMISSION_IS_DB (self), NULL);
-  g_return_val_if_fail (data != NULL, NULL);
+  ids = g_hash_table_lookup (self->value_index, key);
+  if (ids == NULL)
+    return;
 
-  res = g_ptr_array_new ();
+  i = str_ptr_array_find (ids, id);
+  if (i >= 0)
+    g_ptr_array_remove_index_fast (ids, i);
+
+  if (ids->len == 0)
+    g_hash_table_remove (self->value_index, key);
+}
+
+static void
+ensure_value_index (PermissionDb *self)
+{
+  g_autofree char **ids = NULL;
+  int i;
 
+  if (self->value_index != NULL)
+    return;
+
+  self->value_index =
+    g_hash_table_new_full (value_hash, (GEqualFunc) g_variant_equal,
+                           (GDestroyNotify) g_variant_unref,
+                           (GDestroyNotify) g_ptr_array_unref);
+
+  ids = permission_db_list_ids (self);
   for (i = 0; ids[i] != NULL; i++)
     {
-      char *id = ids[i];
-
+      g_autofree char *id = ids[i];
       g_autoptr(PermissionDbEntry) entry = NULL;
       g_autoptr(GVariant) entry_data = NULL;
 
@@ -546,83 +741,171 @@ permission_db_list_ids_by_value (PermissionDb *self,
       if (entry)
         {
           entry_data = permission_db_entry_get_data (entry);
-          if (g_variant_equal (data, entry_data))
-            {
-              g_ptr_array_add (res, id);
-              id = NULL; /* Don't free, as we return this */
-            }
+          value_index_add (self, entry_data, id);
         }
-      g_free (id);
     }
-
-  g_ptr_array_add (res, NULL);
-  return (char **) g_ptr_array_free (res, FALSE);
 }
 
-static void
-add_app_id (PermissionDb  *self,
-            const char *app,
-            const char *id)
+/* Builds the value index on first use, so like the other functions
+ * that change the db this needs external locking */
+char **
+permission_db_list_ids_by_value (PermissionDb *self,
+                                 GVariant  *data)
 {
-  GPtrArray *additions;
-  GPtrArray *removals;
+  g_autoptr(GVariant) key = NULL;
+  GPtrArray *ids;
+  GPtrArray *res;
   int i;
 
-  additions = g_hash_table_lookup (self->app_additions, app);
-  removals = g_hash_table_lookup (self->app_removals, app);
+  g_return_val_if_fail (PERMISSION_IS_DB (self), NULL);
+  g_return_val_if_fail (data != NULL, NULL);
+
+  ensure_value_index (self);
 
-  if (removals)
+  res = g_ptr_array_new ();
+
+  key = g_variant_get_normal_form (data);
+  ids = g_hash_table_lookup (self->value_index, key);
+  if (ids)
     {
-      i = str_ptr_array_find (removals, id);
-      if (i >= 0)
-        g_ptr_array_remove_index_fast (removals, i);
+      for (i = 0; i < ids->len; i++)
+        g_ptr_array_add (res, g_strdup (g_ptr_array_index (ids, i)));
     }
 
-  if (additions)
+  g_ptr_array_add (res, NULL);
+  return (char **) g_ptr_array_free (res, FALSE);
+}
+
+/* Whether id is in the on-disk id array of app. This is a binary search
+ * over the mapped array unless the file is from before they were sorted */
+static gboolean
+app_table_has_id (PermissionDb *self,
+                  const char   *app,
+                  const char   *id)
+{
+  g_autoptr(GVariant) ids_v = NULL;
+  const char *child_id;
+  gsize start, end, m;
+  int cmp;
+
+  if (self->app_table == NULL)
+    return FALSE;
+
+  ids_v = gvdb_table_get_value (self->app_table, app);
+  if (ids_v == NULL)
+    return FALSE;
+
+  if (!self->app_table_sorted)
     {
-      if (!str_ptr_array_contains (additions, id))
-        g_ptr_array_add (additions, g_strdup (id));
+      gsize i, n_children = g_variant_n_children (ids_v);
+
+      for (i = 0; i < n_children; i++)
+        {
+          g_variant_get_child (ids_v, i, "&s", &child_id);
+          if (strcmp (id, child_id) == 0)
+            return TRUE;
+        }
+
+      return FALSE;
     }
-  else
+
+  start = 0;
+  end = g_variant_n_children (ids_v);
+  while (start < end)
     {
-      additions = g_ptr_array_new_with_free_func (g_free);
-      g_ptr_array_add (additions, g_strdup (id));
-      g_hash_table_insert (self->app_additions,
-                           g_strdup (app), additions);
+      m = (start + end) / 2;
+
+      g_variant_get_child (ids_v, m, "&s", &child_id);
+
+      cmp = strcmp (id, child_id);
+      if (cmp == 0)
+        return TRUE;
+      else if (cmp < 0)
+        end = m;
+      else /* cmp > 0 */
+        start = m + 1;
     }
+
+  return FALSE;
 }
 
-static void
-remove_app_id (PermissionDb  *self,
-               const char *app,
-               const char *id)
+gboolean
+permission_db_has_app_id (PermissionDb *self,
+                          const char   *app,
+                          const char   *id)
 {
-  GPtrArray *additions;
-  GPtrArray *removals;
-  int i;
+  AppUpdates *updates;
 
-  additions = g_hash_table_lookup (self->app_additions, app);
-  removals = g_hash_table_lookup (self->app_removals, app);
+  g_return_val_if_fail (PERMISSION_IS_DB (self), FALSE);
+  g_return_val_if_fail (app != NULL, FALSE);
+  g_return_val_if_fail (id != NULL, FALSE);
 
-  if (additions)
+  updates = g_hash_table_lookup (self->app_updates, app);
+  if (updates)
     {
-      i = str_ptr_array_find (additions, id);
-      if (i >= 0)
-        g_ptr_array_remove_index_fast (additions, i);
+      if (g_hash_table_contains (updates->additions, id))
+        return TRUE;
+      if (g_hash_table_contains (updates->removals, id))
+        return FALSE;
     }
 
-  if (removals)
-    {
-      if (!str_ptr_array_contains (removals, id))
-        g_ptr_array_add (removals, g_strdup (id));
-    }
-  else
+  return app_table_has_id (self, app, id);
+}
+
+static AppUpdates *
+ensure_app_updates (PermissionDb *self,
+                    const char   *app)
+{
+  AppUpdates *updates;
+
+  updates = g_hash_table_lookup (self->app_updates, app);
+  if (updates == NULL)
     {
-      removals = g_ptr_array_new_with_free_func (g_free);
-      g_ptr_array_add (removals, g_strdup (id));
-      g_hash_table_insert (self->app_removals,
-                           g_strdup (app), removals);
+      updates = g_new0 (AppUpdates, 1);
+      updates->additions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      updates->removals = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+      if (self->app_table)
+        {
+          g_autoptr(GVariant) ids_v = gvdb_table_get_value (self->app_table, app);
+          if (ids_v)
+            updates->n_ids = g_variant_n_children (ids_v);
+        }
+
+      g_hash_table_insert (self->app_updates, g_strdup (app), updates);
     }
+
+  return updates;
+}
+
+static void
+add_app_id (PermissionDb  *self,
+            const char *app,
+            const char *id)
+{
+  AppUpdates *updates = ensure_app_updates (self, app);
+
+  /* Either it is back in app_table, or it is new */
+  if (g_hash_table_remove (updates->removals, id))
+    updates->n_ids++;
+  else if (!app_table_has_id (self, app, id) &&
+           g_hash_table_add (updates->additions, g_strdup (id)))
+    updates->n_ids++;
+}
+
+static void
+remove_app_id (PermissionDb  *self,
+               const char *app,
+               const char *id)
+{
+  AppUpdates *updates = ensure_app_updates (self, app);
+
+  /* Only ids that are really in app_table need to be recorded as removed */
+  if (g_hash_table_remove (updates->additions, id))
+    updates->n_ids--;
+  else if (app_table_has_id (self, app, id) &&
+           g_hash_table_add (updates->removals, g_strdup (id)))
+    updates->n_ids--;
 }
 
 gboolean
@@ -653,9 +936,26 @@ permission_db_set_entry (PermissionDb      *self,
 
   old_entry = permission_db_lookup (self, id);
 
+  if (self->value_index)
+    {
+      if (old_entry)
+        {
+          g_autoptr(GVariant) old_data = permission_db_entry_get_data (old_entry);
+          value_index_remove (self, old_data, id);
+        }
+      if (entry)
+        {
+          g_autoptr(GVariant) new_data = permission_db_entry_get_data (entry);
+          value_index_add (self, new_data, id);
+        }
+    }
+
   g_hash_table_insert (self->main_updates,
                        g_strdup (id),
                        permission_db_entry_ref (entry));
+  g_hash_table_insert (self->journal_pending,
+                       g_strdup (id),
+                       permission_db_entry_ref (entry));
 
   a = empty;
   b = empty;
@@ -714,20 +1014,34 @@ permission_db_set_entry (PermissionDb      *self,
             }
         }
     }
+
+  g_atomic_int_inc (&self->generation);
 }
 
-void
-permission_db_update (PermissionDb *self)
+/* Changes whenever an entry is changed. This is safe to call without
+ * holding the lock protecting the db, to cheaply check whether some
+ * state derived from the db is still valid. */
+guint
+permission_db_get_generation (PermissionDb *self)
 {
-  GHashTable *root, *main_h, *apps_h;
-  GBytes *new_contents;
-  GvdbTable *new_gvdb;
+  g_return_val_if_fail (PERMISSION_IS_DB (self), 0);
+
+  return (guint) g_atomic_int_get (&self->generation);
+}
+
+/* Transfer: full */
+GBytes *
+permission_db_serialize (PermissionDb *self)
+{
+  g_autoptr(GHashTable) root = NULL;
+  GHashTable *main_h, *apps_h;
+  GvdbItem *item;
   int i;
 
   g_auto(GStrv) ids = NULL;
   g_auto(GStrv) apps = NULL;
 
-  g_return_if_fail (PERMISSION_IS_DB (self));
+  g_return_val_if_fail (PERMISSION_IS_DB (self), NULL);
 
   root = gvdb_hash_table_new (NULL, NULL);
   main_h = gvdb_hash_table_new (root, "main");
@@ -735,14 +1049,15 @@ permission_db_update (PermissionDb *self)
   g_hash_table_unref (main_h);
   g_hash_table_unref (apps_h);
 
+  item = gvdb_hash_table_insert (root, "version");
+  gvdb_item_set_value (item, g_variant_new_uint32 (PERMISSION_DB_FORMAT_VERSION));
+
   ids = permission_db_list_ids (self);
   for (i = 0; ids[i] != 0; i++)
     {
       g_autoptr(PermissionDbEntry) entry = permission_db_lookup (self, ids[i]);
       if (entry != NULL)
         {
-          GvdbItem *item;
-
           item = gvdb_hash_table_insert (main_h, ids[i]);
           gvdb_item_set_value (item, (GVariant *) entry);
         }
@@ -753,10 +1068,9 @@ permission_db_update (PermissionDb *self)
     {
       g_auto(GStrv) app_ids = permission_db_list_ids_by_app (self, apps[i]);
       GVariantBuilder builder;
-      GvdbItem *item;
       int j;
 
-      /* May as well ensure that on-disk arrays are sorted, even if we don't use it yet */
+      /* Sorted, so app_table_has_id() can use a binary search */
       sort_strv ((const char **) app_ids);
 
       /* We should never list an app that has empty id lists */
@@ -770,7 +1084,18 @@ permission_db_update (PermissionDb *self)
       gvdb_item_set_value (item, g_variant_builder_end (&builder));
     }
 
-  new_contents = gvdb_table_get_content (root, FALSE);
+  return gvdb_table_get_content (root, FALSE);
+}
+
+void
+permission_db_update (PermissionDb *self)
+{
+  GBytes *new_contents;
+  GvdbTable *new_gvdb;
+
+  g_return_if_fail (PERMISSION_IS_DB (self));
+
+  new_contents = permission_db_serialize (self);
   new_gvdb = gvdb_table_new_from_bytes (new_contents, TRUE, NULL);
 
   /* This was just created, any failure to parse it is purely an internal error */
@@ -781,6 +1106,335 @@ permission_db_update (PermissionDb *self)
   self->gvdb_contents = new_contents;
   self->gvdb = new_gvdb;
   self->dirty = FALSE;
+  self->gvdb_generation = self->generation;
+  self->journaled_since_update = FALSE;
+}
+
+static gboolean
+write_all (int           fd,
+           const guint8 *data,
+           gsize         len)
+{
+  while (len > 0)
+    {
+      ssize_t res = write (fd, data, len);
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+
+      data += res;
+      len -= res;
+    }
+
+  return TRUE;
+}
+
+/* Serializes the records for the changes in journal_pending, with
+ * the magic in front if this starts a new journal */
+static GByteArray *
+build_journal_records (PermissionDb *self)
+{
+  GByteArray *buffer;
+  static const guint8 padding[8] = { 0 };
+  GHashTableIter iter;
+  gpointer key, value;
+
+  buffer = g_byte_array_new ();
+  if (self->journal_size == 0)
+    g_byte_array_append (buffer, (const guint8 *) JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+
+  g_hash_table_iter_init (&iter, self->journal_pending);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      g_autoptr(GVariant) record = NULL;
+      guint32 size;
+
+      record = g_variant_ref_sink (g_variant_new ("(s@m(va{sas}))", (const char *) key,
+                                                  g_variant_new_maybe (G_VARIANT_TYPE ("(va{sas})"),
+                                                                       (GVariant *) value)));
+      size = GUINT32_TO_LE (g_variant_get_size (record));
+
+      g_byte_array_append (buffer, (const guint8 *) &size, sizeof (size));
+      g_byte_array_append (buffer, padding, 4);
+      g_byte_array_append (buffer, g_variant_get_data (record), g_variant_get_size (record));
+      g_byte_array_append (buffer, padding, (8 - g_variant_get_size (record) % 8) % 8);
+    }
+
+  return buffer;
+}
+
+/* Doesn't touch self, so it can run in a thread. journal_size is the
+ * size of the valid journal on disk, 0 if this starts a new one. On
+ * failure, *broken is set if it could not be cut back to that size. */
+static gboolean
+write_journal_records (const char  *journal_path,
+                       GByteArray  *buffer,
+                       goffset      journal_size,
+                       gboolean    *broken,
+                       GError     **error)
+{
+  int fd;
+
+  *broken = FALSE;
+
+  fd = open (journal_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1 ||
+      (journal_size == 0 && ftruncate (fd, 0) != 0) ||
+      !write_all (fd, buffer->data, buffer->len) ||
+      fdatasync (fd) != 0)
+    {
+      int errsv = errno;
+
+      /* Don't leave a partial record behind, the next append would go
+         after it and make everything after it unreadable on replay */
+      if (fd != -1)
+        {
+          if (journal_size == 0)
+            *broken = unlink (journal_path) != 0 && errno != ENOENT;
+          else
+            *broken = ftruncate (fd, journal_size) != 0;
+          close (fd);
+        }
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Unable to write journal %s: %s", journal_path, g_strerror (errsv));
+      return FALSE;
+    }
+
+  close (fd);
+
+  return TRUE;
+}
+
+static void
+journal_records_written (PermissionDb *self,
+                         gsize         len)
+{
+  if (self->journal_size == 0)
+    self->journal_start = g_get_monotonic_time ();
+  self->journal_size += len;
+  self->journaled_since_update = TRUE;
+}
+
+/* Appends the changes since the last call to the journal, which is
+ * much cheaper than writing out the whole db */
+gboolean
+permission_db_append_journal (PermissionDb *self,
+                              GError      **error)
+{
+  g_autoptr(GByteArray) buffer = NULL;
+  g_autofree char *journal_path = NULL;
+  gboolean broken;
+
+  g_return_val_if_fail (PERMISSION_IS_DB (self), FALSE);
+  g_return_val_if_fail (!self->read_only, FALSE);
+
+  if (g_hash_table_size (self->journal_pending) == 0)
+    return TRUE;
+
+  if (self->path == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "No path set");
+      return FALSE;
+    }
+
+  if (self->journal_broken)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   "Journal is broken, the db needs to be saved");
+      return FALSE;
+    }
+
+  buffer = build_journal_records (self);
+  journal_path = get_journal_path (self);
+  if (!write_journal_records (journal_path, buffer, self->journal_size, &broken, error))
+    {
+      self->journal_broken = broken;
+      return FALSE;
+    }
+
+  journal_records_written (self, buffer->len);
+  g_hash_table_remove_all (self->journal_pending);
+
+  return TRUE;
+}
+
+typedef struct {
+  char       *journal_path;
+  GByteArray *buffer;
+  goffset     journal_size;
+  gboolean    broken;
+  GHashTable *written; /* The journal_pending changes in buffer */
+} AppendJournalData;
+
+static void
+append_journal_data_free (AppendJournalData *data)
+{
+  g_free (data->journal_path);
+  g_byte_array_unref (data->buffer);
+  g_hash_table_unref (data->written);
+  g_free (data);
+}
+
+static void
+append_journal_thread (GTask        *task,
+                       gpointer      source_object,
+                       gpointer      task_data,
+                       GCancellable *cancellable)
+{
+  AppendJournalData *data = task_data;
+  GError *error = NULL;
+
+  if (write_journal_records (data->journal_path, data->buffer, data->journal_size, &data->broken, &error))
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_error (task, error);
+}
+
+/* Like permission_db_append_journal(), but the file i/o is done in a
+ * thread. Changes made while it runs are appended by the next call.
+ * Appends must not overlap with each other or with saving the content. */
+void
+permission_db_append_journal_async (PermissionDb        *self,
+                                    GCancellable        *cancellable,
+                                    GAsyncReadyCallback  callback,
+                                    gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AppendJournalData *data;
+
+  g_return_if_fail (PERMISSION_IS_DB (self));
+  g_return_if_fail (!self->read_only);
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, permission_db_append_journal_async);
+
+  if (g_hash_table_size (self->journal_pending) == 0)
+    {
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
+
+  if (self->path == NULL)
+    {
+      g_task_return_new_error (task, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                               "No path set");
+      return;
+    }
+
+  if (self->journal_broken)
+    {
+      g_task_return_new_error (task, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                               "Journal is broken, the db needs to be saved");
+      return;
+    }
+
+  data = g_new0 (AppendJournalData, 1);
+  data->journal_path = get_journal_path (self);
+  data->buffer = build_journal_records (self);
+  data->journal_size = self->journal_size;
+  data->written = g_steal_pointer (&self->journal_pending);
+  self->journal_pending =
+    g_hash_table_new_full (g_str_hash, g_str_equal,
+                           g_free, (GDestroyNotify) permission_db_entry_unref);
+  g_task_set_task_data (task, data, (GDestroyNotify) append_journal_data_free);
+
+  g_task_run_in_thread (task, append_journal_thread);
+}
+
+gboolean
+permission_db_append_journal_finish (PermissionDb  *self,
+                                     GAsyncResult  *res,
+                                     GError       **error)
+{
+  AppendJournalData *data;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_return_val_if_fail (g_task_is_valid (res, self), FALSE);
+
+  data = g_task_get_task_data (G_TASK (res));
+
+  if (!g_task_propagate_boolean (G_TASK (res), error))
+    {
+      /* Try again with the next append, unless changed since */
+      if (data != NULL)
+        {
+          self->journal_broken = data->broken;
+
+          g_hash_table_iter_init (&iter, data->written);
+          while (g_hash_table_iter_next (&iter, &key, &value))
+            {
+              if (!g_hash_table_contains (self->journal_pending, key))
+                {
+                  g_hash_table_iter_steal (&iter);
+                  g_hash_table_insert (self->journal_pending, key, value);
+                }
+            }
+        }
+
+      return FALSE;
+    }
+
+  if (data != NULL)
+    journal_records_written (self, data->buffer->len);
+
+  return TRUE;
+}
+
+/* Whether the journal is big or old enough that the whole db should be
+ * written out again (with update and save_content), which removes it */
+gboolean
+permission_db_needs_compaction (PermissionDb *self)
+{
+  goffset max_size;
+
+  g_return_val_if_fail (PERMISSION_IS_DB (self), FALSE);
+
+  /* Nothing more can be appended after garbage */
+  if (self->journal_broken)
+    return TRUE;
+
+  if (self->journal_size == 0)
+    return FALSE;
+
+  /* Compact when the journal is half the size of the db, within limits */
+  max_size = self->gvdb_contents ? g_bytes_get_size (self->gvdb_contents) / 2 : 0;
+  max_size = CLAMP (max_size, JOURNAL_MIN_COMPACT_SIZE, JOURNAL_MAX_COMPACT_SIZE);
+
+  return
+    self->journal_size > max_size ||
+    g_get_monotonic_time () - self->journal_start > JOURNAL_MAX_AGE;
+}
+
+/* Called when the output of update was saved */
+static void
+content_saved (PermissionDb *self)
+{
+  g_autofree char *journal_path = NULL;
+
+  /* The journal is still needed if something was journaled after the update */
+  if (self->path == NULL || self->journaled_since_update)
+    return;
+
+  journal_path = get_journal_path (self);
+  if (unlink (journal_path) != 0 && errno != ENOENT)
+    {
+      g_warning ("Unable to remove journal %s: %s", journal_path, g_strerror (errno));
+      return;
+    }
+
+  self->journal_size = 0;
+  self->journal_start = 0;
+  self->journal_broken = FALSE;
+
+  /* Everything pending is in the saved db */
+  if (self->generation == self->gvdb_generation)
+    g_hash_table_remove_all (self->journal_pending);
 }
 
 GBytes *
@@ -813,7 +1467,12 @@ permission_db_save_content (PermissionDb *self,
     }
 
   content = self->gvdb_contents;
-  return g_file_set_contents (self->path, g_bytes_get_data (content, NULL), g_bytes_get_size (content), error);
+  if (!g_file_set_contents (self->path, g_bytes_get_data (content, NULL), g_bytes_get_size (content), error))
+    return FALSE;
+
+  content_saved (self);
+
+  return TRUE;
 }
 
 static void
@@ -830,7 +1489,10 @@ save_content_callback (GObject      *source_object,
                                        res,
                                        NULL, &error);
   if (ok)
-    g_task_return_boolean (task, TRUE);
+    {
+      content_saved (g_task_get_source_object (task));
+      g_task_return_boolean (task, TRUE);
+    }
   else
     g_task_return_error (task, error);
 }
@@ -1023,10 +1685,12 @@ permission_db_entry_get_permissions_variant (PermissionDbEntry *entry,
 
       cmp = strcmp (app_id, child_app_id);
       if (cmp == 0)
-        {
-          res = g_variant_get_child_value (child, 1);
-          break;
-        }
+        res = g_variant_get_child_value (child, 1);
+
+      g_variant_unref (child);
+
+      if (cmp == 0)
+        break;
       else if (cmp < 0)
         {
           end = m;
@@ -40,10 +40,16 @@ GType permission_db_get_type (void);
 PermissionDb *     permission_db_new (const char *path,
                                       gboolean    fail_if_not_found,
                                       GError    **error);
+PermissionDb *     permission_db_new_read_only (const char *path,
+                                                gboolean    fail_if_not_found,
+                                                GError    **error);
 char **        permission_db_list_ids (PermissionDb *self);
 char **        permission_db_list_apps (PermissionDb *self);
 char **        permission_db_list_ids_by_app (PermissionDb  *self,
                                               const char *app);
+gboolean       permission_db_has_app_id (PermissionDb *self,
+                                         const char   *app,
+                                         const char   *id);
 char **        permission_db_list_ids_by_value (PermissionDb *self,
                                                 GVariant  *data);
 PermissionDbEntry *permission_db_lookup (PermissionDb  *self,
@@ -53,14 +59,26 @@ GString *      permission_db_print_string (PermissionDb *self,
 char *         permission_db_print (PermissionDb *self);
 
 gboolean       permission_db_is_dirty (PermissionDb *self);
+guint          permission_db_get_generation (PermissionDb *self);
 void           permission_db_set_entry (PermissionDb      *self,
                                         const char     *id,
                                         PermissionDbEntry *entry);
+GBytes *       permission_db_serialize (PermissionDb *self);
 void           permission_db_update (PermissionDb *self);
 GBytes *       permission_db_get_content (PermissionDb *self);
 const char *   permission_db_get_path (PermissionDb *self);
 gboolean       permission_db_save_content (PermissionDb *self,
                                            GError   **error);
+gboolean       permission_db_append_journal (PermissionDb *self,
+                                             GError      **error);
+void           permission_db_append_journal_async (PermissionDb        *self,
+                                                   GCancellable        *cancellable,
+                                                   GAsyncReadyCallback  callback,
+                                                   gpointer             user_data);
+gboolean       permission_db_append_journal_finish (PermissionDb  *self,
+                                                    GAsyncResult  *res,
+                                                    GError       **error);
+gboolean       permission_db_needs_compaction (PermissionDb *self);
 void           permission_db_save_content_async (PermissionDb          *self,
                                                  GCancellable       *cancellable,
                                                  GAsyncReadyCallback callback,
@@ -55,11 +55,15 @@ on_name_lost (GDBusConnection *connection,
 static gboolean opt_verbose;
 static gboolean opt_replace;
 static gboolean opt_version;
+static int opt_write_window = -1;
+static int opt_write_batch = -1;
 
 static GOptionEntry entries[] = {
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print debug information", NULL },
   { "replace", 'r', 0, G_OPTION_ARG_NONE, &opt_replace, "Replace", NULL },
   { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Print version and exit", NULL },
+  { "write-window", 0, 0, G_OPTION_ARG_INT, &opt_write_window, "Time to wait for more changes before writing, in ms (0 to write immediately)", "MS" },
+  { "write-batch", 0, 0, G_OPTION_ARG_INT, &opt_write_batch, "Write immediately once this many changes are pending", "N" },
   { NULL }
 };
 
@@ -116,6 +120,8 @@ main (int    argc,
   if (opt_verbose)
     g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, message_handler, NULL);
 
+  xdg_permission_store_set_write_window (opt_write_window, opt_write_batch);
+
   g_set_prgname (argv[0]);
 
   owner_id = g_bus_own_name (G_BUS_TYPE_SESSION,
@@ -20,10 +20,15 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <locale.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 #include "permission-store-dbus.h"
 #include "xdg-permission-store.h"
 #include "permission-db.h"
@@ -36,15 +41,56 @@ typedef struct
   char      *name;
   PermissionDb *db;
   GList     *outstanding_writes;
+  guint      n_outstanding_writes;
   GList     *current_writes;
   gboolean   writing;
+  guint      write_window_timeout;
+  guint      compact_timeout;
+
+  guint32    version; /* bumped on each change */
+  int        snapshot_fd;
+  guint32    snapshot_version;
+  int        snapshot_counter_fd;
+  gint      *snapshot_counter;
 } Table;
 
-static void start_writeout (Table *table);
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+/* Writes that come in within write_window_ms of the first one are
+ * written out together, unless there are already write_max_batch. */
+#define DEFAULT_WRITE_WINDOW_MS 5
+#define DEFAULT_WRITE_MAX_BATCH 64
+
+static guint write_window_ms = DEFAULT_WRITE_WINDOW_MS;
+static guint write_max_batch = DEFAULT_WRITE_MAX_BATCH;
+
+/* Number of writeouts, and the number of writes they included */
+static guint64 n_writeouts = 0;
+static guint64 n_batched_writes = 0;
+static guint largest_batch = 0;
+
+/* Writes only go to the journal, so make sure it doesn't stay around
+ * forever if no more writes come */
+#define COMPACT_TIMEOUT_SECS (10 * 60)
+
+static void start_writeout (Table   *table,
+                            gboolean compact);
 
 static void
 table_free (Table *table)
 {
+  if (table->write_window_timeout != 0)
+    g_source_remove (table->write_window_timeout);
+  if (table->compact_timeout != 0)
+    g_source_remove (table->compact_timeout);
+  if (table->snapshot_fd != -1)
+    close (table->snapshot_fd);
+  if (table->snapshot_counter != NULL)
+    munmap (table->snapshot_counter, sizeof (gint));
+  if (table->snapshot_counter_fd != -1)
+    close (table->snapshot_counter_fd);
   g_free (table->name);
   g_object_unref (table->db);
   g_free (table);
@@ -81,6 +127,8 @@ lookup_table (const char            *name,
   table = g_new0 (Table, 1);
   table->name = g_strdup (name);
   table->db = db;
+  table->snapshot_fd = -1;
+  table->snapshot_counter_fd = -1;
 
   g_hash_table_insert (tables, table->name, table);
 
@@ -88,18 +136,12 @@ lookup_table (const char            *name,
 }
 
 static void
-writeout_done (GObject      *source_object,
-               GAsyncResult *res,
-               gpointer      user_data)
+writeout_complete (Table    *table,
+                   gboolean  ok,
+                   GError   *error)
 {
-  Table *table = user_data;
   GList *l;
 
-  g_autoptr(GError) error = NULL;
-  gboolean ok;
-
-  ok = permission_db_save_content_finish (table->db, res, &error);
-
   for (l = table->current_writes; l != NULL; l = l->next)
     {
       GDBusMethodInvocation *invocation = l->data;
@@ -118,30 +160,306 @@ writeout_done (GObject      *source_object,
   table->writing = FALSE;
 
   if (table->outstanding_writes != NULL)
-    start_writeout (table);
+    start_writeout (table, FALSE);
 }
 
 static void
-start_writeout (Table *table)
+writeout_done (GObject      *source_object,
+               GAsyncResult *res,
+               gpointer      user_data)
+{
+  Table *table = user_data;
+
+  g_autoptr(GError) error = NULL;
+  gboolean ok;
+
+  ok = permission_db_save_content_finish (table->db, res, &error);
+
+  writeout_complete (table, ok, error);
+}
+
+static gboolean
+compact_timeout_cb (gpointer user_data)
+{
+  Table *table = user_data;
+
+  table->compact_timeout = 0;
+
+  /* Try again later, rather than racing with the ongoing write */
+  if (table->writing)
+    {
+      table->compact_timeout = g_timeout_add_seconds (COMPACT_TIMEOUT_SECS, compact_timeout_cb, table);
+      return G_SOURCE_REMOVE;
+    }
+
+  start_writeout (table, TRUE);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+journal_append_done (GObject      *source_object,
+                     GAsyncResult *res,
+                     gpointer      user_data)
+{
+  Table *table = user_data;
+
+  g_autoptr(GError) error = NULL;
+  gboolean ok;
+
+  ok = permission_db_append_journal_finish (table->db, res, &error);
+
+  if (ok && table->compact_timeout == 0)
+    table->compact_timeout = g_timeout_add_seconds (COMPACT_TIMEOUT_SECS, compact_timeout_cb, table);
+
+  writeout_complete (table, ok, error);
+}
+
+static void
+start_writeout (Table   *table,
+                gboolean compact)
 {
   g_assert (table->current_writes == NULL);
   table->current_writes = table->outstanding_writes;
   table->outstanding_writes = NULL;
   table->writing = TRUE;
 
+  if (table->write_window_timeout != 0)
+    {
+      g_source_remove (table->write_window_timeout);
+      table->write_window_timeout = 0;
+    }
+
+  if (table->n_outstanding_writes > 0)
+    {
+      n_writeouts++;
+      n_batched_writes += table->n_outstanding_writes;
+      largest_batch = MAX (largest_batch, table->n_outstanding_writes);
+
+      g_debug ("Writing %u changes to table %s (%" G_GUINT64_FORMAT " changes in %" G_GUINT64_FORMAT " writes so far)",
+               table->n_outstanding_writes, table->name, n_batched_writes, n_writeouts);
+      table->n_outstanding_writes = 0;
+    }
+
+  /* Normally we just append the changes to the journal, and only write
+     out the whole db when the journal grows too big */
+  if (!compact && !permission_db_needs_compaction (table->db))
+    {
+      permission_db_append_journal_async (table->db, NULL, journal_append_done, table);
+      return;
+    }
+
+  if (table->compact_timeout != 0)
+    {
+      g_source_remove (table->compact_timeout);
+      table->compact_timeout = 0;
+    }
+
   permission_db_update (table->db);
 
   permission_db_save_content_async (table->db, NULL, writeout_done, table);
 }
 
+static gboolean
+write_window_cb (gpointer user_data)
+{
+  Table *table = user_data;
+
+  table->write_window_timeout = 0;
+
+  if (!table->writing)
+    start_writeout (table, FALSE);
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 ensure_writeout (Table                 *table,
                  GDBusMethodInvocation *invocation)
 {
   table->outstanding_writes = g_list_prepend (table->outstanding_writes, invocation);
+  table->n_outstanding_writes++;
 
-  if (!table->writing)
-    start_writeout (table);
+  /* All changes end up here, so let snapshot readers know */
+  table->version++;
+  if (table->snapshot_counter != NULL)
+    g_atomic_int_set (table->snapshot_counter, table->version);
+
+  /* These go out together when the current write is done */
+  if (table->writing)
+    return;
+
+  if (write_window_ms == 0 || table->n_outstanding_writes >= write_max_batch)
+    start_writeout (table, FALSE);
+  else if (table->write_window_timeout == 0)
+    table->write_window_timeout = g_timeout_add (write_window_ms, write_window_cb, table);
+}
+
+/* Read-only snapshots of a table, which local clients can map and read
+ * without a round trip for each lookup. snapshot_counter is a shared
+ * page with the current version of the table, so clients can cheaply
+ * check if their snapshot is still up to date. */
+
+static gboolean
+table_ensure_snapshot_counter (Table   *table,
+                               GError **error)
+{
+  xdp_autofd int fd = -1;
+  void *map;
+
+  if (table->snapshot_counter != NULL)
+    return TRUE;
+
+  fd = memfd_create ("xdg-permission-store-counter", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1 || ftruncate (fd, sizeof (gint)) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Unable to create counter: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+  map = mmap (NULL, sizeof (gint), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Unable to map counter: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+  /* Only our mapping can write to it. F_SEAL_FUTURE_WRITE needs
+   * Linux 5.1, on older kernels clients have to be trusted not to */
+  if (fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) != 0 &&
+      (errno != EINVAL ||
+       fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0))
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Unable to seal counter: %s", g_strerror (errno));
+      munmap (map, sizeof (gint));
+      return FALSE;
+    }
+
+  table->snapshot_counter = map;
+  table->snapshot_counter_fd = xdp_steal_fd (&fd);
+  g_atomic_int_set (table->snapshot_counter, table->version);
+
+  return TRUE;
+}
+
+static gboolean
+table_ensure_snapshot (Table   *table,
+                       GError **error)
+{
+  g_autoptr(GBytes) content = NULL;
+  xdp_autofd int fd = -1;
+  const guint8 *data;
+  gsize size;
+
+  if (!table_ensure_snapshot_counter (table, error))
+    return FALSE;
+
+  if (table->snapshot_fd != -1 && table->snapshot_version == table->version)
+    return TRUE;
+
+  content = permission_db_serialize (table->db);
+  data = g_bytes_get_data (content, &size);
+
+  fd = memfd_create ("xdg-permission-store-snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Unable to create snapshot: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+  while (size > 0)
+    {
+      ssize_t res = write (fd, data, size);
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                       "Unable to write snapshot: %s", g_strerror (errno));
+          return FALSE;
+        }
+
+      data += res;
+      size -= res;
+    }
+
+  if (fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Unable to seal snapshot: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+  if (table->snapshot_fd != -1)
+    close (table->snapshot_fd);
+  table->snapshot_fd = xdp_steal_fd (&fd);
+  table->snapshot_version = table->version;
+
+  return TRUE;
+}
+
+static gboolean
+handle_get_write_stats (XdgPermissionStore     *object,
+                        GDBusMethodInvocation  *invocation)
+{
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}", "writeouts", g_variant_new_uint64 (n_writeouts));
+  g_variant_builder_add (&builder, "{sv}", "writes", g_variant_new_uint64 (n_batched_writes));
+  g_variant_builder_add (&builder, "{sv}", "largest-batch", g_variant_new_uint32 (largest_batch));
+
+  xdg_permission_store_complete_get_write_stats (object, invocation, g_variant_builder_end (&builder));
+
+  return TRUE;
+}
+
+static gboolean
+handle_get_snapshot (XdgPermissionStore     *object,
+                     GDBusMethodInvocation  *invocation,
+                     GUnixFDList            *fd_list,
+                     const gchar            *table_name)
+{
+  Table *table;
+  g_autoptr(GUnixFDList) out_fd_list = NULL;
+  g_autoptr(GError) error = NULL;
+  int snapshot_handle, counter_handle = -1;
+
+  table = lookup_table (table_name, invocation);
+  if (table == NULL)
+    return TRUE;
+
+  if (!table_ensure_snapshot (table, &error))
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_FAILED,
+                                             "Unable to create snapshot: %s", error->message);
+      return TRUE;
+    }
+
+  out_fd_list = g_unix_fd_list_new ();
+  snapshot_handle = g_unix_fd_list_append (out_fd_list, table->snapshot_fd, &error);
+  if (snapshot_handle != -1)
+    counter_handle = g_unix_fd_list_append (out_fd_list, table->snapshot_counter_fd, &error);
+  if (snapshot_handle == -1 || counter_handle == -1)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_FAILED,
+                                             "Unable to pass snapshot: %s", error->message);
+      return TRUE;
+    }
+
+  xdg_permission_store_complete_get_snapshot (object, invocation, out_fd_list,
+                                              g_variant_new_handle (snapshot_handle),
+                                              g_variant_new_handle (counter_handle),
+                                              table->snapshot_version);
+
+  return TRUE;
 }
 
 static gboolean
@@ -458,6 +776,253 @@ handle_set_permission (XdgPermissionStore     *object,
   return TRUE;
 }
 
+static void
+add_change (GVariantBuilder   *changes,
+            const char        *id,
+            gboolean           deleted,
+            PermissionDbEntry *entry)
+{
+  g_autoptr(GVariant) data = NULL;
+  g_autoptr(GVariant) permissions = NULL;
+
+  data = permission_db_entry_get_data (entry);
+  if (deleted)
+    permissions = g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE ("{sas}"), NULL, 0));
+  else
+    permissions = get_app_permissions (entry);
+
+  g_variant_builder_add (changes, "(sb@v@a{sas})",
+                         id, deleted,
+                         g_variant_new_variant (data),
+                         permissions);
+}
+
+static gboolean
+handle_lookup_many (XdgPermissionStore     *object,
+                    GDBusMethodInvocation  *invocation,
+                    const gchar            *table_name,
+                    const gchar *const     *ids)
+{
+  Table *table;
+  GVariantBuilder builder;
+  int i;
+
+  table = lookup_table (table_name, invocation);
+  if (table == NULL)
+    return TRUE;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(a{sas}v)}"));
+
+  for (i = 0; ids[i] != NULL; i++)
+    {
+      g_autoptr(PermissionDbEntry) entry = NULL;
+      g_autoptr(GVariant) data = NULL;
+      g_autoptr(GVariant) permissions = NULL;
+
+      entry = permission_db_lookup (table->db, ids[i]);
+      if (entry == NULL)
+        continue;
+
+      data = permission_db_entry_get_data (entry);
+      permissions = get_app_permissions (entry);
+
+      g_variant_builder_add (&builder, "{s(@a{sas}v)}", ids[i], permissions, data);
+    }
+
+  xdg_permission_store_complete_lookup_many (object, invocation,
+                                             g_variant_builder_end (&builder));
+
+  return TRUE;
+}
+
+static gboolean
+handle_set_many (XdgPermissionStore     *object,
+                 GDBusMethodInvocation  *invocation,
+                 const gchar            *table_name,
+                 gboolean                create,
+                 GVariant               *app_permissions)
+{
+  Table *table;
+  GVariantIter iter;
+  const char *id;
+  const char *app;
+  const char **permissions;
+  g_autoptr(GHashTable) new_entries = NULL;
+  g_autoptr(GPtrArray) changed_ids = NULL;
+  GVariantBuilder changes;
+  int i;
+
+  table = lookup_table (table_name, invocation);
+  if (table == NULL)
+    return TRUE;
+
+  /* Compute all the new entries first, so nothing is changed on errors */
+  new_entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       g_free, (GDestroyNotify) permission_db_entry_unref);
+  changed_ids = g_ptr_array_new_with_free_func (g_free);
+
+  g_variant_iter_init (&iter, app_permissions);
+  while (g_variant_iter_next (&iter, "(&s&s^a&s)", &id, &app, &permissions))
+    {
+      g_autofree const char **permissions_owned = permissions;
+      g_autoptr(PermissionDbEntry) entry = NULL;
+
+      entry = permission_db_entry_ref (g_hash_table_lookup (new_entries, id));
+      if (entry == NULL)
+        {
+          entry = permission_db_lookup (table->db, id);
+          if (entry == NULL)
+            {
+              if (!create)
+                {
+                  g_dbus_method_invocation_return_error (invocation,
+                                                         XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND,
+                                                         "Id %s not found", id);
+                  return TRUE;
+                }
+
+              entry = permission_db_entry_new (NULL);
+            }
+
+          g_ptr_array_add (changed_ids, g_strdup (id));
+        }
+
+      g_hash_table_insert (new_entries, g_strdup (id),
+                           permission_db_entry_set_app_permissions (entry, app, permissions));
+    }
+
+  g_variant_builder_init (&changes, G_VARIANT_TYPE ("a(sbva{sas})"));
+
+  for (i = 0; i < changed_ids->len; i++)
+    {
+      const char *changed_id = g_ptr_array_index (changed_ids, i);
+      PermissionDbEntry *new_entry = g_hash_table_lookup (new_entries, changed_id);
+
+      permission_db_set_entry (table->db, changed_id, new_entry);
+      add_change (&changes, changed_id, FALSE, new_entry);
+    }
+
+  xdg_permission_store_emit_changed_many (object, table_name,
+                                          g_variant_builder_end (&changes));
+
+  ensure_writeout (table, invocation);
+
+  return TRUE;
+}
+
+static gboolean
+handle_set_entries (XdgPermissionStore     *object,
+                    GDBusMethodInvocation  *invocation,
+                    const gchar            *table_name,
+                    GVariant               *entries)
+{
+  Table *table;
+  GVariantIter iter;
+  const char *id;
+  GVariant *app_permissions;
+  GVariant *data;
+  GVariantBuilder changes;
+
+  table = lookup_table (table_name, invocation);
+  if (table == NULL)
+    return TRUE;
+
+  g_variant_builder_init (&changes, G_VARIANT_TYPE ("a(sbva{sas})"));
+
+  g_variant_iter_init (&iter, entries);
+  while (g_variant_iter_next (&iter, "{&s(@a{sas}v)}", &id, &app_permissions, &data))
+    {
+      g_autoptr(GVariant) app_permissions_owned = app_permissions;
+      g_autoptr(GVariant) data_owned = data;
+      g_autoptr(PermissionDbEntry) new_entry = NULL;
+      GVariantIter perms_iter;
+      const char *app;
+      const char **permissions;
+
+      new_entry = permission_db_entry_new (data);
+
+      g_variant_iter_init (&perms_iter, app_permissions);
+      while (g_variant_iter_next (&perms_iter, "{&s^a&s}", &app, &permissions))
+        {
+          g_autofree const char **permissions_owned = permissions;
+          PermissionDbEntry *old_entry = new_entry;
+
+          new_entry = permission_db_entry_set_app_permissions (old_entry, app, permissions);
+          permission_db_entry_unref (old_entry);
+        }
+
+      permission_db_set_entry (table->db, id, new_entry);
+      add_change (&changes, id, FALSE, new_entry);
+    }
+
+  xdg_permission_store_emit_changed_many (object, table_name,
+                                          g_variant_builder_end (&changes));
+
+  ensure_writeout (table, invocation);
+
+  return TRUE;
+}
+
+static gboolean
+handle_delete_many (XdgPermissionStore     *object,
+                    GDBusMethodInvocation  *invocation,
+                    const gchar            *table_name,
+                    const gchar *const     *ids)
+{
+  Table *table;
+  g_autoptr(GHashTable) old_entries = NULL;
+  g_autoptr(GPtrArray) deleted_ids = NULL;
+  GVariantBuilder changes;
+  int i;
+
+  table = lookup_table (table_name, invocation);
+  if (table == NULL)
+    return TRUE;
+
+  /* Check all the ids first, so nothing is deleted on errors */
+  old_entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       NULL, (GDestroyNotify) permission_db_entry_unref);
+  deleted_ids = g_ptr_array_new ();
+
+  for (i = 0; ids[i] != NULL; i++)
+    {
+      PermissionDbEntry *entry;
+
+      if (g_hash_table_contains (old_entries, ids[i]))
+        continue;
+
+      entry = permission_db_lookup (table->db, ids[i]);
+      if (entry == NULL)
+        {
+          g_dbus_method_invocation_return_error (invocation,
+                                                 XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND,
+                                                 "No entry for %s", ids[i]);
+          return TRUE;
+        }
+
+      g_hash_table_insert (old_entries, (char *) ids[i], entry);
+      g_ptr_array_add (deleted_ids, (char *) ids[i]);
+    }
+
+  g_variant_builder_init (&changes, G_VARIANT_TYPE ("a(sbva{sas})"));
+
+  for (i = 0; i < deleted_ids->len; i++)
+    {
+      const char *id = g_ptr_array_index (deleted_ids, i);
+      PermissionDbEntry *entry = g_hash_table_lookup (old_entries, id);
+
+      permission_db_set_entry (table->db, id, NULL);
+      add_change (&changes, id, TRUE, entry);
+    }
+
+  xdg_permission_store_emit_changed_many (object, table_name,
+                                          g_variant_builder_end (&changes));
+
+  ensure_writeout (table, invocation);
+
+  return TRUE;
+}
+
 static gboolean
 handle_set_value (XdgPermissionStore     *object,
                   GDBusMethodInvocation  *invocation,
@@ -506,6 +1071,17 @@ handle_set_value (XdgPermissionStore     *object,
   return TRUE;
 }
 
+/* Negative values keep the current setting */
+void
+xdg_permission_store_set_write_window (int window_ms,
+                                       int max_batch)
+{
+  if (window_ms >= 0)
+    write_window_ms = window_ms;
+  if (max_batch >= 0)
+    write_max_batch = MAX (max_batch, 1);
+}
+
 void
 xdg_permission_store_start (GDBusConnection *connection)
 {
@@ -519,7 +1095,7 @@ xdg_permission_store_start (GDBusConnection *connection)
 
   store = xdg_permission_store_skeleton_new ();
 
-  xdg_permission_store_set_version (XDG_PERMISSION_STORE (store), 2);
+  xdg_permission_store_set_version (XDG_PERMISSION_STORE (store), 6);
 
   g_signal_connect (store, "handle-list", G_CALLBACK (handle_list), NULL);
   g_signal_connect (store, "handle-lookup", G_CALLBACK (handle_lookup), NULL);
@@ -529,6 +1105,12 @@ xdg_permission_store_start (GDBusConnection *connection)
   g_signal_connect (store, "handle-delete", G_CALLBACK (handle_delete), NULL);
   g_signal_connect (store, "handle-delete-permission", G_CALLBACK (handle_delete_permission), NULL);
   g_signal_connect (store, "handle-get-permission", G_CALLBACK (handle_get_permission), NULL);
+  g_signal_connect (store, "handle-lookup-many", G_CALLBACK (handle_lookup_many), NULL);
+  g_signal_connect (store, "handle-set-many", G_CALLBACK (handle_set_many), NULL);
+  g_signal_connect (store, "handle-set-entries", G_CALLBACK (handle_set_entries), NULL);
+  g_signal_connect (store, "handle-delete-many", G_CALLBACK (handle_delete_many), NULL);
+  g_signal_connect (store, "handle-get-snapshot", G_CALLBACK (handle_get_snapshot), NULL);
+  g_signal_connect (store, "handle-get-write-stats", G_CALLBACK (handle_get_write_stats), NULL);
 
   if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (store),
                                          connection,
@@ -21,3 +21,5 @@
 #pragma once
 
 void xdg_permission_store_start (GDBusConnection *connection);
+void xdg_permission_store_set_write_window (int window_ms,
+                                            int max_batch);
@@ -78,6 +78,66 @@ device_get_permission_sync (const char *app_id,
   return get_permission_sync (app_id, PERMISSION_TABLE, device);
 }
 
+static void
+build_access_dialog (const char       *app_id,
+                     const char       *device,
+                     GVariantBuilder  *opt_builder,
+                     char            **title,
+                     char            **subtitle,
+                     char            **body)
+{
+  g_autoptr(GAppInfo) info = NULL;
+
+  if (app_id[0] != 0)
+    {
+      g_autofree char *desktop_id;
+      desktop_id = g_strconcat (app_id, ".desktop", NULL);
+      info = (GAppInfo*)g_desktop_app_info_new (desktop_id);
+    }
+
+  g_variant_builder_init (opt_builder, G_VARIANT_TYPE_VARDICT);
+
+  if (strcmp (device, "microphone") == 0)
+    {
+      g_variant_builder_add (opt_builder, "{sv}", "icon", g_variant_new_string ("audio-input-microphone-symbolic"));
+
+      *title = g_strdup (_("Turn On Microphone?"));
+      *body = g_strdup (_("Access to your microphone can be changed "
+                          "at any time from the privacy settings."));
+
+      if (info == NULL)
+        *subtitle = g_strdup (_("An application wants to use your microphone."));
+      else
+        *subtitle = g_strdup_printf (_("%s wants to use your microphone."), g_app_info_get_display_name (info));
+    }
+  else if (strcmp (device, "speakers") == 0)
+    {
+      g_variant_builder_add (opt_builder, "{sv}", "icon", g_variant_new_string ("audio-speakers-symbolic"));
+
+      *title = g_strdup (_("Turn On Speakers?"));
+      *body = g_strdup (_("Access to your speakers can be changed "
+                          "at any time from the privacy settings."));
+
+      if (info == NULL)
+        *subtitle = g_strdup (_("An application wants to play sound."));
+      else
+        *subtitle = g_strdup_printf (_("%s wants to play sound."), g_app_info_get_display_name (info));
+    }
+  else if (strcmp (device, "camera") == 0)
+    {
+      g_variant_builder_add (opt_builder, "{sv}", "icon", g_variant_new_string ("camera-web-symbolic"));
+
+      *title = g_strdup (_("Turn On Camera?"));
+      *body = g_strdup (_("Access to your camera can be changed "
+                          "at any time from the privacy settings."));
+
+      if (info == NULL)
+        *subtitle = g_strdup (_("An application wants to use your camera."));
+      else
+        *subtitle = g_strdup_printf (_("%s wants to use your camera."), g_app_info_get_display_name (info));
+    }
+}
+
 gboolean
 device_query_permission_sync (const char *app_id,
                               const char *device,
@@ -96,57 +156,9 @@ device_query_permission_sync (const char *app_id,
       guint32 response = 2;
       g_autoptr(GVariant) results = NULL;
       g_autoptr(GError) error = NULL;
-      g_autoptr(GAppInfo) info = NULL;
       g_autoptr(XdpImplRequest) impl_request = NULL;
 
-      if (app_id[0] != 0)
-        {
-          g_autofree char *desktop_id;
-          desktop_id = g_strconcat (app_id, ".desktop", NULL);
-          info = (GAppInfo*)g_desktop_app_info_new (desktop_id);
-        }
-
-      g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
-
-      if (strcmp (device, "microphone") == 0)
-        {
-          g_variant_builder_add (&opt_builder, "{sv}", "icon", g_variant_new_string ("audio-input-microphone-symbolic"));
-
-          title = g_strdup (_("Turn On Microphone?"));
-          body = g_strdup (_("Access to your microphone can be changed "
-                             "at any time from the privacy settings."));
-
-          if (info == NULL)
-            subtitle = g_strdup (_("An application wants to use your microphone."));
-          else
-            subtitle = g_strdup_printf (_("%s wants to use your microphone."), g_app_info_get_display_name (info));
-        }
-      else if (strcmp (device, "speakers") == 0)
-        {
-          g_variant_builder_add (&opt_builder, "{sv}", "icon", g_variant_new_string ("audio-speakers-symbolic"));
-
-          title = g_strdup (_("Turn On Speakers?"));
-          body = g_strdup (_("Access to your speakers can be changed "
-                             "at any time from the privacy settings."));
-
-          if (info == NULL)
-            subtitle = g_strdup (_("An application wants to play sound."));
-          else
-            subtitle = g_strdup_printf (_("%s wants to play sound."), g_app_info_get_display_name (info));
-        }
-      else if (strcmp (device, "camera") == 0)
-        {
-          g_variant_builder_add (&opt_builder, "{sv}", "icon", g_variant_new_string ("camera-web-symbolic"));
-
-          title = g_strdup (_("Turn On Camera?"));
-          body = g_strdup (_("Access to your camera can be changed "
-                             "at any time from the privacy settings."));
-
-          if (info == NULL)
-            subtitle = g_strdup (_("An application wants to use your camera."));
-          else
-            subtitle = g_strdup_printf (_("%s wants to use your camera."), g_app_info_get_display_name (info));
-        }
+      build_access_dialog (app_id, device, &opt_builder, &title, &subtitle, &body);
 
       impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
                                                       G_DBUS_PROXY_FLAGS_NONE,
@@ -188,33 +200,105 @@ device_query_permission_sync (const char *app_id,
 }
 
 static void
-handle_access_device_in_thread (GTask *task,
-                                gpointer source_object,
-                                gpointer task_data,
-                                GCancellable *cancellable)
+send_response (Request  *request,
+               gboolean  allowed)
 {
-  Request *request = (Request *)task_data;
+  if (request->exported)
+    {
+      GVariantBuilder results;
+
+      g_variant_builder_init (&results, G_VARIANT_TYPE_VARDICT);
+      xdp_request_emit_response (XDP_REQUEST (request),
+                                 allowed ? XDG_DESKTOP_PORTAL_RESPONSE_SUCCESS : XDG_DESKTOP_PORTAL_RESPONSE_CANCELLED,
+                                 g_variant_builder_end (&results));
+      request_unexport (request);
+    }
+}
+
+static void
+access_dialog_done (GObject      *source,
+                    GAsyncResult *result,
+                    gpointer      data)
+{
+  g_autoptr(Request) request = data;
+  g_autoptr(GVariant) results = NULL;
+  g_autoptr(GError) error = NULL;
+  guint32 response = 2;
   const char *app_id;
   const char *device;
+  Permission permission;
   gboolean allowed;
 
   REQUEST_AUTOLOCK (request);
 
   app_id = (const char *)g_object_get_data (G_OBJECT (request), "app-id");
   device = (const char *)g_object_get_data (G_OBJECT (request), "device");
+  permission = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (request), "permission"));
 
-  allowed = device_query_permission_sync (app_id, device, request);
-
-  if (request->exported)
+  if (!xdp_impl_access_call_access_dialog_finish (XDP_IMPL_ACCESS (source),
+                                                  &response,
+                                                  &results,
+                                                  result,
+                                                  &error))
     {
-      GVariantBuilder results;
+      g_warning ("A backend call failed: %s", error->message);
+    }
 
-      g_variant_builder_init (&results, G_VARIANT_TYPE_VARDICT);
-      xdp_request_emit_response (XDP_REQUEST (request),
-                                 allowed ? XDG_DESKTOP_PORTAL_RESPONSE_SUCCESS : XDG_DESKTOP_PORTAL_RESPONSE_CANCELLED,
-                                 g_variant_builder_end (&results));
-      request_unexport (request);
+  allowed = response == 0;
+
+  if (permission == PERMISSION_UNSET)
+    set_permission (app_id, PERMISSION_TABLE, device, allowed ? PERMISSION_YES : PERMISSION_NO,
+                    NULL, NULL, NULL);
+
+  send_response (request, allowed);
+}
+
+static void
+got_permission (GObject      *source,
+                GAsyncResult *result,
+                gpointer      data)
+{
+  g_autoptr(Request) request = data;
+  GVariantBuilder opt_builder;
+  g_autofree char *title = NULL;
+  g_autofree char *subtitle = NULL;
+  g_autofree char *body = NULL;
+  const char *app_id;
+  const char *device;
+  Permission permission;
+
+  REQUEST_AUTOLOCK (request);
+
+  app_id = (const char *)g_object_get_data (G_OBJECT (request), "app-id");
+  device = (const char *)g_object_get_data (G_OBJECT (request), "device");
+
+  permission = get_permission_finish (result, NULL);
+  if (permission != PERMISSION_ASK && permission != PERMISSION_UNSET)
+    {
+      send_response (request, permission == PERMISSION_YES);
+      return;
     }
+
+  if (!request->exported)
+    return;
+
+  g_object_set_data (G_OBJECT (request), "permission", GINT_TO_POINTER (permission));
+
+  build_access_dialog (app_id, device, &opt_builder, &title, &subtitle, &body);
+
+  g_debug ("Calling backend for device access to: %s", device);
+
+  xdp_impl_access_call_access_dialog (impl,
+                                      request->id,
+                                      app_id,
+                                      "",
+                                      title,
+                                      subtitle,
+                                      body,
+                                      g_variant_builder_end (&opt_builder),
+                                      NULL,
+                                      access_dialog_done,
+                                      g_object_ref (request));
 }
 
 static gboolean
@@ -228,7 +312,6 @@ handle_access_device (XdpDevice *object,
   g_autoptr(XdpAppInfo) app_info = NULL;
   g_autoptr(GError) error = NULL;
   g_autoptr(XdpImplRequest) impl_request = NULL;
-  g_autoptr(GTask) task = NULL;
 
   if (g_strv_length ((char **)devices) != 1 || !g_strv_contains (known_devices, devices[0]))
     {
@@ -310,9 +393,8 @@ handle_access_device (XdpDevice *object,
 
   xdp_device_complete_access_device (object, invocation, request->id);
 
-  task = g_task_new (object, NULL, NULL, NULL);
-  g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, handle_access_device_in_thread);
+  get_permission (xdp_app_info_get_id (app_info), PERMISSION_TABLE, devices[0],
+                  NULL, got_permission, g_object_ref (request));
 
   return G_DBUS_METHOD_INVOCATION_HANDLED;
 }
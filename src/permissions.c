@@ -20,12 +20,462 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <string.h>
+#include <sys/mman.h>
+
+#include <gio/gunixfdlist.h>
 
 #include "permissions.h"
+#include "xdp-utils.h"
+#include "gvdb/gvdb-reader.h"
 
 static XdpImplPermissionStore *permission_store = NULL;
 
+/* Local copies of permission store tables, which are used to look up
+ * permissions without a D-Bus call each time. See GetSnapshot in
+ * org.freedesktop.impl.portal.PermissionStore.xml */
+typedef struct
+{
+  GBytes    *bytes;
+  GvdbTable *gvdb;
+  GvdbTable *main_table;
+  guint32    generation;
+  gint      *generation_counter; /* Shared with the permission store */
+} TableSnapshot;
+
+/* How long to wait before asking for a snapshot of a table again,
+ * after that failed for other reasons than the store not supporting it */
+#define SNAPSHOT_RETRY_INTERVAL (30 * G_USEC_PER_SEC)
+
+G_LOCK_DEFINE_STATIC (snapshots);
+static GHashTable *snapshots = NULL; /* table name -> TableSnapshot */
+static GHashTable *snapshot_retry_times = NULL; /* table name -> monotonic time */
+static gboolean snapshots_unsupported = FALSE;
+static guint snapshots_store_generation = 0; /* bumped when the store is replaced */
+
+static void
+table_snapshot_free (TableSnapshot *snapshot)
+{
+  g_clear_pointer (&snapshot->main_table, gvdb_table_free);
+  g_clear_pointer (&snapshot->gvdb, gvdb_table_free);
+  g_clear_pointer (&snapshot->bytes, g_bytes_unref);
+  if (snapshot->generation_counter != NULL)
+    munmap (snapshot->generation_counter, sizeof (gint));
+  g_free (snapshot);
+}
+
+/* Called without the snapshots lock held, as this blocks on the
+ * permission store. Sets unsupported if it doesn't have snapshots. */
+static TableSnapshot *
+fetch_table_snapshot (const char *table,
+                      gboolean   *unsupported)
+{
+  TableSnapshot *snapshot;
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) snapshot_handle = NULL;
+  g_autoptr(GVariant) counter_handle = NULL;
+  g_autoptr(GMappedFile) mapped = NULL;
+  g_autoptr(GError) error = NULL;
+  xdp_autofd int snapshot_fd = -1;
+  xdp_autofd int counter_fd = -1;
+  guint32 generation;
+  void *counter;
+
+  *unsupported = FALSE;
+
+  if (!xdp_impl_permission_store_call_get_snapshot_sync (permission_store,
+                                                         table,
+                                                         NULL,
+                                                         &snapshot_handle,
+                                                         &counter_handle,
+                                                         &generation,
+                                                         &fd_list,
+                                                         NULL,
+                                                         &error))
+    {
+      /* Older permission store */
+      if (g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
+        *unsupported = TRUE;
+
+      g_dbus_error_strip_remote_error (error);
+      g_debug ("No snapshot of '%s' permissions: %s", table, error->message);
+      return NULL;
+    }
+
+  snapshot_fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (snapshot_handle), &error);
+  if (snapshot_fd != -1)
+    counter_fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (counter_handle), &error);
+  if (snapshot_fd == -1 || counter_fd == -1)
+    {
+      g_debug ("Invalid snapshot of '%s' permissions: %s", table, error->message);
+      return NULL;
+    }
+
+  mapped = g_mapped_file_new_from_fd (snapshot_fd, FALSE, &error);
+  if (mapped == NULL)
+    {
+      g_debug ("Unable to map snapshot of '%s' permissions: %s", table, error->message);
+      return NULL;
+    }
+
+  counter = mmap (NULL, sizeof (gint), PROT_READ, MAP_SHARED, counter_fd, 0);
+  if (counter == MAP_FAILED)
+    {
+      g_debug ("Unable to map snapshot of '%s' permissions: %s", table, g_strerror (errno));
+      return NULL;
+    }
+
+  snapshot = g_new0 (TableSnapshot, 1);
+  snapshot->bytes = g_mapped_file_get_bytes (mapped);
+  snapshot->generation = generation;
+  snapshot->generation_counter = counter;
+
+  /* Not trusted, as it comes from another process */
+  snapshot->gvdb = gvdb_table_new_from_bytes (snapshot->bytes, FALSE, &error);
+  if (snapshot->gvdb != NULL)
+    snapshot->main_table = gvdb_table_get_table (snapshot->gvdb, "main");
+  if (snapshot->main_table == NULL)
+    {
+      g_debug ("Invalid snapshot of '%s' permissions", table);
+      table_snapshot_free (snapshot);
+      return NULL;
+    }
+
+  return snapshot;
+}
+
+static gboolean
+table_snapshot_is_current (TableSnapshot *snapshot)
+{
+  return (guint32) g_atomic_int_get (snapshot->generation_counter) == snapshot->generation;
+}
+
+/* Called with snapshots lock held, which is dropped while fetching a
+ * new snapshot. If fetch is FALSE, only an up-to-date snapshot we
+ * already have is returned. */
+static TableSnapshot *
+ensure_table_snapshot (const char *table,
+                       gboolean    fetch)
+{
+  TableSnapshot *snapshot;
+  TableSnapshot *fetched;
+  gint64 *retry_time;
+  guint store_generation;
+  gboolean unsupported;
+
+  if (snapshots_unsupported || permission_store == NULL)
+    return NULL;
+
+  snapshot = g_hash_table_lookup (snapshots, table);
+  if (snapshot != NULL && table_snapshot_is_current (snapshot))
+    return snapshot;
+
+  g_hash_table_remove (snapshots, table);
+
+  if (!fetch)
+    return NULL;
+
+  /* Don't ask again on every lookup if it failed recently */
+  retry_time = g_hash_table_lookup (snapshot_retry_times, table);
+  if (retry_time != NULL && g_get_monotonic_time () < *retry_time)
+    return NULL;
+
+  store_generation = snapshots_store_generation;
+
+  G_UNLOCK (snapshots);
+  fetched = fetch_table_snapshot (table, &unsupported);
+  G_LOCK (snapshots);
+
+  /* The permission store was replaced meanwhile */
+  if (store_generation != snapshots_store_generation)
+    {
+      g_clear_pointer (&fetched, table_snapshot_free);
+      return NULL;
+    }
+
+  if (fetched == NULL)
+    {
+      if (unsupported)
+        {
+          snapshots_unsupported = TRUE;
+        }
+      else
+        {
+          retry_time = g_new (gint64, 1);
+          *retry_time = g_get_monotonic_time () + SNAPSHOT_RETRY_INTERVAL;
+          g_hash_table_insert (snapshot_retry_times, g_strdup (table), retry_time);
+        }
+
+      return NULL;
+    }
+
+  g_hash_table_remove (snapshot_retry_times, table);
+
+  /* Another thread may have fetched one meanwhile */
+  snapshot = g_hash_table_lookup (snapshots, table);
+  if (snapshot != NULL && table_snapshot_is_current (snapshot))
+    {
+      table_snapshot_free (fetched);
+      return snapshot;
+    }
+
+  g_hash_table_insert (snapshots, g_strdup (table), fetched);
+
+  return fetched;
+}
+
+/* Returns FALSE if there is no snapshot of the table to look in */
+static gboolean
+lookup_in_snapshot (const char  *table,
+                    const char  *id,
+                    gboolean     fetch,
+                    GVariant   **out_perms)
+{
+  TableSnapshot *snapshot;
+  g_autoptr(GVariant) entry = NULL;
+
+  G_LOCK (snapshots);
+
+  snapshot = ensure_table_snapshot (table, fetch);
+  if (snapshot == NULL)
+    {
+      G_UNLOCK (snapshots);
+      return FALSE;
+    }
+
+  entry = gvdb_table_get_value (snapshot->main_table, id);
+
+  G_UNLOCK (snapshots);
+
+  if (entry != NULL && g_variant_is_of_type (entry, G_VARIANT_TYPE ("(va{sas})")))
+    *out_perms = g_variant_get_child_value (entry, 1);
+  else
+    *out_perms = NULL;
+
+  return TRUE;
+}
+
+/* Cache of looked up entries, for when there are no snapshots. This is
+ * kept up to date with the Changed signals of the permission store,
+ * which we only subscribe to for the tables that end up in the cache. */
+#define PERMISSION_CACHE_MAX_ENTRIES 1024
+
+G_LOCK_DEFINE_STATIC (cache);
+static GHashTable *cache = NULL; /* "table\nid" -> permissions, or NULL if there is no entry */
+static GHashTable *cache_tables = NULL; /* tables we get change signals for */
+static guint cache_generation = 0; /* bumped on invalidation */
+
+/* Lookups that didn't need a call to the permission store, and ones that did */
+static guint64 n_cache_hits = 0;
+static guint64 n_cache_misses = 0;
+
+static void
+cache_value_free (GVariant *value)
+{
+  if (value != NULL)
+    g_variant_unref (value);
+}
+
+static char *
+cache_key (const char *table,
+           const char *id)
+{
+  return g_strconcat (table, "\n", id, NULL);
+}
+
+static void changed_cb (GDBusConnection *connection,
+                        const char      *sender_name,
+                        const char      *object_path,
+                        const char      *interface_name,
+                        const char      *signal_name,
+                        GVariant        *parameters,
+                        gpointer         user_data);
+
+/* Called with cache lock held. This is done before looking up an entry
+ * in the store, so no change after the lookup can be missed. */
+static void
+cache_ensure_subscribed (const char *table)
+{
+  if (g_hash_table_contains (cache_tables, table))
+    return;
+
+  /* Both Changed and ChangedMany, for this table only */
+  g_dbus_connection_signal_subscribe (g_dbus_proxy_get_connection (G_DBUS_PROXY (permission_store)),
+                                      "org.freedesktop.impl.portal.PermissionStore",
+                                      "org.freedesktop.impl.portal.PermissionStore",
+                                      NULL,
+                                      "/org/freedesktop/impl/portal/PermissionStore",
+                                      table,
+                                      G_DBUS_SIGNAL_FLAGS_NONE,
+                                      changed_cb,
+                                      NULL, NULL);
+  g_hash_table_add (cache_tables, g_strdup (table));
+}
+
+static void
+cache_invalidate (const char *table,
+                  const char *id)
+{
+  g_autofree char *key = cache_key (table, id);
+
+  G_LOCK (cache);
+  g_hash_table_remove (cache, key);
+  cache_generation++;
+  G_UNLOCK (cache);
+}
+
+static void
+cache_invalidate_all (void)
+{
+  G_LOCK (cache);
+  g_hash_table_remove_all (cache);
+  cache_generation++;
+  G_UNLOCK (cache);
+}
+
+static gboolean
+cache_lookup (const char  *table,
+              const char  *id,
+              GVariant   **out_perms,
+              guint       *out_generation)
+{
+  g_autofree char *key = cache_key (table, id);
+  gpointer value;
+  gboolean found;
+
+  G_LOCK (cache);
+  found = g_hash_table_lookup_extended (cache, key, NULL, &value);
+  if (found)
+    {
+      *out_perms = value ? g_variant_ref (value) : NULL;
+      n_cache_hits++;
+    }
+  else
+    {
+      cache_ensure_subscribed (table);
+      n_cache_misses++;
+      g_debug ("Permission cache miss for %s %s (%" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses)",
+               table, id, n_cache_hits, n_cache_misses);
+    }
+  *out_generation = cache_generation;
+  G_UNLOCK (cache);
+
+  return found;
+}
+
+static void
+cache_insert (const char *table,
+              const char *id,
+              GVariant   *perms,
+              guint       generation)
+{
+  G_LOCK (cache);
+
+  /* Something changed while we were looking it up */
+  if (generation != cache_generation)
+    {
+      G_UNLOCK (cache);
+      return;
+    }
+
+  if (g_hash_table_size (cache) >= PERMISSION_CACHE_MAX_ENTRIES)
+    {
+      GHashTableIter iter;
+
+      /* Make room by dropping an arbitrary entry */
+      g_hash_table_iter_init (&iter, cache);
+      if (g_hash_table_iter_next (&iter, NULL, NULL))
+        g_hash_table_iter_remove (&iter);
+    }
+
+  g_hash_table_insert (cache, cache_key (table, id),
+                       perms ? g_variant_ref (perms) : NULL);
+
+  G_UNLOCK (cache);
+}
+
+static void
+changed_cb (GDBusConnection *connection,
+            const char      *sender_name,
+            const char      *object_path,
+            const char      *interface_name,
+            const char      *signal_name,
+            GVariant        *parameters,
+            gpointer         user_data)
+{
+  const char *table;
+  const char *id;
+
+  g_variant_get_child (parameters, 0, "&s", &table);
+
+  if (g_strcmp0 (signal_name, "ChangedMany") == 0)
+    {
+      g_autoptr(GVariant) changes = g_variant_get_child_value (parameters, 1);
+      GVariantIter iter;
+
+      g_variant_iter_init (&iter, changes);
+      while (g_variant_iter_next (&iter, "(&sb@v@a{sas})", &id, NULL, NULL, NULL))
+        cache_invalidate (table, id);
+    }
+  else if (g_strcmp0 (signal_name, "Changed") == 0)
+    {
+      g_variant_get_child (parameters, 1, "&s", &id);
+      cache_invalidate (table, id);
+    }
+}
+
+void
+get_permission_cache_stats (guint64 *hits,
+                            guint64 *misses)
+{
+  G_LOCK (cache);
+  *hits = n_cache_hits;
+  *misses = n_cache_misses;
+  G_UNLOCK (cache);
+}
+
+static void
+name_owner_changed (GObject    *object,
+                    GParamSpec *pspec,
+                    gpointer    user_data)
+{
+  /* The snapshots of a previous permission store won't be updated anymore */
+  G_LOCK (snapshots);
+  g_hash_table_remove_all (snapshots);
+  g_hash_table_remove_all (snapshot_retry_times);
+  snapshots_unsupported = FALSE;
+  snapshots_store_generation++;
+  G_UNLOCK (snapshots);
+
+  /* We may have missed changes while there was no permission store */
+  cache_invalidate_all ();
+}
+
+static char **
+permissions_for_app (GVariant   *perms,
+                     const char *app_id,
+                     const char *table,
+                     const char *id)
+{
+  g_autofree char **permissions = NULL;
+
+  if (perms == NULL)
+    {
+      g_debug ("No '%s' permissions found: No entry for %s", table, id);
+      return NULL;
+    }
+
+  if (!g_variant_lookup (perms, app_id, "^a&s", &permissions))
+    {
+      g_debug ("No permissions stored for: %s %s, app %s", table, id, app_id);
+
+      return NULL;
+    }
+
+  return g_strdupv (permissions);
+}
+
 char **
 get_permissions_sync (const char *app_id,
                       const char *table,
@@ -34,29 +484,138 @@ get_permissions_sync (const char *app_id,
   g_autoptr(GError) error = NULL;
   g_autoptr(GVariant) out_perms = NULL;
   g_autoptr(GVariant) out_data = NULL;
-  g_autofree char **permissions = NULL;
+  guint generation;
 
-  if (!xdp_impl_permission_store_call_lookup_sync (permission_store,
-                                                   table,
-                                                   id,
-                                                   &out_perms,
-                                                   &out_data,
-                                                   NULL,
-                                                   &error))
+  if (!lookup_in_snapshot (table, id, TRUE, &out_perms) &&
+      !cache_lookup (table, id, &out_perms, &generation))
     {
+      if (!xdp_impl_permission_store_call_lookup_sync (permission_store,
+                                                       table,
+                                                       id,
+                                                       &out_perms,
+                                                       &out_data,
+                                                       NULL,
+                                                       &error))
+        {
+          g_autofree char *remote_error = g_dbus_error_get_remote_error (error);
+
+          /* Remember that there is no entry, other errors may be transient */
+          if (g_strcmp0 (remote_error, "org.freedesktop.portal.Error.NotFound") == 0)
+            cache_insert (table, id, NULL, generation);
+
+          g_dbus_error_strip_remote_error (error);
+          g_debug ("No '%s' permissions found: %s", table, error->message);
+          return NULL;
+        }
+
+      cache_insert (table, id, out_perms, generation);
+    }
+
+  return permissions_for_app (out_perms, app_id, table, id);
+}
+
+typedef struct {
+  char *app_id;
+  char *table;
+  char *id;
+  guint generation;
+} LookupData;
+
+static void
+lookup_data_free (LookupData *data)
+{
+  g_free (data->app_id);
+  g_free (data->table);
+  g_free (data->id);
+  g_free (data);
+}
+
+static void
+lookup_done (GObject      *source,
+             GAsyncResult *result,
+             gpointer      user_data)
+{
+  g_autoptr(GTask) task = G_TASK (user_data);
+  LookupData *data = g_task_get_task_data (task);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) out_perms = NULL;
+  g_autoptr(GVariant) out_data = NULL;
+
+  if (!xdp_impl_permission_store_call_lookup_finish (XDP_IMPL_PERMISSION_STORE (source),
+                                                     &out_perms,
+                                                     &out_data,
+                                                     result,
+                                                     &error))
+    {
+      g_autofree char *remote_error = g_dbus_error_get_remote_error (error);
+
+      if (g_strcmp0 (remote_error, "org.freedesktop.portal.Error.NotFound") == 0)
+        cache_insert (data->table, data->id, NULL, data->generation);
+
       g_dbus_error_strip_remote_error (error);
-      g_debug ("No '%s' permissions found: %s", table, error->message);
-      return NULL;
+      g_debug ("No '%s' permissions found: %s", data->table, error->message);
+      g_task_return_pointer (task, NULL, NULL);
+      return;
     }
 
-  if (!g_variant_lookup (out_perms, app_id, "^a&s", &permissions))
+  cache_insert (data->table, data->id, out_perms, data->generation);
+
+  g_task_return_pointer (task,
+                         permissions_for_app (out_perms, data->app_id, data->table, data->id),
+                         (GDestroyNotify) g_strfreev);
+}
+
+/* Like get_permissions_sync(), but doesn't block on the permission store.
+ * Snapshots are only used if we already have them. */
+void
+get_permissions (const char          *app_id,
+                 const char          *table,
+                 const char          *id,
+                 GCancellable        *cancellable,
+                 GAsyncReadyCallback  callback,
+                 gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GVariant) out_perms = NULL;
+  LookupData *data;
+  guint generation;
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, get_permissions);
+
+  if (!lookup_in_snapshot (table, id, FALSE, &out_perms) &&
+      !cache_lookup (table, id, &out_perms, &generation))
     {
-      g_debug ("No permissions stored for: %s %s, app %s", table, id, app_id);
+      data = g_new0 (LookupData, 1);
+      data->app_id = g_strdup (app_id);
+      data->table = g_strdup (table);
+      data->id = g_strdup (id);
+      data->generation = generation;
+      g_task_set_task_data (task, data, (GDestroyNotify) lookup_data_free);
 
-      return NULL;
+      xdp_impl_permission_store_call_lookup (permission_store,
+                                             table,
+                                             id,
+                                             cancellable,
+                                             lookup_done,
+                                             g_steal_pointer (&task));
+      return;
     }
 
-  return g_strdupv (permissions);
+  g_task_return_pointer (task,
+                         permissions_for_app (out_perms, app_id, table, id),
+                         (GDestroyNotify) g_strfreev);
+}
+
+/* Returns NULL if there are no permissions, like get_permissions_sync().
+ * Failing to reach the permission store is treated the same way. */
+char **
+get_permissions_finish (GAsyncResult  *result,
+                        GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
 }
 
 Permission
@@ -122,6 +681,9 @@ set_permissions_sync (const char *app_id,
 {
   g_autoptr(GError) error = NULL;
 
+  /* Don't wait for the Changed signal, we may be asked again before it arrives */
+  cache_invalidate (table, id);
+
   if (!xdp_impl_permission_store_call_set_permission_sync (permission_store,
                                                            table,
                                                            TRUE,
@@ -161,18 +723,162 @@ void set_permission_sync (const char *app_id,
   set_permissions_sync (app_id, table, id, (const char * const *)perms);
 }
 
+static void
+set_permission_done (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+  g_autoptr(GTask) task = G_TASK (user_data);
+  g_autoptr(GError) error = NULL;
+
+  if (!xdp_impl_permission_store_call_set_permission_finish (XDP_IMPL_PERMISSION_STORE (source),
+                                                             result,
+                                                             &error))
+    {
+      g_dbus_error_strip_remote_error (error);
+      g_warning ("Error updating permission store: %s", error->message);
+      g_task_return_error (task, g_steal_pointer (&error));
+      return;
+    }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+/* Like set_permissions_sync(). Failures are logged, so callers
+ * that don't care about the outcome can pass a NULL callback. */
+void
+set_permissions (const char          *app_id,
+                 const char          *table,
+                 const char          *id,
+                 const char * const  *permissions,
+                 GCancellable        *cancellable,
+                 GAsyncReadyCallback  callback,
+                 gpointer             user_data)
+{
+  GTask *task;
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, set_permissions);
+
+  cache_invalidate (table, id);
+
+  xdp_impl_permission_store_call_set_permission (permission_store,
+                                                 table,
+                                                 TRUE,
+                                                 id,
+                                                 app_id,
+                                                 permissions,
+                                                 cancellable,
+                                                 set_permission_done,
+                                                 task);
+}
+
+gboolean
+set_permissions_finish (GAsyncResult  *result,
+                        GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+get_permission_done (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+  g_autoptr(GTask) task = G_TASK (user_data);
+  g_auto(GStrv) perms = NULL;
+  g_autoptr(GError) error = NULL;
+
+  perms = get_permissions_finish (result, &error);
+  if (error)
+    g_task_return_error (task, g_steal_pointer (&error));
+  else if (perms)
+    g_task_return_int (task, permissions_to_tristate (perms));
+  else
+    g_task_return_int (task, PERMISSION_UNSET);
+}
+
+void
+get_permission (const char          *app_id,
+                const char          *table,
+                const char          *id,
+                GCancellable        *cancellable,
+                GAsyncReadyCallback  callback,
+                gpointer             user_data)
+{
+  GTask *task;
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, get_permission);
+
+  get_permissions (app_id, table, id, cancellable, get_permission_done, task);
+}
+
+Permission
+get_permission_finish (GAsyncResult  *result,
+                       GError       **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  Permission permission;
+
+  g_return_val_if_fail (g_task_is_valid (result, NULL), PERMISSION_UNSET);
+
+  permission = g_task_propagate_int (G_TASK (result), &local_error);
+  if (local_error)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return PERMISSION_UNSET;
+    }
+
+  return permission;
+}
+
+void
+set_permission (const char          *app_id,
+                const char          *table,
+                const char          *id,
+                Permission           permission,
+                GCancellable        *cancellable,
+                GAsyncReadyCallback  callback,
+                gpointer             user_data)
+{
+  g_auto(GStrv) perms = NULL;
+
+  perms = permissions_from_tristate (permission);
+  set_permissions (app_id, table, id, (const char * const *)perms,
+                   cancellable, callback, user_data);
+}
+
 void
 init_permission_store (GDBusConnection *connection)
 {
   g_autoptr(GError) error = NULL;
 
+  /* The cache below subscribes to the Changed signals it needs
+   * itself, there is no need for the proxy to track them too */
   permission_store = xdp_impl_permission_store_proxy_new_sync (connection,
-                                                               G_DBUS_PROXY_FLAGS_NONE,
+                                                               G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
                                                                "org.freedesktop.impl.portal.PermissionStore",
                                                                "/org/freedesktop/impl/portal/PermissionStore",
                                                                NULL, &error);
   if (permission_store == NULL)
-    g_warning ("No permission store: %s", error->message);
+    {
+      g_warning ("No permission store: %s", error->message);
+      return;
+    }
+
+  snapshots = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                     g_free, (GDestroyNotify) table_snapshot_free);
+  snapshot_retry_times = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, g_free);
+  g_signal_connect (permission_store, "notify::g-name-owner",
+                    G_CALLBACK (name_owner_changed), NULL);
+
+  cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                 g_free, (GDestroyNotify) cache_value_free);
+  cache_tables = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 }
 
 XdpImplPermissionStore *
@@ -49,9 +49,48 @@ void set_permission_sync (const char *app_id,
                           const char *id,
                           Permission permission);
 
+void get_permissions (const char          *app_id,
+                      const char          *table,
+                      const char          *id,
+                      GCancellable        *cancellable,
+                      GAsyncReadyCallback  callback,
+                      gpointer             user_data);
+char **get_permissions_finish (GAsyncResult  *result,
+                               GError       **error);
+
+void set_permissions (const char          *app_id,
+                      const char          *table,
+                      const char          *id,
+                      const char * const  *permissions,
+                      GCancellable        *cancellable,
+                      GAsyncReadyCallback  callback,
+                      gpointer             user_data);
+gboolean set_permissions_finish (GAsyncResult  *result,
+                                 GError       **error);
+
+void get_permission (const char          *app_id,
+                     const char          *table,
+                     const char          *id,
+                     GCancellable        *cancellable,
+                     GAsyncReadyCallback  callback,
+                     gpointer             user_data);
+Permission get_permission_finish (GAsyncResult  *result,
+                                  GError       **error);
+
+void set_permission (const char          *app_id,
+                     const char          *table,
+                     const char          *id,
+                     Permission           permission,
+                     GCancellable        *cancellable,
+                     GAsyncReadyCallback  callback,
+                     gpointer             user_data);
+
 char **permissions_from_tristate (Permission permission);
 
 Permission permissions_to_tristate (char **permissions);
 
+void get_permission_cache_stats (guint64 *hits,
+                                 guint64 *misses);
+
 void init_permission_store (GDBusConnection *connection);
 XdpImplPermissionStore *get_permission_store (void);
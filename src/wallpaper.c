@@ -116,11 +116,13 @@ static XdpOptionKey wallpaper_options[] = {
   { "set-on", G_VARIANT_TYPE_STRING, validate_set_on }
 };
 
+/* Resolving the fd and creating the impl request proxy block, so this
+ * runs in a thread */
 static void
-handle_set_wallpaper_in_thread_func (GTask *task,
-                                     gpointer source_object,
-                                     gpointer task_data,
-                                     GCancellable *cancellable)
+set_wallpaper_in_thread_func (GTask        *task,
+                              gpointer      source_object,
+                              gpointer      task_data,
+                              GCancellable *cancellable)
 {
   Request *request = (Request *)task_data;
   const char *parent_window;
@@ -130,9 +132,7 @@ handle_set_wallpaper_in_thread_func (GTask *task,
   GVariantBuilder opt_builder;
   g_autoptr(XdpImplRequest) impl_request = NULL;
   GVariant *options;
-  gboolean show_preview = FALSE;
   int fd;
-  Permission permission;
 
   REQUEST_AUTOLOCK (request);
 
@@ -141,22 +141,117 @@ handle_set_wallpaper_in_thread_func (GTask *task,
   fd = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (request), "fd"));
   options = ((GVariant *)g_object_get_data (G_OBJECT (request), "options"));
 
-  if (uri != NULL && fd != -1)
+  if (!uri)
     {
-      g_warning ("Rejecting invalid set-wallpaper request (both URI and fd are set)");
-      if (request->exported)
+      g_autofree char *path = NULL;
+
+      path = xdp_app_info_get_path_for_fd (request->app_info, fd, 0, NULL, NULL, &error);
+      if (path == NULL)
         {
-          g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
-          xdp_request_emit_response (XDP_REQUEST (request),
-                                     XDG_DESKTOP_PORTAL_RESPONSE_OTHER,
-                                     g_variant_builder_end (&opt_builder));
-          request_unexport (request);
+          g_debug ("Cannot get path for fd: %s", error->message);
+
+          /* Reject the request */
+          send_response (request, XDG_DESKTOP_PORTAL_RESPONSE_OTHER);
+          return;
         }
+
+      uri = g_filename_to_uri (path, NULL, NULL);
+      g_object_set_data_full (G_OBJECT (request), "uri", g_strdup (uri), g_free);
+      close (fd);
+      g_object_set_data (G_OBJECT (request), "fd", GINT_TO_POINTER (-1));
+    }
+
+  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
+                                                  G_DBUS_PROXY_FLAGS_NONE,
+                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
+                                                  request->id,
+                                                  NULL, &error);
+  request_set_impl_request (request, impl_request);
+
+  g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
+  xdp_filter_options (options, &opt_builder,
+                      wallpaper_options, G_N_ELEMENTS (wallpaper_options),
+                      NULL);
+
+  g_debug ("Calling SetWallpaperURI with %s", uri);
+  xdp_impl_wallpaper_call_set_wallpaper_uri (impl,
+                                             request->id,
+                                             app_id,
+                                             parent_window,
+                                             uri,
+                                             g_variant_builder_end (&opt_builder),
+                                             NULL,
+                                             handle_set_wallpaper_uri_done,
+                                             g_object_ref (request));
+}
+
+static void
+set_wallpaper (Request *request)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, g_object_ref (request), g_object_unref);
+  g_task_run_in_thread (task, set_wallpaper_in_thread_func);
+}
+
+static void
+access_dialog_done (GObject      *source,
+                    GAsyncResult *result,
+                    gpointer      data)
+{
+  g_autoptr(Request) request = data;
+  g_autoptr(GVariant) access_results = NULL;
+  g_autoptr(GError) error = NULL;
+  guint access_response = 2;
+  const char *app_id = xdp_app_info_get_id (request->app_info);
+  Permission permission;
+
+  REQUEST_AUTOLOCK (request);
+
+  permission = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (request), "permission"));
+
+  if (!xdp_impl_access_call_access_dialog_finish (XDP_IMPL_ACCESS (source),
+                                                  &access_response,
+                                                  &access_results,
+                                                  result,
+                                                  &error))
+    {
+      g_warning ("Failed to show access dialog: %s", error->message);
       return;
     }
 
+  if (permission == PERMISSION_UNSET)
+    set_permission (app_id, PERMISSION_TABLE, PERMISSION_ID, access_response == 0 ? PERMISSION_YES : PERMISSION_NO,
+                    NULL, NULL, NULL);
 
-  permission = get_permission_sync (app_id, PERMISSION_TABLE, PERMISSION_ID);
+  if (access_response != 0)
+    {
+      send_response (request, 2);
+      return;
+    }
+
+  set_wallpaper (request);
+}
+
+static void
+got_permission (GObject      *source,
+                GAsyncResult *result,
+                gpointer      data)
+{
+  g_autoptr(Request) request = data;
+  const char *parent_window;
+  const char *app_id = xdp_app_info_get_id (request->app_info);
+  GVariant *options;
+  gboolean show_preview = FALSE;
+  Permission permission;
+
+  REQUEST_AUTOLOCK (request);
+
+  parent_window = ((const char *)g_object_get_data (G_OBJECT (request), "parent-window"));
+  options = ((GVariant *)g_object_get_data (G_OBJECT (request), "options"));
+
+  permission = get_permission_finish (result, NULL);
 
   if (permission == PERMISSION_NO)
     {
@@ -167,8 +262,6 @@ handle_set_wallpaper_in_thread_func (GTask *task,
   g_variant_lookup (options, "show-preview", "b", &show_preview);
   if (!show_preview && permission != PERMISSION_YES)
     {
-      guint access_response = 2;
-      g_autoptr(GVariant) access_results = NULL;
       GVariantBuilder access_opt_builder;
       g_autofree gchar *title = NULL;
       g_autofree gchar *subtitle = NULL;
@@ -207,82 +300,45 @@ handle_set_wallpaper_in_thread_func (GTask *task,
 
       body = _("This permission can be changed at any time from the privacy settings.");
 
-      if (!xdp_impl_access_call_access_dialog_sync (access_impl,
-                                                    request->id,
-                                                    app_id,
-                                                    parent_window,
-                                                    title,
-                                                    subtitle,
-                                                    body,
-                                                    g_variant_builder_end (&access_opt_builder),
-                                                    &access_response,
-                                                    &access_results,
-                                                    NULL,
-                                                    &error))
-        {
-          g_warning ("Failed to show access dialog: %s", error->message);
-          return;
-        }
-
-      if (permission == PERMISSION_UNSET)
-        set_permission_sync (app_id, PERMISSION_TABLE, PERMISSION_ID, access_response == 0 ? PERMISSION_YES : PERMISSION_NO);
-
-      if (access_response != 0)
-        {
-          send_response (request, 2);
-          return;
-        }
+      g_object_set_data (G_OBJECT (request), "permission", GINT_TO_POINTER (permission));
+
+      xdp_impl_access_call_access_dialog (access_impl,
+                                          request->id,
+                                          app_id,
+                                          parent_window,
+                                          title,
+                                          subtitle,
+                                          body,
+                                          g_variant_builder_end (&access_opt_builder),
+                                          NULL,
+                                          access_dialog_done,
+                                          g_object_ref (request));
+      return;
     }
 
-  if (!uri)
-    {
-      g_autofree char *path = NULL;
-
-      path = xdp_app_info_get_path_for_fd (request->app_info, fd, 0, NULL, NULL, &error);
-      if (path == NULL)
-        {
-          g_debug ("Cannot get path for fd: %s", error->message);
+  set_wallpaper (request);
+}
 
-          /* Reject the request */
-          if (request->exported)
-            {
-              g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
-              xdp_request_emit_response (XDP_REQUEST (request),
-                                         XDG_DESKTOP_PORTAL_RESPONSE_OTHER,
-                                         g_variant_builder_end (&opt_builder));
-              request_unexport (request);
-            }
-          return;
-        }
+static void
+handle_set_wallpaper (Request *request)
+{
+  const char *uri;
+  int fd;
 
-      uri = g_filename_to_uri (path, NULL, NULL);
-      g_object_set_data_full (G_OBJECT (request), "uri", g_strdup (uri), g_free);
-      close (fd);
-      g_object_set_data (G_OBJECT (request), "fd", GINT_TO_POINTER (-1));
-    }
+  REQUEST_AUTOLOCK (request);
 
-  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                                  request->id,
-                                                  NULL, &error);
-  request_set_impl_request (request, impl_request);
+  uri = (const char *)g_object_get_data (G_OBJECT (request), "uri");
+  fd = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (request), "fd"));
 
-  g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
-  xdp_filter_options (options, &opt_builder,
-                      wallpaper_options, G_N_ELEMENTS (wallpaper_options),
-                      NULL);
+  if (uri != NULL && fd != -1)
+    {
+      g_warning ("Rejecting invalid set-wallpaper request (both URI and fd are set)");
+      send_response (request, XDG_DESKTOP_PORTAL_RESPONSE_OTHER);
+      return;
+    }
 
-  g_debug ("Calling SetWallpaperURI with %s", uri);
-  xdp_impl_wallpaper_call_set_wallpaper_uri (impl,
-                                             request->id,
-                                             app_id,
-                                             parent_window,
-                                             uri,
-                                             g_variant_builder_end (&opt_builder),
-                                             NULL,
-                                             handle_set_wallpaper_uri_done,
-                                             g_object_ref (request));
+  get_permission (xdp_app_info_get_id (request->app_info), PERMISSION_TABLE, PERMISSION_ID,
+                  NULL, got_permission, g_object_ref (request));
 }
 
 static gboolean
@@ -293,7 +349,6 @@ handle_set_wallpaper_uri (XdpWallpaper *object,
                           GVariant *arg_options)
 {
   Request *request = request_from_invocation (invocation);
-  g_autoptr(GTask) task = NULL;
 
   g_debug ("Handle SetWallpaperURI");
 
@@ -307,9 +362,7 @@ handle_set_wallpaper_uri (XdpWallpaper *object,
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
   xdp_wallpaper_complete_set_wallpaper_uri (object, invocation, request->id);
 
-  task = g_task_new (object, NULL, NULL, NULL);
-  g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, handle_set_wallpaper_in_thread_func);
+  handle_set_wallpaper (request);
 
   return G_DBUS_METHOD_INVOCATION_HANDLED;
 }
@@ -323,7 +376,6 @@ handle_set_wallpaper_file (XdpWallpaper *object,
                            GVariant *arg_options)
 {
   Request *request = request_from_invocation (invocation);
-  g_autoptr(GTask) task = NULL;
   int fd_id, fd;
   g_autoptr(GError) error = NULL;
 
@@ -347,9 +399,7 @@ handle_set_wallpaper_file (XdpWallpaper *object,
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
   xdp_wallpaper_complete_set_wallpaper_file (object, invocation, NULL, request->id);
 
-  task = g_task_new (object, NULL, NULL, NULL);
-  g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, handle_set_wallpaper_in_thread_func);
+  handle_set_wallpaper (request);
 
   return G_DBUS_METHOD_INVOCATION_HANDLED;
 }
@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+
+# Simple metadata benchmark for the document portal fuse filesystem.
+# This is not run as part of the test suite, use bench-document-fuse.sh.
+
+import os, sys, time, argparse, threading
+from gi.repository import Gio, GLib
+
+DOCUMENT_ADD_FLAGS_DIRECTORY = (1 << 3)
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--iterations", type=int, default=1000)
+parser.add_argument("--files", type=int, default=20)
+parser.add_argument("--app", default="org.test.Bench")
+parser.add_argument("--threads", type=int, default=1,
+                    help="Number of threads, each running all iterations")
+args = parser.parse_args(sys.argv[1:])
+
+TEST_DATA_DIR=os.environ['TEST_DATA_DIR']
+
+bus = Gio.bus_get_sync(Gio.BusType.SESSION, None)
+proxy = Gio.DBusProxy.new_sync(bus, Gio.DBusProxyFlags.NONE, None,
+                               "org.freedesktop.portal.Documents",
+                               "/org/freedesktop/portal/documents",
+                               "org.freedesktop.portal.Documents", None)
+
+res = proxy.call_sync("GetMountPoint", GLib.Variant('()', ()), 0, -1, None)
+mountpoint = bytearray(res[0][:-1]).decode("utf-8")
+
+dirpath = os.path.join(TEST_DATA_DIR, "bench-dir")
+os.makedirs(os.path.join(dirpath, "subdir"), exist_ok=True)
+names = []
+for i in range(args.files):
+    name = os.path.join("subdir", "file%d" % i)
+    with open(os.path.join(dirpath, name), "w") as f:
+        f.write("content %d" % i)
+    names.append(name)
+
+fdlist = Gio.UnixFDList.new()
+fd = os.open(dirpath, os.O_PATH)
+handle = fdlist.append(fd)
+os.close(fd)
+res = proxy.call_with_unix_fd_list_sync("AddFull",
+                                        GLib.Variant('(ahusas)',
+                                                     ([handle], DOCUMENT_ADD_FLAGS_DIRECTORY,
+                                                      args.app, ["read", "write"])),
+                                        0, -1, fdlist, None)
+doc_id = res[0][0][0]
+
+views = [
+    os.path.join(mountpoint, doc_id, "bench-dir"),
+    os.path.join(mountpoint, "by-app", args.app, doc_id, "bench-dir"),
+]
+
+def run(what, func):
+    def loop():
+        for i in range(args.iterations):
+            func()
+
+    threads = [threading.Thread(target=loop) for i in range(args.threads)]
+    start = time.monotonic()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.monotonic() - start
+
+    ops = func.ops_per_iteration * args.iterations * args.threads
+    print("%-8s %d threads x %d iterations: %.3f s (%.0f ops/s)" %
+          (what, args.threads, args.iterations, elapsed, ops / elapsed))
+
+def stat_all():
+    for view in views:
+        for name in names:
+            os.stat(os.path.join(view, name))
+
+stat_all.ops_per_iteration = len(views) * len(names)
+
+def walk_all():
+    for view in views:
+        for dirpath, dirnames, filenames in os.walk(view):
+            for name in filenames:
+                os.lstat(os.path.join(dirpath, name))
+
+walk_all.ops_per_iteration = len(views) * (len(names) + 2)
+
+run("stat", stat_all)
+run("walk", walk_all)
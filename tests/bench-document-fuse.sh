@@ -0,0 +1,87 @@
+#!/bin/bash
+
+# Compare the number of GETATTR/LOOKUP requests the document portal
+# receives for a metadata heavy workload, with and without kernel caching
+# (--cache-timeout), and how its throughput scales with the number of
+# concurrent clients (THREADS). Run from the build directory:
+#
+#   ../tests/bench-document-fuse.sh [ITERATIONS]
+
+set -e
+
+iterations=${1:-1000}
+cache_timeout=${CACHE_TIMEOUT:-1}
+
+test_srcdir=$(realpath "$(dirname $0)")
+test_builddir=$(pwd)
+
+export TEST_DATA_DIR=`mktemp -d /tmp/xdp-XXXXXX`
+mkdir -p "${TEST_DATA_DIR}/home"
+mkdir -p "${TEST_DATA_DIR}/runtime"
+
+export HOME=${TEST_DATA_DIR}/home
+export XDG_CACHE_HOME=${TEST_DATA_DIR}/home/cache
+export XDG_CONFIG_HOME=${TEST_DATA_DIR}/home/config
+export XDG_DATA_HOME=${TEST_DATA_DIR}/home/share
+export XDG_RUNTIME_DIR=${TEST_DATA_DIR}/runtime
+
+cleanup () {
+    fusermount3 -u "$XDG_RUNTIME_DIR/doc" 2> /dev/null || :
+    sleep 0.1
+    kill "$DBUS_SESSION_BUS_PID"
+    kill $(jobs -p) &> /dev/null || true
+    rm -rf "$TEST_DATA_DIR"
+}
+trap cleanup EXIT
+
+sed "s#@testdir@#${test_builddir}#" "${test_srcdir}/session.conf.in" > "${TEST_DATA_DIR}/session.conf"
+
+dbus-daemon --fork --config-file="${TEST_DATA_DIR}/session.conf" --print-address=3 --print-pid=4 \
+            3> "${TEST_DATA_DIR}/dbus-session-bus-address" 4> "${TEST_DATA_DIR}/dbus-session-bus-pid"
+export DBUS_SESSION_BUS_ADDRESS="$(cat ${TEST_DATA_DIR}/dbus-session-bus-address)"
+DBUS_SESSION_BUS_PID="$(cat ${TEST_DATA_DIR}/dbus-session-bus-pid)"
+
+start_portal () {
+    # Debug output is printed with printf, keep it line buffered so it survives the kill
+    stdbuf -oL ./xdg-document-portal -r "$@" > "${TEST_DATA_DIR}/portal.log" 2>&1 &
+    PORTAL_PID=$!
+}
+
+stop_portal () {
+    kill "$PORTAL_PID"
+    wait "$PORTAL_PID" || :
+    fusermount3 -u "$XDG_RUNTIME_DIR/doc" 2> /dev/null || :
+    rm -rf "$XDG_DATA_HOME/flatpak/db" "${TEST_DATA_DIR}/bench-dir"
+}
+
+# Number of requests that reach the portal, with and without caching
+count_requests () {
+    local log="${TEST_DATA_DIR}/portal.log"
+
+    echo "== xdg-document-portal $*"
+
+    start_portal -v "$@"
+    "${test_srcdir}/bench-document-fuse.py" --iterations "$iterations"
+    stop_portal
+
+    echo "GETATTR requests: $(grep -cE '^XDP: GETATTR [0-9a-f]+$' "$log" || :)"
+    echo "LOOKUP requests:  $(grep -cE '^XDP: LOOKUP [0-9a-f]+:[^ ]*$' "$log" || :)"
+}
+
+# Throughput of uncached lookups and getattrs with concurrent clients
+# (no -v here, as printing the debug output would serialize the
+# fuse threads)
+thread_scaling () {
+    local threads
+
+    for threads in ${THREADS:-1 2 4 8 16}; do
+        echo "== $threads threads"
+        start_portal
+        "${test_srcdir}/bench-document-fuse.py" --iterations "$iterations" --threads "$threads"
+        stop_portal
+    done
+}
+
+count_requests
+count_requests --cache-timeout="$cache_timeout"
+thread_scaling
@@ -0,0 +1,177 @@
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include "document-portal/app-file-access.h"
+
+#define APP_ID "org.test.FileAccess"
+
+static char *home;
+
+static void
+write_file (const char *path,
+            const char *contents)
+{
+  g_autofree char *dir = g_path_get_dirname (path);
+  g_autoptr(GError) error = NULL;
+
+  g_assert_cmpint (g_mkdir_with_parents (dir, 0700), ==, 0);
+  g_file_set_contents (path, contents, -1, &error);
+  g_assert_no_error (error);
+}
+
+static gboolean
+rm_rf_dir (GFile         *dir,
+           GError       **error)
+{
+  GFileEnumerator *enumerator = NULL;
+  g_autoptr(GFileInfo) child_info = NULL;
+  GError *temp_error = NULL;
+
+  enumerator = g_file_enumerate_children (dir, "standard::type,standard::name",
+                                          G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                          NULL, error);
+  if (!enumerator)
+    return FALSE;
+
+  while ((child_info = g_file_enumerator_next_file (enumerator, NULL, &temp_error)))
+    {
+      const char *name = g_file_info_get_name (child_info);
+      g_autoptr(GFile) child = g_file_get_child (dir, name);
+
+      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY)
+        {
+          if (!rm_rf_dir (child, error))
+            return FALSE;
+        }
+      else
+        {
+          if (!g_file_delete (child, NULL, error))
+            return FALSE;
+        }
+
+      g_clear_object (&child_info);
+    }
+
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, temp_error);
+      return FALSE;
+    }
+
+  if (!g_file_delete (dir, NULL, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+static AppFileAccess
+lookup (const char *relative_path)
+{
+  g_autofree char *path = g_build_filename (home, relative_path, NULL);
+
+  return app_file_access_lookup (APP_ID, path);
+}
+
+static void
+test_file_access (void)
+{
+  g_autofree char *metadata = NULL;
+  g_autofree char *override = NULL;
+  g_autofree char *rw_dir = NULL;
+  g_autofree char *other_data = NULL;
+  g_autofree char *own_data = NULL;
+
+  metadata = g_build_filename (home, ".local/share/flatpak/app", APP_ID, "current/active/metadata", NULL);
+  override = g_build_filename (home, ".local/share/flatpak/overrides", APP_ID, NULL);
+  rw_dir = g_build_filename (home, "rw-dir", NULL);
+  other_data = g_build_filename (home, ".var/app/org.test.Other", NULL);
+  own_data = g_build_filename (home, ".var/app", APP_ID, NULL);
+
+  g_assert_cmpint (g_mkdir_with_parents (rw_dir, 0700), ==, 0);
+  g_assert_cmpint (g_mkdir_with_parents (other_data, 0700), ==, 0);
+  g_assert_cmpint (g_mkdir_with_parents (own_data, 0700), ==, 0);
+
+  g_assert_cmpint (app_file_access_lookup ("org.test.NotInstalled", "/home/file"), ==, APP_FILE_ACCESS_UNKNOWN);
+  g_assert_cmpint (lookup ("file"), ==, APP_FILE_ACCESS_UNKNOWN);
+
+  write_file (metadata,
+              "[Application]\n"
+              "name=" APP_ID "\n"
+              "\n"
+              "[Context]\n"
+              "filesystems=home:ro;~/rw-dir;/usr/share;\n");
+
+  g_assert_cmpint (lookup ("file"), ==, APP_FILE_ACCESS_READ_ONLY);
+  g_assert_cmpint (lookup ("dir/file"), ==, APP_FILE_ACCESS_READ_ONLY);
+  g_assert_cmpint (lookup ("rw-dir"), ==, APP_FILE_ACCESS_READ_WRITE);
+  g_assert_cmpint (lookup ("rw-dir/file"), ==, APP_FILE_ACCESS_READ_WRITE);
+  g_assert_cmpint (lookup ("rw-dir-2"), ==, APP_FILE_ACCESS_READ_ONLY);
+  g_assert_cmpint (lookup (".var/app/org.test.Other/file"), ==, APP_FILE_ACCESS_NONE);
+  g_assert_cmpint (lookup (".var/app/" APP_ID "/file"), ==, APP_FILE_ACCESS_READ_WRITE);
+  g_assert_cmpint (app_file_access_lookup (APP_ID, "/usr/share/file"), ==, APP_FILE_ACCESS_NONE);
+  g_assert_cmpint (app_file_access_lookup (APP_ID, "/srv/file"), ==, APP_FILE_ACCESS_NONE);
+
+  /* Overrides are picked up without restarting */
+  write_file (override,
+              "[Context]\n"
+              "filesystems=!home;host;\n");
+
+  g_assert_cmpint (lookup ("file"), ==, APP_FILE_ACCESS_READ_WRITE);
+  g_assert_cmpint (lookup ("rw-dir/file"), ==, APP_FILE_ACCESS_READ_WRITE);
+  g_assert_cmpint (app_file_access_lookup (APP_ID, "/srv/file"), ==, APP_FILE_ACCESS_READ_WRITE);
+  g_assert_cmpint (app_file_access_lookup (APP_ID, "/usr/share/file"), ==, APP_FILE_ACCESS_NONE);
+  g_assert_cmpint (app_file_access_lookup (APP_ID, "/etc/passwd"), ==, APP_FILE_ACCESS_NONE);
+
+  write_file (override,
+              "[Context]\n"
+              "filesystems=!host:reset;~/rw-dir:ro;\n");
+
+  g_assert_cmpint (lookup ("file"), ==, APP_FILE_ACCESS_NONE);
+  g_assert_cmpint (lookup ("rw-dir/file"), ==, APP_FILE_ACCESS_READ_ONLY);
+
+  /* :reset is only valid on a negated entry */
+  write_file (override,
+              "[Context]\n"
+              "filesystems=host:reset;\n");
+
+  g_assert_cmpint (lookup ("file"), ==, APP_FILE_ACCESS_READ_ONLY);
+  g_assert_cmpint (lookup ("rw-dir/file"), ==, APP_FILE_ACCESS_READ_WRITE);
+  g_assert_cmpint (app_file_access_lookup (APP_ID, "/srv/file"), ==, APP_FILE_ACCESS_NONE);
+
+  g_remove (override);
+  g_assert_cmpint (lookup ("file"), ==, APP_FILE_ACCESS_READ_ONLY);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autofree char *tmpdir = NULL;
+  g_autoptr(GFile) tmpdir_file = NULL;
+  g_autoptr(GError) error = NULL;
+  int res;
+
+  tmpdir = g_dir_make_tmp ("xdp-test-XXXXXX", NULL);
+  g_assert_nonnull (tmpdir);
+
+  /* Must be set up before glib looks at the environment */
+  home = realpath (tmpdir, NULL);
+  g_setenv ("HOME", home, TRUE);
+  g_unsetenv ("XDG_DATA_HOME");
+  g_unsetenv ("XDG_CONFIG_HOME");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/app-file-access", test_file_access);
+
+  res = g_test_run ();
+
+  tmpdir_file = g_file_new_for_path (tmpdir);
+  rm_rf_dir (tmpdir_file, &error);
+  g_assert_no_error (error);
+
+  return res;
+}
@@ -844,6 +844,162 @@ global_teardown (void)
   g_assert_no_error (error);
 }
 
+#define N_TRANSFER_FILES 5
+
+static char *
+start_transfer_with_files (XdpDbusFileTransfer *transfer,
+                           gboolean             autostop,
+                           char               **paths)
+{
+  GError *error = NULL;
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  GVariantBuilder options;
+  GVariantBuilder handles;
+  char *key = NULL;
+  gboolean res;
+  int i;
+
+  g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&options, "{sv}", "autostop", g_variant_new_boolean (autostop));
+  res = xdp_dbus_file_transfer_call_start_transfer_sync (transfer,
+                                                         g_variant_builder_end (&options),
+                                                         &key, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (res);
+
+  fd_list = g_unix_fd_list_new ();
+  g_variant_builder_init (&handles, G_VARIANT_TYPE ("ah"));
+  for (i = 0; paths[i] != NULL; i++)
+    {
+      int fd = open (paths[i], O_PATH | O_CLOEXEC);
+      g_assert (fd >= 0);
+      g_variant_builder_add (&handles, "h", g_unix_fd_list_append (fd_list, fd, &error));
+      g_assert_no_error (error);
+      close (fd);
+    }
+
+  g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
+  res = xdp_dbus_file_transfer_call_add_files_sync (transfer, key,
+                                                    g_variant_builder_end (&handles),
+                                                    g_variant_builder_end (&options),
+                                                    fd_list, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (res);
+
+  return key;
+}
+
+static void
+test_transfer_chunks (void)
+{
+  GError *error = NULL;
+  g_autoptr(XdpDbusFileTransfer) transfer = NULL;
+  g_autoptr(GPtrArray) paths = NULL;
+  g_autoptr(GPtrArray) retrieved = NULL;
+  g_autofree char *key = NULL;
+  g_autofree char *key2 = NULL;
+  GVariantBuilder options;
+  guint32 cursor;
+  gboolean res;
+  int i;
+
+  if (!check_fuse_or_skip_test ())
+    return;
+
+  transfer = xdp_dbus_file_transfer_proxy_new_sync (session_bus, 0,
+                                                    "org.freedesktop.portal.Documents",
+                                                    "/org/freedesktop/portal/documents",
+                                                    NULL, &error);
+  g_assert_no_error (error);
+
+  paths = g_ptr_array_new_with_free_func (g_free);
+  for (i = 0; i < N_TRANSFER_FILES; i++)
+    {
+      g_autofree char *basename = g_strdup_printf ("transfer%d", i);
+      char *path = g_build_filename (outdir, basename, NULL);
+
+      g_file_set_contents (path, basename, -1, &error);
+      g_assert_no_error (error);
+      g_ptr_array_add (paths, path);
+    }
+  g_ptr_array_add (paths, NULL);
+
+  /* All files come back, over several calls, in order */
+  key = start_transfer_with_files (transfer, TRUE, (char **) paths->pdata);
+  retrieved = g_ptr_array_new_with_free_func (g_free);
+  cursor = 0;
+  do
+    {
+      g_auto(GStrv) files = NULL;
+      guint32 next_cursor;
+
+      g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
+      g_variant_builder_add (&options, "{sv}", "max-files", g_variant_new_uint32 (2));
+      res = xdp_dbus_file_transfer_call_retrieve_files_chunk_sync (transfer, key, cursor,
+                                                                   g_variant_builder_end (&options),
+                                                                   &files, &next_cursor,
+                                                                   NULL, &error);
+      g_assert_no_error (error);
+      g_assert (res);
+      g_assert_cmpuint (g_strv_length (files), ==, MIN (2, N_TRANSFER_FILES - cursor));
+
+      for (i = 0; files[i] != NULL; i++)
+        g_ptr_array_add (retrieved, g_strdup (files[i]));
+      cursor = next_cursor;
+    }
+  while (cursor != 0);
+
+  g_assert_cmpuint (retrieved->len, ==, N_TRANSFER_FILES);
+  for (i = 0; i < N_TRANSFER_FILES; i++)
+    g_assert_cmpstr (g_ptr_array_index (retrieved, i), ==, g_ptr_array_index (paths, i));
+
+  /* The autostop transfer ended with the last chunk */
+  g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
+  res = xdp_dbus_file_transfer_call_retrieve_files_chunk_sync (transfer, key, 0,
+                                                               g_variant_builder_end (&options),
+                                                               NULL, NULL, NULL, &error);
+  g_assert_error (error, G_DBUS_ERROR, G_DBUS_ERROR_ACCESS_DENIED);
+  g_assert (!res);
+  g_clear_error (&error);
+
+  /* A failure partway through fails that call, not the earlier ones */
+  key2 = start_transfer_with_files (transfer, FALSE, (char **) paths->pdata);
+  g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&options, "{sv}", "max-files", g_variant_new_uint32 (2));
+  {
+    g_auto(GStrv) files = NULL;
+
+    res = xdp_dbus_file_transfer_call_retrieve_files_chunk_sync (transfer, key2, 0,
+                                                                 g_variant_builder_end (&options),
+                                                                 &files, &cursor,
+                                                                 NULL, &error);
+    g_assert_no_error (error);
+    g_assert (res);
+    g_assert_cmpuint (g_strv_length (files), ==, 2);
+    g_assert_cmpuint (cursor, ==, 2);
+  }
+
+  g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
+  res = xdp_dbus_file_transfer_call_retrieve_files_chunk_sync (transfer, key2, N_TRANSFER_FILES + 1,
+                                                               g_variant_builder_end (&options),
+                                                               NULL, NULL, NULL, &error);
+  g_assert_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS);
+  g_assert (!res);
+  g_clear_error (&error);
+
+  res = xdp_dbus_file_transfer_call_stop_transfer_sync (transfer, key2, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (res);
+
+  g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
+  res = xdp_dbus_file_transfer_call_retrieve_files_chunk_sync (transfer, key2, cursor,
+                                                               g_variant_builder_end (&options),
+                                                               NULL, NULL, NULL, &error);
+  g_assert_error (error, G_DBUS_ERROR, G_DBUS_ERROR_ACCESS_DENIED);
+  g_assert (!res);
+  g_clear_error (&error);
+}
+
 static void
 test_version (void)
 {
@@ -865,6 +1021,7 @@ main (int argc, char **argv)
   g_test_add_func ("/db/recursive_doc", test_recursive_doc);
   g_test_add_func ("/db/create_docs", test_create_docs);
   g_test_add_func ("/db/add_named", test_add_named);
+  g_test_add_func ("/transfer/chunks", test_transfer_chunks);
 
   global_setup ();
 
@@ -16,6 +16,8 @@ parser = argparse.ArgumentParser()
 parser.add_argument('--verbose', '-v', action='count')
 parser.add_argument("--iterations", type=int, default=3)
 parser.add_argument("--prefix")
+parser.add_argument("--fd-budget", type=int, default=0,
+                    help="Only check fd eviction, against a portal running with this --fd-budget and --stats")
 args = parser.parse_args(sys.argv[1:])
 
 if args.prefix:
@@ -238,6 +240,14 @@ class DocPortal:
                                              "org.freedesktop.portal.Documents", "/org/freedesktop/portal/documents", "org.freedesktop.portal.Documents", None)
         self.mountpoint = self.get_mount_path()
 
+    def get_stats(self):
+        stats_proxy = Gio.DBusProxy.new_sync(self.bus, Gio.DBusProxyFlags.NONE, None,
+                                             "org.freedesktop.portal.Documents", "/org/freedesktop/portal/documents", "org.freedesktop.portal.Documents.Stats", None)
+        res = stats_proxy.call_sync ("GetStats",
+                                     GLib.Variant('()', ()),
+                                     0, -1, None)
+        return res[0]
+
     def get_mount_path(self):
         res = self.proxy.call_sync ("GetMountPoint",
                                     GLib.Variant('()', ()),
@@ -709,6 +719,17 @@ def check_directory_doc_perms(doc, app_id):
 
         os.unlink(docpath + "/moved")
 
+        # Copies and seeking for data are done on the backing file
+        copypath = docpath + "/copy"
+        fd3 = os.open(copypath, os.O_CREAT|os.O_RDWR, 0o600)
+        assertEqual(os.copy_file_range(fd2, fd3, len("replaced"), 0, 0), len("replaced"))
+        assertFdHasContent(fd3, "replaced")
+        assertFileHasContent(doc.real_path + "/copy", "replaced")
+        assertEqual(os.lseek(fd3, 0, os.SEEK_DATA), 0)
+        assertEqual(os.lseek(fd3, 0, os.SEEK_HOLE), len("replaced"))
+        os.close(fd3)
+        os.unlink(copypath)
+
         os.close(fd)
         os.close(fd2)
 
@@ -902,9 +923,75 @@ def add_an_app (num_docs):
         doc.apps.append(write_app)
     logv("granted acces to %s and %s for %s" % (read_app, write_app, ids))
 
+def check_fd_eviction (budget):
+    stats = portal.get_stats()
+    assertEqual(stats["fd-budget"], budget)
+
+    # Many more files than the budget, in nested dirs so that the
+    # evicted inodes have to be reopened relative to their parents
+    real_dir = TEST_DATA_DIR + "/evict-dir"
+    subdirs = ["sub%d" % (i) for i in range(3)]
+    files = ["file%d" % (i) for i in range(budget * 2)]
+    os.mkdir(real_dir)
+    for subdir in subdirs:
+        os.mkdir(real_dir + "/" + subdir)
+        for name in files:
+            setFileContent(real_dir + "/" + subdir + "/" + name, subdir + "/" + name)
+
+    doc = portal.add_dir(real_dir)
+    docdir = doc.get_doc_path(None)
+    logv("exported (dir) %s as %s" % (real_dir, doc))
+
+    walked = 0
+    for (dirpath, dirnames, filenames) in os.walk(docdir):
+        for name in filenames:
+            path = dirpath + "/" + name
+            assertFileExist(path)
+            assertFileHasContent(path, os.path.relpath(path, docdir))
+            walked = walked + 1
+    assertEqual(walked, len(subdirs) * len(files))
+
+    stats = portal.get_stats()
+    assert stats["evicted-fds"] > 0
+
+    # The first files we walked are evicted by now
+    for subdir in subdirs:
+        for name in files:
+            path = docdir + "/" + subdir + "/" + name
+            info = os.lstat(path)
+            real_info = os.lstat(real_dir + "/" + subdir + "/" + name)
+            assertSameStat(info, real_info, ~(stat.S_ISUID|stat.S_ISGID|stat.S_ISVTX))
+            fd = os.open(path, os.O_RDWR)
+            assertFdHasContent(fd, subdir + "/" + name)
+            appendFdContent(fd, "-changed")
+            os.close(fd)
+            assertFileHasContent(real_dir + "/" + subdir + "/" + name, subdir + "/" + name + "-changed")
+
+    for subdir in subdirs:
+        for name in files:
+            os.rename(docdir + "/" + subdir + "/" + name, docdir + "/" + subdir + "/" + name + ".renamed")
+            assertFileNotExist(real_dir + "/" + subdir + "/" + name)
+            assertFileHasContent(real_dir + "/" + subdir + "/" + name + ".renamed", subdir + "/" + name + "-changed")
+
+    # Evicted children must be reopened from the new location of their parent
+    os.rename(docdir + "/" + subdirs[0], docdir + "/" + subdirs[0] + ".renamed")
+    for name in files:
+        path = docdir + "/" + subdirs[0] + ".renamed/" + name + ".renamed"
+        assertFileHasContent(path, subdirs[0] + "/" + name + "-changed")
+
+    stats = portal.get_stats()
+    assert stats["reopened-fds"] > 0
+    logv("fd stats: %d open, %d evicted, %d reopened" % (stats["open-fds"], stats["evicted-fds"], stats["reopened-fds"]))
+
 log("Connecting to portal")
 portal = DocPortal()
 
+if args.fd_budget > 0:
+    log("Running fd eviction tests...")
+    check_fd_eviction (args.fd_budget)
+    log("fd eviction tests ok")
+    sys.exit(0)
+
 log("Running fuse tests...")
 create_app_by_lookup ()
 verify_fs_layout()
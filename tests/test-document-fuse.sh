@@ -18,7 +18,7 @@ skip_without_fuse () {
 
 skip_without_fuse
 
-echo "1..2"
+echo "1..3"
 
 set -e
 
@@ -72,6 +72,7 @@ fi
 # we rely on D-Bus activation.
 if [ -n "${XDP_UNINSTALLED:-}" ]; then
     ./xdg-document-portal -r &
+    PORTAL_PID="$!"
 fi
 
 # First run a basic single-thread test
@@ -93,3 +94,25 @@ for PID in "${PIDS[@]}"; do
     wait "${PID}"
 done
 echo "ok load-test"
+
+# Finally restart the portal with a tiny fd budget, so that walking a
+# directory document evicts the fds of the files we looked up. This needs
+# to pass options to the portal, so it only works when running uninstalled.
+if [ -n "${XDP_UNINSTALLED:-}" ]; then
+    echo Testing fd eviction
+    kill "$PORTAL_PID"
+    wait "$PORTAL_PID" || :
+    fusermount3 -u "$XDG_RUNTIME_DIR/doc" || :
+    ./xdg-document-portal -r --fd-budget=8 --stats &
+    # Wait for our instance, only it implements the stats interface
+    for i in $(seq 50); do
+        gdbus call --session --dest org.freedesktop.portal.Documents \
+              --object-path /org/freedesktop/portal/documents \
+              --method org.freedesktop.portal.Documents.Stats.GetStats &> /dev/null && break
+        sleep 0.1
+    done
+    "${test_srcdir}/test-document-fuse.py" --fd-budget 8 -v
+    echo "ok fd-eviction"
+else
+    echo "ok fd-eviction # SKIP needs an uninstalled portal"
+fi
@@ -2,6 +2,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <locale.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,7 +26,7 @@ XdgPermissionStore *permissions;
 static void
 test_version (void)
 {
-  g_assert_cmpint (xdg_permission_store_get_version (permissions), ==, 2);
+  g_assert_cmpint (xdg_permission_store_get_version (permissions), ==, 6);
 }
 
 static int change_count;
@@ -135,6 +136,80 @@ test_change (void)
   g_signal_handler_disconnect (permissions, changed_handler);
 }
 
+static void
+filtered_changed_cb (GDBusConnection *connection,
+                     const char *sender_name,
+                     const char *object_path,
+                     const char *interface_name,
+                     const char *signal_name,
+                     GVariant *parameters,
+                     gpointer user_data)
+{
+  const char *table;
+
+  g_variant_get_child (parameters, 0, "&s", &table);
+  g_assert_cmpstr (table, ==, "TEST2");
+
+  change_count++;
+}
+
+static void
+test_change_filtered (void)
+{
+  gboolean res;
+  g_autoptr(GError) error = NULL;
+  const char * perms[] = { "one", NULL };
+  gboolean timeout_reached = FALSE;
+  guint timeout_id;
+  guint subscription;
+
+  /* Only changes to TEST2 should be delivered */
+  subscription = g_dbus_connection_signal_subscribe (session_bus,
+                                                     NULL,
+                                                     "org.freedesktop.impl.portal.PermissionStore",
+                                                     "Changed",
+                                                     "/org/freedesktop/impl/portal/PermissionStore",
+                                                     "TEST2",
+                                                     G_DBUS_SIGNAL_FLAGS_NONE,
+                                                     filtered_changed_cb,
+                                                     NULL, NULL);
+  change_count = 0;
+
+  res = xdg_permission_store_call_set_permission_sync (permissions,
+                                                       "TEST", TRUE,
+                                                       "filtered-resource",
+                                                       "one.two.three",
+                                                       perms,
+                                                       NULL,
+                                                       &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  res = xdg_permission_store_call_set_permission_sync (permissions,
+                                                       "TEST2", TRUE,
+                                                       "filtered-resource",
+                                                       "one.two.three",
+                                                       perms,
+                                                       NULL,
+                                                       &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  timeout_id = g_timeout_add (10000, timeout_cb, &timeout_reached);
+  while (!timeout_reached && change_count == 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_source_remove (timeout_id);
+
+  g_assert_cmpint (change_count, ==, 1);
+
+  g_dbus_connection_signal_unsubscribe (session_bus, subscription);
+
+  res = xdg_permission_store_call_delete_sync (permissions, "TEST", "filtered-resource", NULL, &error);
+  g_assert_no_error (error);
+  res = xdg_permission_store_call_delete_sync (permissions, "TEST2", "filtered-resource", NULL, &error);
+  g_assert_no_error (error);
+}
+
 static void
 test_lookup (void)
 {
@@ -552,6 +627,334 @@ test_get_permission3 (void)
   g_assert (g_strv_length (out_perms) == 0);
 }
 
+static int changed_many_count;
+
+static void
+count_changed_cb (XdgPermissionStore *store,
+                  const char *table,
+                  const char *id,
+                  gboolean deleted,
+                  GVariant *data,
+                  GVariant *perms,
+                  gpointer user_data)
+{
+  change_count++;
+}
+
+static void
+changed_many_cb (XdgPermissionStore *store,
+                 const char *table,
+                 GVariant *changes,
+                 gpointer user_data)
+{
+  changed_many_count++;
+
+  g_assert_cmpstr (table, ==, "TEST");
+  g_assert_true (g_variant_is_of_type (changes, G_VARIANT_TYPE ("a(sbva{sas})")));
+  g_assert_cmpint (g_variant_n_children (changes), ==, 2);
+}
+
+static void
+test_many (void)
+{
+  gboolean res;
+  g_autoptr(GError) error = NULL;
+  const char * perms1[] = { "one", NULL };
+  const char * perms2[] = { "one", "two", NULL };
+  const char * ids[] = { "many-resource1", "many-resource2", "many-missing", NULL };
+  const char * ids2[] = { "many-resource1", "many-missing", NULL };
+  g_autoptr(GVariant) entries = NULL;
+  g_autoptr(GVariant) p = NULL;
+  g_autoptr(GVariant) d = NULL;
+  g_autofree char **strv = NULL;
+  GVariantBuilder builder;
+  gboolean timeout_reached = FALSE;
+  gulong changed_handler;
+  gulong single_changed_handler;
+  guint timeout_id;
+
+  changed_handler = g_signal_connect (permissions, "changed-many", G_CALLBACK (changed_many_cb), NULL);
+  changed_many_count = 0;
+
+  /* Batches are only announced with ChangedMany */
+  single_changed_handler = g_signal_connect (permissions, "changed", G_CALLBACK (count_changed_cb), NULL);
+  change_count = 0;
+
+  /* Nothing is created if one of the ids doesn't exist */
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssas)"));
+  g_variant_builder_add (&builder, "(ss^as)", "many-resource1", "one.two.three", perms1);
+  res = xdg_permission_store_call_set_many_sync (permissions,
+                                                 "TEST", FALSE,
+                                                 g_variant_builder_end (&builder),
+                                                 NULL,
+                                                 &error);
+  g_assert_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND);
+  g_assert_false (res);
+  g_clear_error (&error);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssas)"));
+  g_variant_builder_add (&builder, "(ss^as)", "many-resource1", "one.two.three", perms1);
+  g_variant_builder_add (&builder, "(ss^as)", "many-resource1", "one.two.four", perms2);
+  g_variant_builder_add (&builder, "(ss^as)", "many-resource2", "one.two.three", perms2);
+  res = xdg_permission_store_call_set_many_sync (permissions,
+                                                 "TEST", TRUE,
+                                                 g_variant_builder_end (&builder),
+                                                 NULL,
+                                                 &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  timeout_id = g_timeout_add (10000, timeout_cb, &timeout_reached);
+  while (!timeout_reached && changed_many_count == 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_source_remove (timeout_id);
+
+  g_assert_cmpint (changed_many_count, ==, 1);
+
+  res = xdg_permission_store_call_lookup_many_sync (permissions,
+                                                    "TEST",
+                                                    ids,
+                                                    &entries,
+                                                    NULL,
+                                                    &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpint (g_variant_n_children (entries), ==, 2);
+
+  res = g_variant_lookup (entries, "many-resource1", "(@a{sas}v)", &p, &d);
+  g_assert_true (res);
+  g_assert_cmpint (g_variant_n_children (p), ==, 2);
+  res = g_variant_lookup (p, "one.two.four", "^a&s", &strv);
+  g_assert_true (res);
+  g_assert_cmpint (g_strv_length (strv), ==, 2);
+
+  /* Nothing is deleted if one of the ids doesn't exist */
+  res = xdg_permission_store_call_delete_many_sync (permissions,
+                                                    "TEST",
+                                                    ids2,
+                                                    NULL,
+                                                    &error);
+  g_assert_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND);
+  g_assert_false (res);
+  g_clear_error (&error);
+
+  changed_many_count = 0;
+
+  ids[2] = NULL;
+  res = xdg_permission_store_call_delete_many_sync (permissions,
+                                                    "TEST",
+                                                    ids,
+                                                    NULL,
+                                                    &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  timeout_reached = FALSE;
+  timeout_id = g_timeout_add (10000, timeout_cb, &timeout_reached);
+  while (!timeout_reached && changed_many_count == 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_source_remove (timeout_id);
+
+  g_assert_cmpint (changed_many_count, ==, 1);
+
+  g_clear_pointer (&entries, g_variant_unref);
+  res = xdg_permission_store_call_lookup_many_sync (permissions,
+                                                    "TEST",
+                                                    ids,
+                                                    &entries,
+                                                    NULL,
+                                                    &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpint (g_variant_n_children (entries), ==, 0);
+
+  /* Any Changed signal would have arrived before ChangedMany */
+  g_assert_cmpint (change_count, ==, 0);
+
+  g_signal_handler_disconnect (permissions, single_changed_handler);
+  g_signal_handler_disconnect (permissions, changed_handler);
+}
+
+static void
+test_write_stats (void)
+{
+  gboolean res;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) stats = NULL;
+  const char * perms[] = { "one", NULL };
+  guint64 writeouts, writes;
+  guint32 largest_batch;
+
+  res = xdg_permission_store_call_set_permission_sync (permissions,
+                                                       "TEST", TRUE,
+                                                       "stats-resource",
+                                                       "one.two.three",
+                                                       perms,
+                                                       NULL,
+                                                       &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  /* The reply to the change is only sent once it was written out */
+  res = xdg_permission_store_call_get_write_stats_sync (permissions, &stats, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  g_assert_true (g_variant_lookup (stats, "writeouts", "t", &writeouts));
+  g_assert_true (g_variant_lookup (stats, "writes", "t", &writes));
+  g_assert_true (g_variant_lookup (stats, "largest-batch", "u", &largest_batch));
+  g_assert_cmpuint (writeouts, >=, 1);
+  g_assert_cmpuint (writes, >=, writeouts);
+  g_assert_cmpuint (largest_batch, >=, 1);
+}
+
+static void
+test_set_entries (void)
+{
+  gboolean res;
+  g_autoptr(GError) error = NULL;
+  const char * perms1[] = { "one", NULL };
+  const char * perms2[] = { "one", "two", NULL };
+  const char * ids[] = { "entries-resource1", "entries-resource2", NULL };
+  g_autoptr(GVariant) entries = NULL;
+  g_autoptr(GVariant) p = NULL;
+  g_autoptr(GVariant) d = NULL;
+  g_autofree char **strv = NULL;
+  GVariantBuilder builder;
+  GVariantBuilder perms_builder;
+  gboolean timeout_reached = FALSE;
+  gulong changed_handler;
+  guint timeout_id;
+
+  changed_handler = g_signal_connect (permissions, "changed-many", G_CALLBACK (changed_many_cb), NULL);
+  changed_many_count = 0;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(a{sas}v)}"));
+
+  g_variant_builder_init (&perms_builder, G_VARIANT_TYPE ("a{sas}"));
+  g_variant_builder_add (&perms_builder, "{s^as}", "one.two.three", perms1);
+  g_variant_builder_add (&perms_builder, "{s^as}", "one.two.four", perms2);
+  g_variant_builder_add (&builder, "{s(@a{sas}v)}", "entries-resource1",
+                         g_variant_builder_end (&perms_builder),
+                         g_variant_new_string ("data1"));
+
+  g_variant_builder_init (&perms_builder, G_VARIANT_TYPE ("a{sas}"));
+  g_variant_builder_add (&builder, "{s(@a{sas}v)}", "entries-resource2",
+                         g_variant_builder_end (&perms_builder),
+                         g_variant_new_string ("data2"));
+
+  res = xdg_permission_store_call_set_entries_sync (permissions,
+                                                    "TEST",
+                                                    g_variant_builder_end (&builder),
+                                                    NULL,
+                                                    &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  timeout_id = g_timeout_add (10000, timeout_cb, &timeout_reached);
+  while (!timeout_reached && changed_many_count == 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_source_remove (timeout_id);
+
+  g_assert_cmpint (changed_many_count, ==, 1);
+
+  res = xdg_permission_store_call_lookup_many_sync (permissions,
+                                                    "TEST",
+                                                    ids,
+                                                    &entries,
+                                                    NULL,
+                                                    &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpint (g_variant_n_children (entries), ==, 2);
+
+  res = g_variant_lookup (entries, "entries-resource1", "(@a{sas}v)", &p, &d);
+  g_assert_true (res);
+  g_assert_cmpstr (g_variant_get_string (d, NULL), ==, "data1");
+  g_assert_cmpint (g_variant_n_children (p), ==, 2);
+  res = g_variant_lookup (p, "one.two.four", "^a&s", &strv);
+  g_assert_true (res);
+  g_assert_cmpint (g_strv_length (strv), ==, 2);
+
+  g_clear_pointer (&p, g_variant_unref);
+  g_clear_pointer (&d, g_variant_unref);
+  res = g_variant_lookup (entries, "entries-resource2", "(@a{sas}v)", &p, &d);
+  g_assert_true (res);
+  g_assert_cmpstr (g_variant_get_string (d, NULL), ==, "data2");
+  g_assert_cmpint (g_variant_n_children (p), ==, 0);
+
+  g_signal_handler_disconnect (permissions, changed_handler);
+}
+
+static void
+test_snapshot (void)
+{
+  gboolean res;
+  g_autoptr(GError) error = NULL;
+  const char * perms[] = { "one", NULL };
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) snapshot_handle = NULL;
+  g_autoptr(GVariant) counter_handle = NULL;
+  guint generation;
+  int snapshot_fd, counter_fd;
+  int seals;
+  gint *counter;
+  struct stat st_buf;
+
+  res = xdg_permission_store_call_set_permission_sync (permissions,
+                                                       "TEST", TRUE,
+                                                       "snapshot-resource",
+                                                       "one.two.three",
+                                                       perms,
+                                                       NULL,
+                                                       &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  res = xdg_permission_store_call_get_snapshot_sync (permissions,
+                                                     "TEST",
+                                                     NULL,
+                                                     &snapshot_handle,
+                                                     &counter_handle,
+                                                     &generation,
+                                                     &fd_list,
+                                                     NULL,
+                                                     &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  snapshot_fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (snapshot_handle), &error);
+  g_assert_no_error (error);
+  counter_fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (counter_handle), &error);
+  g_assert_no_error (error);
+
+  /* The snapshot can't be changed */
+  seals = fcntl (snapshot_fd, F_GET_SEALS);
+  g_assert_cmpint (seals & F_SEAL_WRITE, !=, 0);
+  g_assert_cmpint (seals & F_SEAL_SHRINK, !=, 0);
+  g_assert_cmpint (fstat (snapshot_fd, &st_buf), ==, 0);
+  g_assert_cmpint (st_buf.st_size, >, 0);
+
+  counter = mmap (NULL, sizeof (gint), PROT_READ, MAP_SHARED, counter_fd, 0);
+  g_assert_true (counter != MAP_FAILED);
+  g_assert_cmpuint ((guint) g_atomic_int_get (counter), ==, generation);
+
+  /* Changes are visible in the counter before the call returns */
+  res = xdg_permission_store_call_delete_sync (permissions,
+                                               "TEST",
+                                               "snapshot-resource",
+                                               NULL,
+                                               &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  g_assert_cmpuint ((guint) g_atomic_int_get (counter), !=, generation);
+
+  munmap (counter, sizeof (gint));
+  close (snapshot_fd);
+  close (counter_fd);
+}
+
 static void
 global_setup (void)
 {
@@ -667,6 +1070,7 @@ main (int argc, char **argv)
 
   g_test_add_func ("/permissions/version", test_version);
   g_test_add_func ("/permissions/change", test_change);
+  g_test_add_func ("/permissions/change-filtered", test_change_filtered);
   g_test_add_func ("/permissions/lookup", test_lookup);
   g_test_add_func ("/permissions/delete1", test_delete1);
   g_test_add_func ("/permissions/delete2", test_delete2);
@@ -679,6 +1083,10 @@ main (int argc, char **argv)
   g_test_add_func ("/permissions/get-pemission1", test_get_permission1);
   g_test_add_func ("/permissions/get-pemission2", test_get_permission2);
   g_test_add_func ("/permissions/get-pemission3", test_get_permission3);
+  g_test_add_func ("/permissions/many", test_many);
+  g_test_add_func ("/permissions/set-entries", test_set_entries);
+  g_test_add_func ("/permissions/write-stats", test_write_stats);
+  g_test_add_func ("/permissions/snapshot", test_snapshot);
 
   global_setup ();
 
@@ -223,6 +223,311 @@ test_serialize (void)
   unlink (tmpfile);
 }
 
+static void
+test_journal (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  g_autoptr(PermissionDb) db2 = NULL;
+  g_autoptr(PermissionDb) db3 = NULL;
+  g_autoptr(PermissionDb) db4 = NULL;
+  g_autoptr(PermissionDb) ro_db = NULL;
+  g_autoptr(PermissionDbEntry) entry = NULL;
+  g_autofree char *dump1 = NULL;
+  g_autofree char *dump2 = NULL;
+  g_autofree char *dump3 = NULL;
+  g_autofree char *dump4 = NULL;
+  g_autofree char *ro_dump = NULL;
+  g_autofree char *journal = NULL;
+  g_autofree char *ro_contents = NULL;
+  GError *error = NULL;
+  char tmpfile[] = "/tmp/testdbXXXXXX";
+  const char torn[] = { 0x40, 0, 0, 0, 0, 0, 0, 0, 'x' };
+  g_autofree char *contents = NULL;
+  g_autoptr(GByteArray) torn_journal = NULL;
+  gsize len;
+  gsize ro_len;
+  int fd;
+
+  fd = g_mkstemp (tmpfile);
+  close (fd);
+  unlink (tmpfile);
+  journal = g_strconcat (tmpfile, ".journal", NULL);
+
+  db = create_test_db (FALSE);
+  permission_db_set_path (db, tmpfile);
+  dump1 = permission_db_print (db);
+
+  /* Changes only go to the journal */
+  permission_db_append_journal (db, &error);
+  g_assert_no_error (error);
+  g_assert (g_file_test (journal, G_FILE_TEST_EXISTS));
+  g_assert (!g_file_test (tmpfile, G_FILE_TEST_EXISTS));
+
+  /* A partially written record is ignored */
+  g_file_get_contents (journal, &contents, &len, &error);
+  g_assert_no_error (error);
+  torn_journal = g_byte_array_new ();
+  g_byte_array_append (torn_journal, (guint8 *) contents, len);
+  g_byte_array_append (torn_journal, (guint8 *) torn, sizeof (torn));
+  g_file_set_contents (journal, (char *) torn_journal->data, torn_journal->len, &error);
+  g_assert_no_error (error);
+
+  /* Read-only loads leave the (maybe still being written) tail alone */
+  ro_db = permission_db_new_read_only (tmpfile, FALSE, &error);
+  g_assert_no_error (error);
+  ro_dump = permission_db_print (ro_db);
+  g_assert_cmpstr (dump1, ==, ro_dump);
+  g_file_get_contents (journal, &ro_contents, &ro_len, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (ro_len, ==, torn_journal->len);
+  g_clear_object (&ro_db);
+
+  db2 = permission_db_new (tmpfile, FALSE, &error);
+  g_assert_no_error (error);
+  dump2 = permission_db_print (db2);
+  g_assert_cmpstr (dump1, ==, dump2);
+
+  /* Removals are journaled too, and appended after the torn record was dropped */
+  permission_db_set_entry (db2, "bar", NULL);
+  permission_db_append_journal (db2, &error);
+  g_assert_no_error (error);
+
+  db3 = permission_db_new (tmpfile, FALSE, &error);
+  g_assert_no_error (error);
+  entry = permission_db_lookup (db3, "bar");
+  g_assert (entry == NULL);
+  g_clear_pointer (&entry, permission_db_entry_unref);
+  entry = permission_db_lookup (db3, "foo");
+  g_assert (entry != NULL);
+  dump3 = permission_db_print (db3);
+
+  /* Writing out the whole db removes the journal */
+  permission_db_update (db3);
+  permission_db_save_content (db3, &error);
+  g_assert_no_error (error);
+  g_assert (!g_file_test (journal, G_FILE_TEST_EXISTS));
+
+  /* A journal that was just created by the owner is not removed by readers */
+  g_file_set_contents (journal, "", 0, &error);
+  g_assert_no_error (error);
+  ro_db = permission_db_new_read_only (tmpfile, TRUE, &error);
+  g_assert_no_error (error);
+  g_assert (g_file_test (journal, G_FILE_TEST_EXISTS));
+  unlink (journal);
+
+  db4 = permission_db_new (tmpfile, TRUE, &error);
+  g_assert_no_error (error);
+  dump4 = permission_db_print (db4);
+  g_assert_cmpstr (dump3, ==, dump4);
+
+  unlink (tmpfile);
+}
+
+static void
+test_journal_invalid_record (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  g_autoptr(PermissionDb) db2 = NULL;
+  g_autoptr(PermissionDb) db3 = NULL;
+  g_autoptr(PermissionDbEntry) entry = NULL;
+  g_autoptr(GByteArray) bad_journal = NULL;
+  g_autofree char *journal = NULL;
+  g_autofree char *contents1 = NULL;
+  g_autofree char *contents2 = NULL;
+  g_autofree char *contents3 = NULL;
+  GError *error = NULL;
+  char tmpfile[] = "/tmp/testdbXXXXXX";
+  const char bad[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+  gsize len1, len2, len3;
+  int fd;
+
+  fd = g_mkstemp (tmpfile);
+  close (fd);
+  unlink (tmpfile);
+  journal = g_strconcat (tmpfile, ".journal", NULL);
+
+  db = create_test_db (FALSE);
+  permission_db_set_path (db, tmpfile);
+  permission_db_append_journal (db, &error);
+  g_assert_no_error (error);
+  g_file_get_contents (journal, &contents1, &len1, &error);
+  g_assert_no_error (error);
+
+  db2 = permission_db_new (tmpfile, FALSE, &error);
+  g_assert_no_error (error);
+  permission_db_set_entry (db2, "bar", NULL);
+  permission_db_append_journal (db2, &error);
+  g_assert_no_error (error);
+  g_file_get_contents (journal, &contents2, &len2, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (len2, >, len1);
+
+  /* Put an invalid record in front of the removal of bar */
+  bad_journal = g_byte_array_new ();
+  g_byte_array_append (bad_journal, (guint8 *) contents1, len1);
+  g_byte_array_append (bad_journal, (guint8 *) bad, sizeof (bad));
+  g_byte_array_append (bad_journal, (guint8 *) contents2 + len1, len2 - len1);
+  g_file_set_contents (journal, (char *) bad_journal->data, bad_journal->len, &error);
+  g_assert_no_error (error);
+
+  /* Replay stops at the invalid record, rather than guessing where the
+     next one starts, and cuts the journal there */
+  db3 = permission_db_new (tmpfile, FALSE, &error);
+  g_assert_no_error (error);
+  entry = permission_db_lookup (db3, "bar");
+  g_assert (entry != NULL);
+
+  g_file_get_contents (journal, &contents3, &len3, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (len3, ==, len1);
+
+  unlink (journal);
+}
+
+static void
+append_journal_cb (GObject      *source_object,
+                   GAsyncResult *res,
+                   gpointer      user_data)
+{
+  GAsyncResult **res_out = user_data;
+
+  *res_out = g_object_ref (res);
+  g_main_context_wakeup (NULL);
+}
+
+static void
+test_journal_async (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  g_autoptr(PermissionDb) db2 = NULL;
+  g_autoptr(GAsyncResult) res = NULL;
+  g_autofree char *dump1 = NULL;
+  g_autofree char *dump2 = NULL;
+  g_autofree char *journal = NULL;
+  GError *error = NULL;
+  char tmpfile[] = "/tmp/testdbXXXXXX";
+  gboolean ok;
+  int fd;
+
+  fd = g_mkstemp (tmpfile);
+  close (fd);
+  unlink (tmpfile);
+  journal = g_strconcat (tmpfile, ".journal", NULL);
+
+  db = create_test_db (FALSE);
+  permission_db_set_path (db, tmpfile);
+
+  permission_db_append_journal_async (db, NULL, append_journal_cb, &res);
+
+  /* Changes made during the append go into the next one */
+  permission_db_set_entry (db, "bar", NULL);
+  dump1 = permission_db_print (db);
+
+  while (res == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  ok = permission_db_append_journal_finish (db, res, &error);
+  g_assert_no_error (error);
+  g_assert (ok);
+  g_assert (g_file_test (journal, G_FILE_TEST_EXISTS));
+  g_clear_object (&res);
+
+  permission_db_append_journal_async (db, NULL, append_journal_cb, &res);
+  while (res == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  ok = permission_db_append_journal_finish (db, res, &error);
+  g_assert_no_error (error);
+  g_assert (ok);
+
+  db2 = permission_db_new (tmpfile, FALSE, &error);
+  g_assert_no_error (error);
+  dump2 = permission_db_print (db2);
+  g_assert_cmpstr (dump1, ==, dump2);
+
+  unlink (journal);
+}
+
+static void
+test_lookup_by_value (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  g_autoptr(PermissionDbEntry) entry = NULL;
+  g_autoptr(GVariant) foo_data = g_variant_ref_sink (g_variant_new_string ("foo-data"));
+  g_autoptr(GVariant) bar_data = g_variant_ref_sink (g_variant_new_string ("bar-data"));
+
+  /* Index built from the gvdb */
+  db = create_test_db (TRUE);
+
+  {
+    g_auto(GStrv) ids = permission_db_list_ids_by_value (db, foo_data);
+    g_assert_cmpint (g_strv_length (ids), ==, 1);
+    g_assert_cmpstr (ids[0], ==, "foo");
+  }
+
+  /* Index kept up to date with changes */
+  entry = permission_db_entry_new (g_variant_new_string ("foo-data"));
+  permission_db_set_entry (db, "baz", entry);
+  permission_db_set_entry (db, "bar", NULL);
+
+  {
+    g_auto(GStrv) ids = permission_db_list_ids_by_value (db, foo_data);
+    g_assert_cmpint (g_strv_length (ids), ==, 2);
+    g_assert (g_strv_contains ((const char * const *) ids, "foo"));
+    g_assert (g_strv_contains ((const char * const *) ids, "baz"));
+  }
+
+  {
+    g_auto(GStrv) ids = permission_db_list_ids_by_value (db, bar_data);
+    g_assert (ids[0] == NULL);
+  }
+
+  permission_db_update (db);
+
+  {
+    g_auto(GStrv) ids = permission_db_list_ids_by_value (db, foo_data);
+    g_assert_cmpint (g_strv_length (ids), ==, 2);
+  }
+}
+
+static void
+test_has_app_id (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  g_autoptr(PermissionDb) db2 = NULL;
+  GError *error = NULL;
+  char tmpfile[] = "/tmp/testdbXXXXXX";
+  int fd;
+
+  db = create_test_db (TRUE);
+
+  fd = g_mkstemp (tmpfile);
+  close (fd);
+
+  permission_db_set_path (db, tmpfile);
+  permission_db_save_content (db, &error);
+  g_assert_no_error (error);
+
+  /* Lookups in the sorted on-disk arrays */
+  db2 = permission_db_new (tmpfile, TRUE, &error);
+  g_assert_no_error (error);
+
+  g_assert (permission_db_has_app_id (db2, "org.test.app", "foo"));
+  g_assert (permission_db_has_app_id (db2, "org.test.app", "bar"));
+  g_assert (permission_db_has_app_id (db2, "org.test.dapp", "bar"));
+  g_assert (!permission_db_has_app_id (db2, "org.test.dapp", "foo"));
+  g_assert (!permission_db_has_app_id (db2, "org.test.app", "baz"));
+  g_assert (!permission_db_has_app_id (db2, "org.test.eapp", "foo"));
+
+  /* And with changes on top */
+  permission_db_set_entry (db2, "bar", NULL);
+  g_assert (!permission_db_has_app_id (db2, "org.test.app", "bar"));
+  g_assert (!permission_db_has_app_id (db2, "org.test.dapp", "bar"));
+  g_assert (permission_db_has_app_id (db2, "org.test.app", "foo"));
+
+  unlink (tmpfile);
+}
+
 static void
 test_modify (void)
 {
@@ -347,6 +652,65 @@ test_modify (void)
   }
 }
 
+#define N_PERF_IDS 100000
+
+/* Grant, list and revoke access to many documents for one app between
+ * writeouts, which used to be quadratic in the number of documents */
+static void
+test_perf_many_ids (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  g_autoptr(PermissionDbEntry) entry = NULL;
+  g_autoptr(PermissionDbEntry) granted = NULL;
+  GError *error = NULL;
+  const char *permissions[] = { "read", NULL };
+  int i;
+
+  db = permission_db_new (NULL, FALSE, &error);
+  g_assert_no_error (error);
+
+  entry = permission_db_entry_new (g_variant_new_string ("data"));
+  granted = permission_db_entry_set_app_permissions (entry, "org.test.app", permissions);
+
+  g_test_timer_start ();
+  for (i = 0; i < N_PERF_IDS; i++)
+    {
+      g_autofree char *id = g_strdup_printf ("doc%d", i);
+      permission_db_set_entry (db, id, granted);
+    }
+  g_test_message ("Granted %d ids: %.3f s", N_PERF_IDS, g_test_timer_elapsed ());
+
+  g_test_timer_start ();
+  {
+    g_auto(GStrv) apps = permission_db_list_apps (db);
+    g_auto(GStrv) ids = permission_db_list_ids_by_app (db, "org.test.app");
+
+    g_assert_cmpint (g_strv_length (apps), ==, 1);
+    g_assert_cmpint (g_strv_length (ids), ==, N_PERF_IDS);
+  }
+  g_test_message ("Listed %d ids: %.3f s", N_PERF_IDS, g_test_timer_elapsed ());
+
+  permission_db_update (db);
+
+  g_test_timer_start ();
+  for (i = 0; i < N_PERF_IDS; i++)
+    {
+      g_autofree char *id = g_strdup_printf ("doc%d", i);
+      permission_db_set_entry (db, id, entry);
+    }
+  g_test_message ("Revoked %d ids: %.3f s", N_PERF_IDS, g_test_timer_elapsed ());
+
+  g_test_timer_start ();
+  {
+    g_auto(GStrv) apps = permission_db_list_apps (db);
+    g_auto(GStrv) ids = permission_db_list_ids_by_app (db, "org.test.app");
+
+    g_assert_cmpint (g_strv_length (apps), ==, 0);
+    g_assert_cmpint (g_strv_length (ids), ==, 0);
+  }
+  g_test_message ("Listed %d removed ids: %.3f s", N_PERF_IDS, g_test_timer_elapsed ());
+}
+
 int
 main (int argc, char **argv)
 {
@@ -354,7 +718,15 @@ main (int argc, char **argv)
 
   g_test_add_func ("/db/open", test_db_open);
   g_test_add_func ("/db/serialize", test_serialize);
+  g_test_add_func ("/db/journal", test_journal);
+  g_test_add_func ("/db/journal-async", test_journal_async);
+  g_test_add_func ("/db/journal-invalid-record", test_journal_invalid_record);
+  g_test_add_func ("/db/lookup-by-value", test_lookup_by_value);
+  g_test_add_func ("/db/has-app-id", test_has_app_id);
   g_test_add_func ("/db/modify", test_modify);
 
+  if (g_test_perf ())
+    g_test_add_func ("/db/perf/many-ids", test_perf_many_ids);
+
   return g_test_run ();
 }